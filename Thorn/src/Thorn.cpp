@@ -2,49 +2,229 @@
 #include <string>
 #include "Lexer.h"
 #include "Parser.h"
+#include "Simplifier.h"
 #include "Compiler.h"
 #include "Emulator.h"
+#include "MappedFile.h"
+#include "BytecodeFile.h"
 #include <fstream>
 #include <sstream>
 #include <filesystem>
+#include <chrono>
+#include <cstdlib>
+#include <format>
 
 using namespace Tusk;
 
-void run(const std::string& in, Emulator& emulator, ErrorHandler& handler) {
+struct Options {
+    uint32_t optimization_level{ 2 };
+    bool gc_stats{ false };
+    bool ic_stats{ false };
+    bool opt_stats{ false };
+    bool phase_times{ false };
+    bool lazy{ true };                              // Compile function bodies on their first call
+    bool strict{ false };                           // Parse every body up front even if it's compiled lazily
+    bool whole_program{ true };                     // False in the REPL, a later line could assign the globals of this one
+    bool cache_stats{ false };
+    std::string compile_to;                         // Save the compiled unit here instead of running it
+    std::string cache_to;                           // Save the compiled unit here and run it
+};
+
+// Milliseconds spent in each stage of the front end, reported by --phase-times
+struct PhaseTimes {
+    double parse{ 0 }, simplify{ 0 }, compile{ 0 };			// Lexing happens as the parser pulls tokens
+
+    static double since(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+void print_phase_times(const PhaseTimes& times, size_t source_size) {
+    double front_end = times.parse + times.simplify + times.compile;
+    std::cerr << "TIME: lex and parse " << times.parse << "ms, simplify " << times.simplify
+        << "ms, compile " << times.compile << "ms\n"
+        << "TIME: " << source_size / 1048576.0 / (front_end / 1000) << " MB/s through the front end\n";
+}
+
+void print_opt_stats(const OptimizerStats& stats) {
+    std::cerr << "OPT: " << stats.instructions_before << " instructions compiled, " << stats.instructions_after << " after optimizing\n"
+        << "OPT: " << stats.superinstructions << " superinstructions, " << stats.jumps_threaded << " jumps threaded, "
+        << stats.instructions_removed << " instructions removed\n";
+}
+
+void print_simplifier_stats(const SimplifierStats& stats) {
+    std::cerr << "OPT: " << stats.expressions_folded << " expressions folded, " << stats.constants_propagated << " constants propagated, "
+        << stats.branches_removed << " branches removed\n";
+}
+
+// Compiled scripts are cached in $XDG_CACHE_HOME/tusk, ~/.cache/tusk without it, or %LOCALAPPDATA%\tusk on
+// Windows. Empty if there is nowhere to put them
+std::filesystem::path cache_directory() {
+    if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+        return std::filesystem::path(xdg) / "tusk";
+#ifdef _WIN32
+    if (const char* local = std::getenv("LOCALAPPDATA"); local && *local)
+        return std::filesystem::path(local) / "tusk";
+#else
+    if (const char* home = std::getenv("HOME"); home && *home)
+        return std::filesystem::path(home) / ".cache" / "tusk";
+#endif
+    return {};
+}
+
+// A cached unit is named after everything that decides what the source compiles to: the source text, the
+// optimization level, the compiler version and the bytecode format. Loading it checks the format and the
+// globals again
+std::filesystem::path cache_path(std::string_view source, const Options& options) {
+    std::filesystem::path directory = cache_directory();
+    if (directory.empty())
+        return {};
+    uint64_t hash = 0xcbf29ce484222325;             // 64 bit FNV-1a
+    auto add = [&hash](std::string_view bytes) {
+        for (char c : bytes)
+            hash = (hash ^ (uint8_t)c) * 0x100000001b3;
+    };
+    add(std::format("{} {} {} {}\n", BytecodeFile::VERSION, INSTRUCTION_COUNT, Compiler::VERSION, options.optimization_level));
+    add(source);
+    return directory / std::format("{:016x}-{}.tkc", hash, source.size());
+}
+
+void print_errors(ErrorHandler& handler) {
+    for (const Error& error : handler.get_errors())
+        std::cout << ErrorHandler::string_basic_with_type(error) << '\n';
+    handler.clear();
+}
+
+// On a cache miss the script runs with lazy bodies like it does without the cache, so the first run starts as
+// soon as it would uncached. The bodies it never called are compiled once it's done and the whole unit is saved,
+// later runs load it and skip the front end entirely. The saved bodies were parsed late, so globals aren't
+// propagated into them (see Simplifier). With StartupBenchmark.txt, 3000 functions of which 10 are called:
+//   miss: output after about 20ms, 120ms until the rest is compiled and saved (was 150ms before any output)
+//   hit:  about 11ms, uncached with lazy bodies about 19ms
+void save_to_cache(Compiler& compiler, const Unit& unit, Emulator& emulator, ErrorHandler& handler, const Options& options) {
+    print_errors(handler);                          // The script's own, the ones below are not errors of this run
+    std::cout.flush();                              // Everything the script printed is out before the rest compiles
+    bool saved = compiler.compile_remaining();
+    handler.clear();                                // A body with errors is reported when it's called, it isn't cached
+    if (saved) {
+        ErrorHandler cache_errors;                  // A cache that can't be written is not an error of the script
+        std::error_code error;
+        std::filesystem::create_directories(std::filesystem::path(options.cache_to).parent_path(), error);
+        saved = BytecodeFile::save(options.cache_to, unit, emulator, cache_errors);
+    }
+    if (options.cache_stats)
+        std::cerr << "CACHE: miss, " << (saved ? "saved " : "could not save ") << options.cache_to << '\n';
+}
+
+void run(std::string_view in, Emulator& emulator, ErrorHandler& handler, const Options& options) {
+    PhaseTimes times;
+#ifdef TK_DEBUG
+    std::cout << "TOKENS:\n";
+    for (const Token& tok : Lexer(in, handler).analyze()) {
+        std::cout << (int)tok.type << '\n';
+    }
+    handler.clear();                                // The parser's lexer reports them again
+#endif
+    auto start = std::chrono::steady_clock::now();
+    // A saved unit needs every body, they are all compiled up front then. A cached one gets them after the run
+    bool lazy = options.lazy && options.compile_to.empty();
     Lexer lexer(in, handler);
-    const std::vector<Token>& tokens = lexer.analyze();
+    Parser parser(lexer, handler);
+    parser.set_preparse(lazy && !options.strict);   // Bodies are parsed when they are compiled
+    AST* ast = parser.parse();
+    times.parse = PhaseTimes::since(start);
     if (!handler.has_errors()) {
 #ifdef TK_DEBUG
-        std::cout << "TOKENS:\n";
-        for (const Token& tok : tokens) {
-            std::cout << (int)tok.type << '\n';
-        }
+        std::cout << "NODES:\n";
+        std::cout << ast->to_string() << '\n';
 #endif
 
-        Parser parser(tokens, handler);
-        const std::shared_ptr<AST>& ast = parser.parse();
-        if (!handler.has_errors()) {
-#ifdef TK_DEBUG
-            std::cout << "NODES:\n";
-            std::cout << ast->to_string() << '\n';
-#endif
+        start = std::chrono::steady_clock::now();
+        if (options.optimization_level > 0) {
+            Simplifier simplifier(emulator, options.whole_program);
+            simplifier.simplify(ast);
+            if (options.opt_stats)
+                print_simplifier_stats(simplifier.get_stats());
+        }
+        times.simplify = PhaseTimes::since(start);
 
-            Compiler compiler(ast, handler);
+        start = std::chrono::steady_clock::now();
+        Compiler compiler(ast, emulator, handler);
+        compiler.set_optimization_level(options.optimization_level);
+        compiler.set_lazy(lazy);
+        emulator.set_quickening(options.optimization_level > 0);
 
-            const Unit& byte_code = compiler.compile();
-            if (!handler.has_errors()) {
+        const Unit& byte_code = compiler.compile();
+        times.compile = PhaseTimes::since(start);
+        if (options.phase_times)
+            print_phase_times(times, in.size());
+        if (!handler.has_errors()) {
 #ifdef TK_DEBUG
-                std::cout << '\n';
+            std::cout << '\n';
 #endif
+            if (options.opt_stats)
+                print_opt_stats(compiler.get_optimizer_stats());
+            if (!options.compile_to.empty())
+                BytecodeFile::save(options.compile_to, byte_code, emulator, handler);
+            else {
                 emulator.run(&byte_code);
                 std::cout << '\n';
+                if (!options.cache_to.empty())
+                    save_to_cache(compiler, byte_code, emulator, handler, options);
             }
         }
     }
-    if(handler.has_errors())
-        for (const Error& error : handler.get_errors())
-            std::cout << ErrorHandler::string_basic_with_type(error) << '\n';
-    handler.clear();
+    print_errors(handler);
+}
+
+void run_loaded(const Unit& unit, Emulator& emulator, ErrorHandler& handler, const Options& options) {
+    emulator.set_quickening(options.optimization_level > 0);
+    emulator.run(&unit);
+    std::cout << '\n';
+    print_errors(handler);
+}
+
+// Runs a unit saved by --compile, nothing is lexed, parsed or compiled
+void run_bytecode(const std::string& path, Emulator& emulator, ErrorHandler& handler, const Options& options) {
+    std::shared_ptr<Unit> unit = BytecodeFile::load(path, emulator, handler);
+    if (unit)
+        run_loaded(*unit, emulator, handler, options);
+    else
+        print_errors(handler);
+}
+
+// Runs the cached unit of the source if there is a usable one, otherwise compiles the source and caches it
+void run_cached(std::string_view source, Emulator& emulator, ErrorHandler& handler, Options options) {
+    std::filesystem::path cached = cache_path(source, options);
+    if (!cached.empty()) {
+        auto start = std::chrono::steady_clock::now();
+        ErrorHandler cache_errors;                  // Missing, stale or damaged entries are compiled again
+        std::shared_ptr<Unit> unit = BytecodeFile::load(cached.string(), emulator, cache_errors);
+        if (unit) {
+            if (options.cache_stats)
+                std::cerr << "CACHE: hit, loaded " << cached.string() << " in " << PhaseTimes::since(start) << "ms\n";
+            run_loaded(*unit, emulator, handler, options);
+            return;
+        }
+        options.cache_to = cached.string();
+    }
+    else if (options.cache_stats)
+        std::cerr << "CACHE: no cache directory, set XDG_CACHE_HOME\n";
+    run(source, emulator, handler, options);
+}
+
+void print_gc_stats(const GCStats& stats) {
+    std::cerr << "GC: " << stats.minor_collections << " minor, " << stats.major_collections << " major collections\n"
+        << "GC: " << stats.objects_allocated << " objects (" << stats.bytes_allocated << " bytes) allocated, "
+        << stats.objects_freed << " freed, " << stats.objects_promoted << " promoted\n"
+        << "GC: " << stats.live_bytes << " bytes live after last collection\n"
+        << "GC: pauses total " << stats.total_pause_ms << "ms, max " << stats.max_pause_ms << "ms\n";
+}
+
+void print_cache_stats(const CacheStats& stats) {
+    uint64_t lookups = stats.hits + stats.misses + stats.megamorphic;
+    std::cerr << "IC: " << lookups << " member lookups, " << stats.hits << " hits, " << stats.misses << " misses, "
+        << stats.megamorphic << " megamorphic\n";
 }
 
 int main(int argc, char* argv[])
@@ -52,23 +232,98 @@ int main(int argc, char* argv[])
     ErrorHandler handler;
     Emulator emulator(handler);
 
-    if (argc > 1) {
-        std::ifstream file(argv[1]);
-        std::stringstream buffer;
+    std::string path;
+    Options options;
+    bool compile = false;
+    bool cache = true;                              // Scripts run from source are compiled once and cached
+    GCConfig gc_config = emulator.get_heap().get_config();
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--gc-stats")
+            options.gc_stats = true;
+        else if (arg == "--ic-stats")
+            options.ic_stats = true;
+        else if (arg == "--opt-stats")
+            options.opt_stats = true;
+        else if (arg == "--eager")
+            options.lazy = false;
+        else if (arg == "--strict")
+            options.strict = true;
+        else if (arg == "--phase-times")
+            options.phase_times = true;
+        else if (arg.size() == 3 && arg.starts_with("-O") && arg[2] >= '0' && arg[2] <= '2')
+            options.optimization_level = arg[2] - '0';
+        else if (arg == "--cache-stats")
+            options.cache_stats = true;
+        else if (arg == "--no-cache")
+            cache = false;
+        else if (arg == "--compile")
+            compile = true;
+        else if (arg == "-o" && i + 1 < argc)
+            options.compile_to = argv[++i];
+        else if (arg.starts_with("--gc-nursery="))
+            gc_config.nursery_size = std::stoull(arg.substr(13));
+        else if (arg.starts_with("--gc-growth="))
+            gc_config.heap_growth_factor = std::stod(arg.substr(12));
+        else if (arg.starts_with("--max-depth="))
+            emulator.set_max_call_depth(std::stoull(arg.substr(12)));
+        else if (arg.starts_with("--stack-size="))
+            emulator.set_stack_size(std::stoull(arg.substr(13)));
+        else
+            path = arg;
+    }
+    emulator.get_heap().set_config(gc_config);
+
+    if (compile && path.empty()) {
+        std::cout << "Nothing to compile\n";
+        return 1;
+    }
+    if (compile && options.compile_to.empty())
+        options.compile_to = std::filesystem::path(path).replace_extension(".tkc").string();
+    if (!compile)
+        options.compile_to.clear();
 
-        buffer << file.rdbuf();
-        run(buffer.str(), emulator, handler);
+    if (!path.empty()) {
+        MappedFile file(path);                      // Lexed in place, the source is never copied
+        if (!file.is_open()) {
+            std::cout << "Could not open '" << path << "'\n";
+            return 1;
+        }
+        if (BytecodeFile::is_bytecode(file.contents())) {
+            if (compile) {
+                std::cout << "'" << path << "' is already compiled\n";
+                return 1;
+            }
+            run_bytecode(path, emulator, handler, options);
+        }
+        else if (cache && !compile)
+            run_cached(file.contents(), emulator, handler, options);
+        else
+            run(file.contents(), emulator, handler, options);
+        if (options.gc_stats)
+            print_gc_stats(emulator.get_heap().get_stats());
+        if (options.ic_stats)
+            print_cache_stats(emulator.get_cache_stats());
+        if (options.opt_stats) {
+            const QuickenStats& stats = emulator.get_quicken_stats();
+            std::cerr << "OPT: " << stats.quickened << " sites quickened, " << stats.deoptimized << " deoptimized\n";
+            if (emulator.get_dispatch_count())
+                std::cerr << "OPT: " << emulator.get_dispatch_count() << " instructions dispatched\n";
+        }
     }
     else {
+        options.lazy = false;                       // The tree of a line is gone by the time a later line calls into it
+        options.whole_program = false;
         std::string in;
         while (true) {
             std::cout << "> ";
-            std::getline(std::cin, in);
+            if (!std::getline(std::cin, in))
+                break;                              // Input piped in has ended
 
             std::ifstream file(in);
             std::stringstream buffer;
 
-            run(in, emulator, handler);
+            run(in, emulator, handler, options);
         }
     }
 }
\ No newline at end of file
@@ -2,127 +2,327 @@
 #include "Bytecode.h"
 
 namespace Tusk {
+	InstructionLayout layout(Instruction instruction) {
+		switch (instruction) {
+		case Instruction::VAL_INDEX:
+		case Instruction::VAL_INT:
+		case Instruction::MAKE_GLOBAL:
+		case Instruction::GET_GLOBAL:
+		case Instruction::SET_GLOBAL:
+		case Instruction::SET_LOCAL:
+		case Instruction::GET_LOCAL:
+		case Instruction::MAKE_MEMBER:
+		case Instruction::CALL:
+		case Instruction::TAIL_CALL:
+		case Instruction::SET_LOCAL_POP:
+			return { 1, 1 };
+		case Instruction::VAL_INDEX_WIDE:
+		case Instruction::VAL_INT_WIDE:
+		case Instruction::MAKE_GLOBAL_WIDE:
+		case Instruction::GET_GLOBAL_WIDE:
+		case Instruction::SET_GLOBAL_WIDE:
+		case Instruction::SET_LOCAL_WIDE:
+		case Instruction::GET_LOCAL_WIDE:
+		case Instruction::MAKE_MEMBER_WIDE:
+		case Instruction::CALL_WIDE:
+		case Instruction::TAIL_CALL_WIDE:
+			return { 1, 3 };
+		case Instruction::GET_MEMBER:
+		case Instruction::GET_MEMBER_CACHED:
+		case Instruction::SET_MEMBER:
+		case Instruction::ADD_LOCALS:
+			return { 2, 1 };
+		case Instruction::GET_MEMBER_WIDE:
+		case Instruction::SET_MEMBER_WIDE:
+			return { 2, 3 };
+		case Instruction::METHOD_CALL:
+			return { 3, 1 };
+		case Instruction::METHOD_CALL_WIDE:
+			return { 3, 3 };
+		case Instruction::JUMP:
+		case Instruction::JUMP_IF_FALSE:
+			return { 0, 1, true };
+		case Instruction::LESS_CONST_JUMP_IF_FALSE:
+		case Instruction::LESS_INT_JUMP_IF_FALSE:
+			return { 1, 1, true };
+		default:
+			return {};
+		}
+	}
+
+	Instruction generic(Instruction instruction) {
+		switch (instruction) {
+		case Instruction::ADD_INT_INT:
+		case Instruction::ADD_F64:
+		case Instruction::CONCAT_STR:
+			return Instruction::ADD;
+		case Instruction::SUBTRACT_INT_INT:
+		case Instruction::SUBTRACT_F64:
+			return Instruction::SUBTRACT;
+		case Instruction::MULTIPLY_INT_INT:
+		case Instruction::MULTIPLY_F64:
+			return Instruction::MULTIPLY;
+		case Instruction::LESS_INT:
+			return Instruction::LESS;
+		case Instruction::LESS_EQUAL_INT:
+			return Instruction::LESS_EQUAL;
+		case Instruction::GREATER_INT:
+			return Instruction::GREATER;
+		case Instruction::GREATER_EQUAL_INT:
+			return Instruction::GREATER_EQUAL;
+		case Instruction::GET_MEMBER_CACHED:
+			return Instruction::GET_MEMBER;
+		default:
+			return instruction;
+		}
+	}
+
 	static std::string instruction_str(const std::string& name) {
 		return name + '\n';
 	}
 
-	static std::string complex_str(const std::string& name, uint8_t index) {
-		return name + " {" + std::to_string((int)index) + "}\n";
+	static std::string complex_str(const std::string& name, int64_t operand) {
+		return name + " {" + std::to_string(operand) + "}\n";
 	}
 
 	std::string Unit::disassemble(const Unit& unit) const {
 		std::string out = "";
-		int i = 0;
+		size_t i = 0;
 		uint8_t instruction;
+		bool wide = false;
+		auto operand = [&]() {								// Reads the next operand of the current instruction
+			uint32_t value = wide ? unit.read_wide(i + 1) : unit.code()[i + 1];
+			i += wide ? 3 : 1;
+			return value;
+		};
 		for (const Value& val : unit.m_values) {
-			if (val.is<std::shared_ptr<ValueObject>>() && val.get<std::shared_ptr<ValueObject>>()->get_type() == ObjectType::FUNCTION) {
-				out += "FUNCTION " + val.get_object<FunctionObject>()->function_name + "\n" + disassemble(*val.get_object<FunctionObject>()->code_unit.get()) + "\n\n";
+			if (val.is_object(ObjectType::FUNCTION)) {
+				const FunctionObject* function = val.get_object<FunctionObject>();
+				out += "FUNCTION " + function->function_name + "\n" + (function->code_unit ? disassemble(*function->code_unit) : "NOT COMPILED YET") + "\n\n";
 			}
 		}
-		while (i < unit.m_bytecode.size()) {
-			instruction = unit.m_bytecode[i];
+		while (i < unit.size()) {
+			instruction = unit.code()[i];
+			std::string prefix = std::to_string(i) + " ";
 			switch ((Instruction)instruction) {
 			case Instruction::ADD:
-				out += std::to_string(i) + " " + instruction_str("ADD");
+				out += prefix + instruction_str("ADD");
 				break;
 			case Instruction::SUBTRACT:
-				out += std::to_string(i) + " " + instruction_str("SUBTRACT");
+				out += prefix + instruction_str("SUBTRACT");
 				break;
 			case Instruction::MULTIPLY:
-				out += std::to_string(i) + " " + instruction_str("MULTIPLY");
+				out += prefix + instruction_str("MULTIPLY");
 				break;
 			case Instruction::DIVIDE:
-				out += std::to_string(i) + " " + instruction_str("DIVIDE");
+				out += prefix + instruction_str("DIVIDE");
 				break;
-			case Instruction::VAL_INDEX:
-				out += std::to_string(i) + " " + complex_str("INDEX", unit.m_bytecode[++i]);
+			case Instruction::MODULO:
+				out += prefix + instruction_str("MODULO");
+				break;
+			case Instruction::BIT_AND:
+				out += prefix + instruction_str("BIT_AND");
+				break;
+			case Instruction::BIT_OR:
+				out += prefix + instruction_str("BIT_OR");
+				break;
+			case Instruction::BIT_XOR:
+				out += prefix + instruction_str("BIT_XOR");
+				break;
+			case Instruction::SHIFT_LEFT:
+				out += prefix + instruction_str("SHIFT_LEFT");
+				break;
+			case Instruction::SHIFT_RIGHT:
+				out += prefix + instruction_str("SHIFT_RIGHT");
 				break;
 			case Instruction::POP:
-				out += std::to_string(i) + " " + instruction_str("POP");
+				out += prefix + instruction_str("POP");
 				break;
 			case Instruction::RETURN:
-				out += std::to_string(i) + " " + instruction_str("RETURN");
+				out += prefix + instruction_str("RETURN");
 				break;
 			case Instruction::LOG:
-				out += std::to_string(i) + " " + instruction_str("LOG");
+				out += prefix + instruction_str("LOG");
+				break;
+			case Instruction::LOGL:
+				out += prefix + instruction_str("LOGL");
 				break;
 			case Instruction::NEGATE:
-				out += std::to_string(i) + " " + instruction_str("NEGATE");
+				out += prefix + instruction_str("NEGATE");
 				break;
 			case Instruction::GREATER:
-				out += std::to_string(i) + " " + instruction_str("GREATER");
+				out += prefix + instruction_str("GREATER");
 				break;
 			case Instruction::GREATER_EQUAL:
-				out += std::to_string(i) + " " + instruction_str("GREATER_EQUAL");
+				out += prefix + instruction_str("GREATER_EQUAL");
 				break;
 			case Instruction::LESS:
-				out += std::to_string(i) + " " + instruction_str("LESS");
+				out += prefix + instruction_str("LESS");
 				break;
 			case Instruction::LESS_EQUAL:
-				out += std::to_string(i) + " " + instruction_str("LESS_EQUAL");
+				out += prefix + instruction_str("LESS_EQUAL");
 				break;
 			case Instruction::EQUAL:
-				out += std::to_string(i) + " " + instruction_str("EQUAL");
+				out += prefix + instruction_str("EQUAL");
 				break;
 			case Instruction::NOT_EQUAL:
-				out += std::to_string(i) + " " + instruction_str("NOT_EQUAL");
+				out += prefix + instruction_str("NOT_EQUAL");
 				break;
 			case Instruction::NOT:
-				out += std::to_string(i) + " " + instruction_str("NOT");
+				out += prefix + instruction_str("NOT");
 				break;
 			case Instruction::AND:
-				out += std::to_string(i) + " " + instruction_str("AND");
+				out += prefix + instruction_str("AND");
 				break;
 			case Instruction::OR:
-				out += std::to_string(i) + " " + instruction_str("OR");
+				out += prefix + instruction_str("OR");
 				break;
 			case Instruction::VOID:
-				out += std::to_string(i) + " " + instruction_str("VOID");
+				out += prefix + instruction_str("VOID");
+				break;
+			case Instruction::INHERIT:
+				out += prefix + instruction_str("INHERIT");
+				break;
+			case Instruction::VAL_INDEX:
+			case Instruction::VAL_INDEX_WIDE:
+				wide = (Instruction)instruction == Instruction::VAL_INDEX_WIDE;
+				out += prefix + complex_str("INDEX", operand());
 				break;
 			case Instruction::MAKE_GLOBAL:
-				out += std::to_string(i) + " " + instruction_str("MAKE_GLOBAL");
+			case Instruction::MAKE_GLOBAL_WIDE:
+				wide = (Instruction)instruction == Instruction::MAKE_GLOBAL_WIDE;
+				out += prefix + complex_str("MAKE_GLOBAL", operand());
 				break;
 			case Instruction::GET_GLOBAL:
-				out += std::to_string(i) + " " + instruction_str("GET_GLOBAL");
+			case Instruction::GET_GLOBAL_WIDE:
+				wide = (Instruction)instruction == Instruction::GET_GLOBAL_WIDE;
+				out += prefix + complex_str("GET_GLOBAL", operand());
 				break;
 			case Instruction::SET_GLOBAL:
-				out += std::to_string(i) + " " + instruction_str("SET_GLOBAL");
-				break;
-			case Instruction::JUMP_IF_FALSE:
-				i++;
-				out += std::to_string(i) + " " + complex_str("JUMP_IF_FALSE", m_values[unit.m_bytecode[i]].get<int64_t>());
-				break;
-			case Instruction::JUMP:
-				i++;
-				out += std::to_string(i) + " " + complex_str("JUMP", m_values[unit.m_bytecode[i]].get<int64_t>());
+			case Instruction::SET_GLOBAL_WIDE:
+				wide = (Instruction)instruction == Instruction::SET_GLOBAL_WIDE;
+				out += prefix + complex_str("SET_GLOBAL", operand());
 				break;
 			case Instruction::GET_LOCAL:
-				i++;
-				out += std::to_string(i) + " " + instruction_str("GET_LOCAL");
+			case Instruction::GET_LOCAL_WIDE:
+				wide = (Instruction)instruction == Instruction::GET_LOCAL_WIDE;
+				out += prefix + complex_str("GET_LOCAL", operand());
 				break;
 			case Instruction::SET_LOCAL:
-				i++;
-				out += std::to_string(i) + " " + instruction_str("SET_LOCAL");
+			case Instruction::SET_LOCAL_WIDE:
+				wide = (Instruction)instruction == Instruction::SET_LOCAL_WIDE;
+				out += prefix + complex_str("SET_LOCAL", operand());
+				break;
+			case Instruction::MAKE_MEMBER:
+			case Instruction::MAKE_MEMBER_WIDE:
+				wide = (Instruction)instruction == Instruction::MAKE_MEMBER_WIDE;
+				out += prefix + complex_str("MAKE_MEMBER", operand());
+				break;
+			case Instruction::LOG_POP:
+				out += prefix + instruction_str("LOG_POP");
+				break;
+			case Instruction::LOGL_POP:
+				out += prefix + instruction_str("LOGL_POP");
+				break;
+			case Instruction::RETURN_VOID:
+				out += prefix + instruction_str("RETURN_VOID");
+				break;
+			case Instruction::SET_LOCAL_POP:
+				out += prefix + complex_str("SET_LOCAL_POP", unit.code()[++i]);
+				break;
+			case Instruction::ADD_LOCALS:
+				out += prefix + "ADD_LOCALS {" + std::to_string(unit.code()[i + 1]) + ", " + std::to_string(unit.code()[i + 2]) + "}\n";
+				i += 2;
+				break;
+			case Instruction::LESS_CONST_JUMP_IF_FALSE:
+				out += prefix + "LESS_CONST_JUMP_IF_FALSE {" + std::to_string(unit.code()[i + 1]) + ", " + std::to_string((int64_t)(i + 5) + to_offset(unit.read_wide(i + 2))) + "}\n";
+				i += 4;
+				break;
+			case Instruction::LESS_INT_JUMP_IF_FALSE:
+				out += prefix + "LESS_INT_JUMP_IF_FALSE {" + std::to_string((int8_t)unit.code()[i + 1]) + ", " + std::to_string((int64_t)(i + 5) + to_offset(unit.read_wide(i + 2))) + "}\n";
+				i += 4;
+				break;
+			case Instruction::ADD_INT_INT:
+				out += prefix + instruction_str("ADD_INT_INT");
+				break;
+			case Instruction::ADD_F64:
+				out += prefix + instruction_str("ADD_F64");
+				break;
+			case Instruction::CONCAT_STR:
+				out += prefix + instruction_str("CONCAT_STR");
+				break;
+			case Instruction::SUBTRACT_INT_INT:
+				out += prefix + instruction_str("SUBTRACT_INT_INT");
+				break;
+			case Instruction::SUBTRACT_F64:
+				out += prefix + instruction_str("SUBTRACT_F64");
+				break;
+			case Instruction::MULTIPLY_INT_INT:
+				out += prefix + instruction_str("MULTIPLY_INT_INT");
+				break;
+			case Instruction::MULTIPLY_F64:
+				out += prefix + instruction_str("MULTIPLY_F64");
+				break;
+			case Instruction::LESS_INT:
+				out += prefix + instruction_str("LESS_INT");
+				break;
+			case Instruction::LESS_EQUAL_INT:
+				out += prefix + instruction_str("LESS_EQUAL_INT");
+				break;
+			case Instruction::GREATER_INT:
+				out += prefix + instruction_str("GREATER_INT");
+				break;
+			case Instruction::GREATER_EQUAL_INT:
+				out += prefix + instruction_str("GREATER_EQUAL_INT");
+				break;
+			case Instruction::VAL_INT:
+				out += prefix + complex_str("INT", (int8_t)unit.code()[++i]);
+				break;
+			case Instruction::VAL_INT_WIDE:
+				out += prefix + complex_str("INT", to_offset(unit.read_wide(i + 1)));
+				i += 3;
+				break;
+			case Instruction::JUMP_IF_FALSE:
+				out += prefix + complex_str("JUMP_IF_FALSE", (int64_t)(i + 4) + to_offset(unit.read_wide(i + 1)));
+				i += 3;
+				break;
+			case Instruction::JUMP:
+				out += prefix + complex_str("JUMP", (int64_t)(i + 4) + to_offset(unit.read_wide(i + 1)));
+				i += 3;
 				break;
 			case Instruction::CALL:
-				i++;
-				out += std::to_string(i) + " " + instruction_str("CALL");
+			case Instruction::CALL_WIDE:
+				wide = (Instruction)instruction == Instruction::CALL_WIDE;
+				out += prefix + complex_str("CALL", operand());
+				break;
+			case Instruction::TAIL_CALL:
+			case Instruction::TAIL_CALL_WIDE:
+				wide = (Instruction)instruction == Instruction::TAIL_CALL_WIDE;
+				out += prefix + complex_str("TAIL_CALL", operand());
 				break;
 			case Instruction::GET_MEMBER:
-				i++;
-				out += std::to_string(i) + " " + instruction_str("GET_MEMBER");
+			case Instruction::GET_MEMBER_WIDE:
+				wide = (Instruction)instruction == Instruction::GET_MEMBER_WIDE;
+				out += prefix + complex_str("GET_MEMBER", operand());
+				operand();
+				break;
+			case Instruction::GET_MEMBER_CACHED:
+				wide = false;
+				out += prefix + complex_str("GET_MEMBER_CACHED", operand());
+				operand();
 				break;
 			case Instruction::SET_MEMBER:
-				i++;
-				out += std::to_string(i) + " " + instruction_str("SET_MEMBER");
+			case Instruction::SET_MEMBER_WIDE:
+				wide = (Instruction)instruction == Instruction::SET_MEMBER_WIDE;
+				out += prefix + complex_str("SET_MEMBER", operand());
+				operand();
 				break;
 			case Instruction::METHOD_CALL:
-				i++;
-				out += std::to_string(i) + " " + instruction_str("METHOD_CALL");
-				break;
-			case Instruction::INHERIT:
-				i++;
-				out += std::to_string(i) + " " + instruction_str("INHERIT");
+			case Instruction::METHOD_CALL_WIDE:
+				wide = (Instruction)instruction == Instruction::METHOD_CALL_WIDE;
+				operand();
+				out += prefix + complex_str("METHOD_CALL", operand());
+				operand();
 				break;
 			default:
 				break;
@@ -4,13 +4,27 @@
 #include "Value.h"
 
 namespace Tusk {
+	class MappedFile;
+
+	// Instructions with operands are directly followed by their _WIDE variant. The plain variant has one byte
+	// operands, the wide one three byte operands (see Unit::read_wide). Jumps always have a three byte signed
+	// offset, relative to the end of the jump instruction.
 	enum class Instruction : uint8_t {
 		ADD,
 		SUBTRACT,
 		MULTIPLY,
 		DIVIDE,
+		MODULO,
+		BIT_AND,
+		BIT_OR,
+		BIT_XOR,
+		SHIFT_LEFT,
+		SHIFT_RIGHT,
 		RETURN,
 		VAL_INDEX,
+		VAL_INDEX_WIDE,
+		VAL_INT,										// Small integer stored in the operand, signed
+		VAL_INT_WIDE,
 		POP,
 		LOG,
 		LOGL,
@@ -26,18 +40,108 @@ namespace Tusk {
 		OR,
 		VOID,
 		MAKE_GLOBAL,
+		MAKE_GLOBAL_WIDE,
 		GET_GLOBAL,
+		GET_GLOBAL_WIDE,
 		SET_GLOBAL,
+		SET_GLOBAL_WIDE,
 		JUMP,
 		JUMP_IF_FALSE,
 		SET_LOCAL,
+		SET_LOCAL_WIDE,
 		GET_LOCAL,
+		GET_LOCAL_WIDE,
 		CALL,
+		CALL_WIDE,
+		TAIL_CALL,										// CALL that replaces the frame of the function it returns from
+		TAIL_CALL_WIDE,
 		GET_MEMBER,
+		GET_MEMBER_WIDE,
 		SET_MEMBER,
+		SET_MEMBER_WIDE,
 		MAKE_MEMBER,
+		MAKE_MEMBER_WIDE,
 		METHOD_CALL,
+		METHOD_CALL_WIDE,
 		INHERIT,
+
+		// Superinstructions, only emitted by the Optimizer. Their operands are always one byte
+		LOG_POP,
+		LOGL_POP,
+		RETURN_VOID,
+		SET_LOCAL_POP,
+		ADD_LOCALS,										// Adds two locals, operands are both slots
+		LESS_CONST_JUMP_IF_FALSE,						// Compares with a constant and jumps if not less, operands are the constant and the offset
+		LESS_INT_JUMP_IF_FALSE,							// Same with a small integer instead of a constant
+
+		// Quickened instructions, only written by the Emulator while it runs. Each handles one combination of
+		// operand types and rewrites itself back into the generic instruction when it meets anything else
+		ADD_INT_INT,
+		ADD_F64,
+		CONCAT_STR,
+		SUBTRACT_INT_INT,
+		SUBTRACT_F64,
+		MULTIPLY_INT_INT,
+		MULTIPLY_F64,
+		LESS_INT,
+		LESS_EQUAL_INT,
+		GREATER_INT,
+		GREATER_EQUAL_INT,
+		GET_MEMBER_CACHED,								// Field read through a monomorphic inline cache, operands of GET_MEMBER. Must stay last
+	};
+
+	inline constexpr size_t INSTRUCTION_COUNT = (size_t)Instruction::GET_MEMBER_CACHED + 1;
+
+	inline Instruction wide(Instruction instruction) { return (Instruction)((uint8_t)instruction + 1); }
+
+	// What follows an instruction in the code
+	struct InstructionLayout {
+		uint32_t operand_count{ 0 };
+		uint32_t operand_size{ 1 };							// Bytes per operand
+		bool jump{ false };									// Followed by a three byte offset
+
+		size_t size() const { return 1 + operand_count * operand_size + (jump ? 3 : 0); }
+	};
+
+	InstructionLayout layout(Instruction instruction);
+	Instruction generic(Instruction instruction);			// What a quickened instruction was rewritten from, others stay as they are
+
+
+	// Per instruction cache of a member lookup, keyed on the shape of the instance. Holds up to MAX_ENTRIES
+	// shapes (polymorphic), after that the site is marked megamorphic and always takes the slow path.
+	struct InlineCache {
+		static constexpr uint32_t MAX_ENTRIES = 4;
+
+		enum class Kind : uint8_t {
+			FIELD,											// Member is the field at slot
+			METHOD,											// Member is a method of the class, stored in method
+			TRANSITION										// Setting the member adds a field: move to next_shape, store at slot
+		};
+
+		struct Entry {
+			uint32_t shape_id{ 0 };
+			Kind kind{ Kind::FIELD };
+			uint32_t slot{ 0 };
+			Shape* next_shape{ nullptr };
+			Value method;
+		};
+
+		Entry entries[MAX_ENTRIES];
+		uint32_t count{ 0 };
+		bool megamorphic{ false };
+
+		const Entry* find(uint32_t shape_id) const {
+			for (uint32_t i = 0; i < count; i++)
+				if (entries[i].shape_id == shape_id)
+					return &entries[i];
+			return nullptr;
+		}
+		void add(const Entry& entry) {
+			if (count == MAX_ENTRIES)
+				megamorphic = true;
+			else
+				entries[count++] = entry;
+		}
 	};
 
 	struct Unit {
@@ -45,16 +149,74 @@ namespace Tusk {
 		Unit() = default;
 		Unit(size_t vec_size) { m_bytecode.reserve(vec_size); }
 
+		static constexpr uint32_t MAX_OPERAND = 0xFFFFFF;	// Largest operand of a wide instruction
+		static constexpr int32_t MAX_OFFSET = 0x7FFFFF;	// Largest jump in either direction
+
 		void write_byte(uint8_t byte) { m_bytecode.push_back(byte); }
-		uint8_t write_value(Value value) { m_values.push_back(value); return m_values.size() - 1; }
+		void write_wide(uint32_t operand) {
+			m_bytecode.push_back((uint8_t)operand);
+			m_bytecode.push_back((uint8_t)(operand >> 8));
+			m_bytecode.push_back((uint8_t)(operand >> 16));
+		}
+		void patch_wide(size_t index, uint32_t operand) {	// Overwrites an operand written by write_wide
+			m_bytecode[index] = (uint8_t)operand;
+			m_bytecode[index + 1] = (uint8_t)(operand >> 8);
+			m_bytecode[index + 2] = (uint8_t)(operand >> 16);
+		}
+		uint32_t write_value(Value value) { m_values.push_back(value); return (uint32_t)(m_values.size() - 1); }
+		uint32_t write_symbol(StringObject* symbol) {		// Every interned string gets one constant per unit
+			auto found = m_symbols.find(symbol);
+			if (found != m_symbols.end())
+				return found->second;
+			return m_symbols[symbol] = write_value(Value(symbol));
+		}
 		std::vector<Value>& get_values() { return m_values; }
-		uint8_t operator[](uint8_t index) const { if (index < m_bytecode.size()) return m_bytecode[index]; }
+		uint8_t operator[](size_t index) const { return code()[index]; }
+		const uint8_t* code() const { return m_mapped_code ? m_mapped_code : m_bytecode.data(); }
+		void rewrite(size_t index, Instruction instruction) const {	// Quickening
+			(m_mapped_code ? m_mapped_code : m_bytecode.data())[index] = (uint8_t)instruction;
+		}
+		uint8_t& type_feedback(size_t index) const {		// Operand types the instruction at index has seen so far
+			if (m_type_feedback.size() != size())
+				m_type_feedback.resize(size());
+			return m_type_feedback[index];
+		}
+		size_t size() const { return m_mapped_code ? m_mapped_size : m_bytecode.size(); }
+		uint32_t get_max_stack() const { return m_max_stack; }
+		void set_max_stack(uint32_t values) { m_max_stack = values; }
+		void set_code(std::vector<uint8_t>&& code) { m_bytecode = std::move(code); }
+		// Runs the code where it lies in a file mapped copy-on-write (see BytecodeFile), quickening only copies the pages it writes to
+		void set_mapped_code(uint8_t* code, size_t size, std::shared_ptr<MappedFile> file) {
+			m_mapped_code = code;
+			m_mapped_size = size;
+			m_file = std::move(file);
+		}
+		uint32_t read_wide(size_t index) const {
+			const uint8_t* bytes = code();
+			return bytes[index] | (bytes[index + 1] << 8) | (bytes[index + 2] << 16);
+		}
+		static int32_t to_offset(uint32_t operand) {		// Sign extends a 24 bit operand
+			return (int32_t)(operand << 8) >> 8;
+		}
 		const std::vector<Value>& get_values() const { return m_values; }
-		int64_t index() const { return m_bytecode.size(); }
+		uint32_t add_cache() {								// Returns the operand of a new inline cache
+			m_caches.emplace_back();
+			return (uint32_t)(m_caches.size() - 1);
+		}
+		InlineCache& get_cache(uint32_t index) const { return m_caches[index]; }
+		const std::vector<InlineCache>& get_caches() const { return m_caches; }
+		size_t index() const { return m_bytecode.size(); }
 		std::string disassemble(const Unit& unit) const;
 		std::string disassemble() const;
 	private:
-		std::vector<uint8_t> m_bytecode;
+		mutable std::vector<uint8_t> m_bytecode;			// The emulator quickens instructions in place
+		uint8_t* m_mapped_code{ nullptr };					// Used instead of m_bytecode when set
+		size_t m_mapped_size{ 0 };
+		std::shared_ptr<MappedFile> m_file;					// Keeps the mapping alive while the unit is
 		std::vector<Value> m_values;
+		std::unordered_map<const StringObject*, uint32_t> m_symbols;	// Constant index of each interned string
+		uint32_t m_max_stack{ 0 };							// Most values the code has on the stack above its frame at once
+		mutable std::vector<InlineCache> m_caches;			// Runtime state, filled while the unit executes
+		mutable std::vector<uint8_t> m_type_feedback;		// Runtime state, one entry per byte of code
 	};
 }
\ No newline at end of file
@@ -0,0 +1,319 @@
+#include "pch.h"
+#include "BytecodeFile.h"
+#include "MappedFile.h"
+#include "Optimizer.h"
+#include <bit>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <unordered_set>
+
+namespace Tusk::BytecodeFile {
+	static_assert(std::endian::native == std::endian::little, "Saved units are read in place, only little endian is supported");
+
+	static constexpr char MAGIC[3] = { 'T', 'K', 'C' };
+
+	enum class Constant : uint8_t {
+		INT,
+		DOUBLE,
+		BOOL,
+		VOID,
+		STRING,
+		FUNCTION,
+		CLASS,
+		ENUM
+	};
+
+	class Writer {
+	public:
+		void bytes(const void* data, size_t size) { m_out.append(static_cast<const char*>(data), size); }
+		template<typename T>
+		void number(T value) { bytes(&value, sizeof(T)); }
+		void string(const std::string& str) {
+			number((uint32_t)str.size());
+			bytes(str.data(), str.size());
+		}
+		void strings(const std::vector<std::string>& strs) {
+			number((uint32_t)strs.size());
+			for (const std::string& str : strs)
+				string(str);
+		}
+		const std::string& get() const { return m_out; }
+	private:
+		std::string m_out;
+	};
+
+	// Every read checks that it stays inside the file, a truncated or damaged file fails instead of reading past it
+	class Reader {
+	public:
+		Reader(char* data, size_t size) : m_data{ data }, m_size{ size } {}
+
+		char* bytes(size_t size) {
+			if (!m_ok || size > m_size - m_position) {
+				m_ok = false;
+				return nullptr;
+			}
+			char* start = m_data + m_position;
+			m_position += size;
+			return start;
+		}
+		template<typename T>
+		T number() {
+			T value{};
+			if (const char* start = bytes(sizeof(T)))
+				std::memcpy(&value, start, sizeof(T));
+			return value;
+		}
+		std::string string() {
+			uint32_t size = number<uint32_t>();
+			const char* start = bytes(size);
+			return start ? std::string(start, size) : std::string();
+		}
+		std::vector<std::string> strings() {
+			uint32_t count = number<uint32_t>();
+			std::vector<std::string> strs;
+			for (uint32_t i = 0; i < count && m_ok; i++)
+				strs.push_back(string());
+			return strs;
+		}
+		bool ok() const { return m_ok; }
+		bool at_end() const { return m_position == m_size; }
+	private:
+		char* m_data;
+		size_t m_size;
+		size_t m_position{ 0 };
+		bool m_ok{ true };
+	};
+
+	bool is_bytecode(std::string_view contents) {
+		return contents.starts_with(std::string_view(MAGIC, sizeof(MAGIC)));
+	}
+
+	static void write_unit(Writer& out, const Unit& unit);
+
+	static void write_constant(Writer& out, const Value& value) {
+		switch (value.get_type()) {
+		case ValueType::INT:
+			out.number(Constant::INT);
+			out.number(value.get<int64_t>());
+			return;
+		case ValueType::DOUBLE:
+			out.number(Constant::DOUBLE);
+			out.number(value.get<double>());
+			return;
+		case ValueType::BOOL:
+			out.number(Constant::BOOL);
+			out.number((uint8_t)value.get<bool>());
+			return;
+		case ValueType::VOID:
+			out.number(Constant::VOID);
+			return;
+		default:
+			break;
+		}
+		switch (value.get<ValueObject*>()->get_type()) {
+		case ObjectType::INTEGER:							// Boxed or not, it's read back as the same integer
+			out.number(Constant::INT);
+			out.number(value.as_int());
+			break;
+		case ObjectType::STRING:
+			out.number(Constant::STRING);
+			out.string(value.get_object<StringObject>()->get());
+			break;
+		case ObjectType::FUNCTION: {
+			FunctionObject* function = value.get_object<FunctionObject>();
+			out.number(Constant::FUNCTION);
+			out.string(function->function_name);
+			out.number(function->arg_count);
+			write_unit(out, *function->code_unit);
+			break;
+		}
+		case ObjectType::CLASS:
+			out.number(Constant::CLASS);
+			out.string(value.get_object<ClassObject>()->class_name);
+			break;
+		case ObjectType::ENUM: {
+			EnumObject* enum_obj = value.get_object<EnumObject>();
+			out.number(Constant::ENUM);
+			out.string(enum_obj->name);
+			out.strings(enum_obj->values);
+			break;
+		}
+		default:											// The compiler makes no other constants
+			break;
+		}
+	}
+
+	static void write_unit(Writer& out, const Unit& unit) {
+		out.number((uint32_t)unit.size());
+		out.number((uint32_t)unit.get_caches().size());
+		out.number((uint32_t)unit.get_values().size());
+		std::vector<uint8_t> code(unit.code(), unit.code() + unit.size());
+		for (size_t i = 0; i < code.size(); i += layout((Instruction)code[i]).size())
+			code[i] = (uint8_t)generic((Instruction)code[i]);	// Type feedback isn't saved, the file always starts out generic
+		out.bytes(code.data(), code.size());
+		for (const Value& value : unit.get_values())
+			write_constant(out, value);
+	}
+
+	// First function whose body is still waiting for its first call, see Compiler::set_lazy
+	static const FunctionObject* find_uncompiled(const Unit& unit) {
+		for (const Value& value : unit.get_values()) {
+			if (!value.is_object(ObjectType::FUNCTION))
+				continue;
+			const FunctionObject* function = value.get_object<FunctionObject>();
+			if (!function->code_unit)
+				return function;
+			if (const FunctionObject* nested = find_uncompiled(*function->code_unit))
+				return nested;
+		}
+		return nullptr;
+	}
+
+	bool save(const std::string& path, const Unit& unit, const Emulator& emulator, ErrorHandler& handler) {
+		if (const FunctionObject* function = find_uncompiled(unit)) {
+			handler.report_error("Function '" + function->function_name + "' has not been compiled and can't be saved", {}, ErrorType::COMPILE_ERROR);
+			return false;
+		}
+		Writer out;
+		out.bytes(MAGIC, sizeof(MAGIC));
+		out.number(VERSION);
+		out.number((uint32_t)INSTRUCTION_COUNT);
+		out.strings(emulator.get_global_names());			// The code refers to globals by slot
+		write_unit(out, unit);
+
+		// Written next to the destination and renamed over it, so a file that is being read, mapped or written by
+		// another process at the same time is never seen half written
+		std::string temporary = std::format("{}.{:08x}.tmp", path, std::random_device{}());
+		std::ofstream file(temporary, std::ios::binary);
+		file.write(out.get().data(), out.get().size());
+		file.close();
+		std::error_code error;
+		if (file)
+			std::filesystem::rename(temporary, path, error);
+		if (!file || error) {
+			std::filesystem::remove(temporary, error);
+			handler.report_error("Could not write '" + path + "'", {}, ErrorType::COMPILE_ERROR);
+			return false;
+		}
+		return true;
+	}
+
+	// Shared by every unit read from one file
+	struct ReadState {
+		Emulator& emulator;
+		std::shared_ptr<MappedFile> file;
+		size_t global_count;
+	};
+
+	static std::shared_ptr<Unit> read_unit(Reader& in, ReadState& state, uint32_t frame_size);
+
+	static bool read_constant(Reader& in, ReadState& state, Unit& unit) {
+		Heap& heap = state.emulator.get_heap();
+		switch (in.number<Constant>()) {
+		case Constant::INT:
+			unit.write_value(heap.make_int(in.number<int64_t>()));
+			break;
+		case Constant::DOUBLE:
+			unit.write_value(Value(in.number<double>()));
+			break;
+		case Constant::BOOL:
+			unit.write_value(Value(in.number<uint8_t>() != 0));
+			break;
+		case Constant::VOID:
+			unit.write_value(Value());
+			break;
+		case Constant::STRING:
+			unit.write_symbol(heap.intern(in.string()));
+			break;
+		case Constant::FUNCTION: {
+			FunctionObject* function = heap.allocate<FunctionObject>(in.string());
+			function->arg_count = in.number<uint32_t>();
+			function->code_unit = read_unit(in, state, function->arg_count + 1);	// The function and its arguments
+			if (!function->code_unit)
+				return false;
+			unit.write_value(Value(function));
+			break;
+		}
+		case Constant::CLASS:
+			unit.write_value(Value(heap.allocate<ClassObject>(in.string())));
+			break;
+		case Constant::ENUM: {
+			std::string name = in.string();
+			unit.write_value(Value(heap.allocate<EnumObject>(name, in.strings())));
+			break;
+		}
+		default:
+			return false;
+		}
+		return in.ok();
+	}
+
+	static std::shared_ptr<Unit> read_unit(Reader& in, ReadState& state, uint32_t frame_size) {
+		uint32_t code_size = in.number<uint32_t>();
+		uint32_t cache_count = in.number<uint32_t>();
+		uint32_t constant_count = in.number<uint32_t>();
+		uint8_t* code = reinterpret_cast<uint8_t*>(in.bytes(code_size));
+		if (!code || cache_count > code_size)				// Every cache belongs to an instruction
+			return nullptr;
+
+		auto unit = std::make_shared<Unit>();
+		unit->set_mapped_code(code, code_size, state.file);
+		for (uint32_t i = 0; i < cache_count; i++)
+			unit->add_cache();
+		for (uint32_t i = 0; i < constant_count; i++)
+			if (!read_constant(in, state, *unit))
+				return nullptr;
+		// Nothing in the file is trusted, the operands, jumps and stack use are checked as if the code was foreign
+		if (!Optimizer().verify(*unit, frame_size, state.global_count))
+			return nullptr;
+		return unit;
+	}
+
+	std::shared_ptr<Unit> load(const std::string& path, Emulator& emulator, ErrorHandler& handler) {
+		// Copy-on-write, quickening rewrites the code in place without touching the file
+		auto file = std::make_shared<MappedFile>(path, true);
+		if (!file->is_open()) {
+			handler.report_error("Could not open '" + path + "'", {}, ErrorType::COMPILE_ERROR);
+			return nullptr;
+		}
+		if (!is_bytecode(file->contents())) {
+			handler.report_error("'" + path + "' is not a compiled Tusk file", {}, ErrorType::COMPILE_ERROR);
+			return nullptr;
+		}
+
+		Reader in(file->data(), file->size());
+		in.bytes(sizeof(MAGIC));
+		uint8_t version = in.number<uint8_t>();
+		uint32_t instruction_count = in.number<uint32_t>();
+		if (version != VERSION || instruction_count != INSTRUCTION_COUNT) {
+			handler.report_error("'" + path + "' was compiled by another version of Tusk", {}, ErrorType::COMPILE_ERROR);
+			return nullptr;
+		}
+
+		std::vector<std::string> globals = in.strings();
+		ReadState state{ emulator, file, globals.size() };
+		std::shared_ptr<Unit> unit = in.ok() ? read_unit(in, state, 0) : nullptr;	// The script frame starts empty
+		if (!unit || !in.at_end()) {
+			handler.report_error("'" + path + "' is damaged", {}, ErrorType::COMPILE_ERROR);
+			return nullptr;
+		}
+
+		// Only declared once everything checks out, a file that can't be used leaves the emulator as it was
+		const std::vector<std::string>& declared = emulator.get_global_names();
+		std::unordered_set<std::string_view> added;
+		for (uint32_t slot = 0; slot < globals.size(); slot++)
+			if (slot < declared.size() ? declared[slot] != globals[slot] : emulator.find_global(globals[slot]) != -1) {
+				handler.report_error("'" + path + "' was compiled with other globals declared", {}, ErrorType::COMPILE_ERROR);
+				return nullptr;
+			}
+			else if (slot >= declared.size() && !added.insert(globals[slot]).second) {
+				handler.report_error("'" + path + "' is damaged", {}, ErrorType::COMPILE_ERROR);	// Each name must get its own slot
+				return nullptr;
+			}
+		for (const std::string& name : globals)
+			emulator.declare_global(name);
+		return unit;
+	}
+}
\ No newline at end of file
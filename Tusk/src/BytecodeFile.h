@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <memory>
+#include "Bytecode.h"
+#include "Emulator.h"
+#include "Error.h"
+
+// Compiled units saved to disk (.tkc), so a script can run again without being lexed, parsed and compiled.
+// Everything is little endian:
+//   header:   "TKC", format version, instruction count, then the names of the global slots, in slot order
+//   unit:     code size, inline cache count, constant count, the code, then each constant
+//   constant: kind byte followed by an int, a double, a bool, a string, a function (name, argument count and
+//             its unit), a class (name) or an enum (name and value names)
+// Strings and name lists are a 32 bit count followed by their contents. Quickened instructions are saved in
+// their generic form, inline caches and type feedback start out empty again. Loading checks the code like
+// Optimizer::verify describes and works out how much stack it needs again.
+namespace Tusk::BytecodeFile {
+	inline constexpr uint8_t VERSION = 3;
+
+	bool is_bytecode(std::string_view contents);			// Starts like a saved unit
+
+	// Saves a unit compiled for emulator, replacing the file in one step. Every function in it must have been
+	// compiled. Returns false and reports an error if it can't be written
+	bool save(const std::string& path, const Unit& unit, const Emulator& emulator, ErrorHandler& handler);
+
+	// Loads a saved unit into emulator and declares the globals it uses. The code is run where it lies in the
+	// mapped file. Returns nullptr and reports an error if the file can't be read or was saved by another version
+	std::shared_ptr<Unit> load(const std::string& path, Emulator& emulator, ErrorHandler& handler);
+}
\ No newline at end of file
@@ -1,6 +1,5 @@
 #include "pch.h"
 #include "Compiler.h"
-#include "Standard.h"
 
 namespace Tusk {
 	void Compiler::write(uint8_t byte) {
@@ -22,137 +21,201 @@ namespace Tusk {
 		
 	}
 
-	uint8_t Compiler::add_constant(Value value) {
+	void Compiler::write_op(Instruction instruction, std::initializer_list<uint32_t> operands) {
+		bool is_wide = false;
+		for (uint32_t operand : operands) {
+			if (operand > Unit::MAX_OPERAND)
+				m_error_handler.report_error("Operand does not fit in an instruction", {}, ErrorType::COMPILE_ERROR);
+			is_wide |= operand > UINT8_MAX;
+		}
+		Unit* unit = current_unit();
+		unit->write_byte((uint8_t)(is_wide ? wide(instruction) : instruction));
+		for (uint32_t operand : operands) {
+			if (is_wide)
+				unit->write_wide(operand);
+			else
+				unit->write_byte((uint8_t)operand);
+		}
+	}
+
+	void Compiler::write_int(int64_t value) {
+		if (value >= INT8_MIN && value <= INT8_MAX)
+			write((uint8_t)Instruction::VAL_INT, (uint8_t)value);
+		else if (value >= -Unit::MAX_OFFSET - 1 && value <= Unit::MAX_OFFSET) {
+			write((uint8_t)Instruction::VAL_INT_WIDE);
+			current_unit()->write_wide((uint32_t)value);
+		}
+		else
+			write_op(Instruction::VAL_INDEX, { add_constant(m_heap.make_int(value)) });
+	}
+
+	size_t Compiler::write_jump(Instruction instruction) {
+		write((uint8_t)instruction);
+		current_unit()->write_wide(0);
+		return current_unit()->index() - 3;
+	}
+
+	void Compiler::patch_jump(size_t offset_index) {
+		int64_t offset = (int64_t)current_unit()->index() - (int64_t)(offset_index + 3);
+		if (offset > Unit::MAX_OFFSET)
+			m_error_handler.report_error("Jump is too long", {}, ErrorType::COMPILE_ERROR);
+		current_unit()->patch_wide(offset_index, (uint32_t)offset);
+	}
+
+	void Compiler::write_jump_back(size_t target) {
+		int64_t offset = (int64_t)target - (int64_t)(current_unit()->index() + 4);
+		if (offset < -Unit::MAX_OFFSET)
+			m_error_handler.report_error("Jump is too long", {}, ErrorType::COMPILE_ERROR);
+		write((uint8_t)Instruction::JUMP);
+		current_unit()->write_wide((uint32_t)offset);
+	}
+
+	uint32_t Compiler::add_constant(Value value) {
 		if (m_unit_stack.empty())
 			return m_bytecode_out.write_value(value);
 		else
 			return m_unit_stack[m_unit_stack.size() - 1]->write_value(value);
 	}
 
-	void Compiler::expression(const std::shared_ptr<Expression>& expression) {
+	uint32_t Compiler::add_symbol(const std::string& string) {
+		return current_unit()->write_symbol(m_heap.intern(string));
+	}
+
+	void Compiler::expression(Expression* expression) {
 		switch (expression->get_type()) {
 		case NodeType::BINARY_OPERATION:
-			binary_operation(std::static_pointer_cast<BinaryOperation>(expression));
+			binary_operation(static_cast<BinaryOperation*>(expression));
 			break;
 		case NodeType::UNARY_OPERATION:
-			unary_operation(std::static_pointer_cast<UnaryOperation>(expression));
+			unary_operation(static_cast<UnaryOperation*>(expression));
 			break;
 		case NodeType::NUMBER_VALUE:
-			number(std::static_pointer_cast<Number>(expression));
+			number(static_cast<Number*>(expression));
 			break;
 		case NodeType::BOOL_VALUE:
-			boolean(std::static_pointer_cast<BoolValue>(expression));
+			boolean(static_cast<BoolValue*>(expression));
 			break;
 		case NodeType::NAME:
-			name(std::static_pointer_cast<Name>(expression));
+			name(static_cast<Name*>(expression));
 			break;
 		case NodeType::VOID:
 			write((uint8_t)Instruction::VOID);
 			break;
 		case NodeType::STRING:
-			write((uint8_t)Instruction::VAL_INDEX, add_constant(std::static_pointer_cast<StringLiteral>(expression)->value));
+			write_op(Instruction::VAL_INDEX, { add_symbol(static_cast<StringLiteral*>(expression)->value) });
 			break;
 		case NodeType::LVALUE:
-			lvalue(std::static_pointer_cast<LValue>(expression));
+			lvalue(static_cast<LValue*>(expression));
 			break;
 		case NodeType::LVALUE_START:
-			lvalue_start(std::static_pointer_cast<LValueStartNode>(expression));
+			lvalue_start(static_cast<LValueStartNode*>(expression));
 			break;
 		case NodeType::CALL:
-			call(std::static_pointer_cast<Call>(expression));
+			call(static_cast<Call*>(expression));
 			break;
 		}
 	}
 
 	const Unit& Compiler::compile() {
-		for (std::shared_ptr<Statement> stmt : m_ast->statements) {
+		size_t errors = m_error_handler.get_errors().size();
+		m_first_global = (uint32_t)m_emulator.get_global_names().size();
+		for (Statement* stmt : m_ast->statements) {
 			statement(stmt);
 		}
 		write((uint8_t)Instruction::RETURN);
+		if (m_error_handler.get_errors().size() != errors)
+			m_emulator.forget_globals(m_first_global);		// The code never runs, a later REPL line may declare them again
+		else if (!m_error_handler.has_errors())
+			m_optimizer.optimize(m_bytecode_out);
 		return m_bytecode_out;
 	}
 
-	void Compiler::number(const std::shared_ptr<Number>& number) {
-		write((uint8_t)Instruction::VAL_INDEX, add_constant(number->value));
+	void Compiler::number(Number* number) {
+		if (number->value.is_int())
+			write_int(number->value.as_int());
+		else
+			write_op(Instruction::VAL_INDEX, { add_constant(number->value) });
+	}
+
+	void Compiler::boolean(BoolValue* boolean) {
+		write_op(Instruction::VAL_INDEX, { add_constant(boolean->value) });
 	}
 
-	void Compiler::boolean(const std::shared_ptr<BoolValue>& boolean) {
-		write((uint8_t)Instruction::VAL_INDEX, add_constant(boolean->value));
+	int32_t Compiler::find_local(std::string_view name) const {
+		auto found = m_local_names.find(name);
+		return found != m_local_names.end() ? found->second : -1;
 	}
 
-	int32_t Compiler::find_local(const std::string& name) {
-		for (int32_t i = 0; i < m_locals.size(); i++)
-			if (m_locals[i].name == name)
-				return i;
-		return -1;
+	void Compiler::push_local(std::string_view name) {
+		int32_t slot = (int32_t)m_locals.size();
+		auto [found, inserted] = m_local_names.try_emplace(name, slot);
+		m_locals.push_back(LocalName{ name, m_current_scope, inserted ? -1 : found->second });
+		found->second = slot;
 	}
 
-	void Compiler::name(const std::shared_ptr<Name>& name) {
+	void Compiler::pop_local() {
+		const LocalName& local = m_locals.back();
+		if (local.shadowed == -1)
+			m_local_names.erase(local.name);
+		else
+			m_local_names[local.name] = local.shadowed;
+		m_locals.pop_back();
+	}
+
+	void Compiler::name(Name* name) {
 		int64_t local_idx = -1;
-		if(std::find(m_globals.begin(), m_globals.end(), name->string) != m_globals.end() 
-			|| std::find(Standard::standard_functions.begin(), Standard::standard_functions.end(), name->string) != Standard::standard_functions.end())
-			write((uint8_t)Instruction::GET_GLOBAL, add_constant(Value(std::make_shared<StringObject>(name->string))));
-		else if ((local_idx = find_local(name->string)) != -1)
-			write((uint8_t)Instruction::GET_LOCAL, add_constant(Value(local_idx)));
+		int32_t global_slot = -1;
+		if ((local_idx = find_local(name->string)) != -1)	// Innermost first: locals, then globals and the standard functions
+			write_op(Instruction::GET_LOCAL, { (uint32_t)local_idx });
+		else if ((global_slot = find_global(name->string)) != -1)
+			write_op(Instruction::GET_GLOBAL, { (uint32_t)global_slot });
 		else {
 			m_error_handler.report_error("Name '" + name->string + "' does not exist in this scope", {}, ErrorType::COMPILE_ERROR);
 		}
 	}
 
-	void Compiler::lvalue(const std::shared_ptr<LValue>& l_value) {
+	void Compiler::lvalue(LValue* l_value, Instruction member_instruction) {
 		if (l_value->name->get_type() == NodeType::NAME)
-			write(add_constant(Value(std::static_pointer_cast<Name>(l_value->name)->string)));
+			write_op(member_instruction, { add_symbol(static_cast<Name*>(l_value->name)->string), current_unit()->add_cache() });
 		else {
-			/*std::shared_ptr<Call> call = std::static_pointer_cast<Call>(l_value->name);
+			/*Call* call = static_cast<Call*>(l_value->name);
 			write(add_constant(Value(call->name->string)));
 			for (const auto& param : call->parameters)
 				expression(param);
 			write((uint8_t)Instruction::CALL, (uint8_t)call->parameters.size());*/
-			call(std::static_pointer_cast<Call>(l_value->name), true);
-		}
-		if (l_value->access) {
-			if (m_set_member && !l_value->access->access)
-				write((uint8_t)Instruction::SET_MEMBER);
-			else
-				if (l_value->access->name->get_type() != NodeType::CALL)
-					write((uint8_t)Instruction::GET_MEMBER);
-			lvalue(l_value->access);
+			call(static_cast<Call*>(l_value->name), true);
 		}
+		if (l_value->access)
+			lvalue(l_value->access, m_set_member && !l_value->access->access ? Instruction::SET_MEMBER : Instruction::GET_MEMBER);
 	}
-	void Compiler::lvalue_start(const std::shared_ptr<LValueStartNode>& l_value) {
-		std::shared_ptr<LValue> lval = l_value->lvalue;
+	void Compiler::lvalue_start(LValueStartNode* l_value) {
+		LValue* lval = l_value->lvalue;
 		if (!m_in_class_decl) {
 			switch (lval->name->get_type()) {
 			case NodeType::NAME:
-				if (std::static_pointer_cast<Name>(lval->name)->string == "this") {
+				if (static_cast<Name*>(lval->name)->string == "this") {
 					m_error_handler.report_error("Cannot use this outside of a class", {}, ErrorType::COMPILE_ERROR);
 					return;
 				}
 				break;
 			case NodeType::CALL:
-				if (std::static_pointer_cast<Call>(lval->name)->name->string == "this") {
+				if (static_cast<Call*>(lval->name)->name->string == "this") {
 					m_error_handler.report_error("Cannot use this outside of a class", {}, ErrorType::COMPILE_ERROR);
 					return;
 				}
 			}
 		}
 		if (lval->name->get_type() == NodeType::NAME) {
-			name(std::static_pointer_cast<Name>(lval->name));
+			name(static_cast<Name*>(lval->name));
 		}
 		else
-			call(std::static_pointer_cast<Call>(lval->name));
+			call(static_cast<Call*>(lval->name));
 
-		if (lval->access) {
-			if (m_set_member && !lval->access->access)
-				write((uint8_t)Instruction::SET_MEMBER);
-			else
-				if(lval->access->name->get_type() != NodeType::CALL)
-					write((uint8_t)Instruction::GET_MEMBER);
-			lvalue(lval->access);
-		}
+		if (lval->access)
+			lvalue(lval->access, m_set_member && !lval->access->access ? Instruction::SET_MEMBER : Instruction::GET_MEMBER);
 	}
 
-	void Compiler::binary_operation(const std::shared_ptr<BinaryOperation>& operation) {
+	void Compiler::binary_operation(BinaryOperation* operation) {
 		expression(operation->left_expression);
 		expression(operation->right_expression);
 		switch (operation->operator_token.type)
@@ -169,6 +232,24 @@ namespace Tusk {
 		case TokenType::SLASH:
 			write((uint8_t)Instruction::DIVIDE);
 			break;
+		case TokenType::PERCENT:
+			write((uint8_t)Instruction::MODULO);
+			break;
+		case TokenType::AMPERSAND:
+			write((uint8_t)Instruction::BIT_AND);
+			break;
+		case TokenType::PIPE:
+			write((uint8_t)Instruction::BIT_OR);
+			break;
+		case TokenType::CAP:
+			write((uint8_t)Instruction::BIT_XOR);
+			break;
+		case TokenType::L_SHIFT:
+			write((uint8_t)Instruction::SHIFT_LEFT);
+			break;
+		case TokenType::R_SHIFT:
+			write((uint8_t)Instruction::SHIFT_RIGHT);
+			break;
 		case TokenType::EQUAL_EQUAL:
 			write((uint8_t)Instruction::EQUAL);
 			break;
@@ -187,13 +268,19 @@ namespace Tusk {
 		case TokenType::LESS_EQUAL:
 			write((uint8_t)Instruction::LESS_EQUAL);
 			break;
+		case TokenType::AND:
+			write((uint8_t)Instruction::AND);
+			break;
+		case TokenType::OR:
+			write((uint8_t)Instruction::OR);
+			break;
 		default:
 			break;
 		}
 		
 	}
 
-	void Compiler::unary_operation(const std::shared_ptr<UnaryOperation>& operation) {
+	void Compiler::unary_operation(UnaryOperation* operation) {
 		expression(operation->right_expression);
 		switch (operation->operator_token.type)
 		{
@@ -209,55 +296,55 @@ namespace Tusk {
 
 	}
 
-	void Compiler::statement(const std::shared_ptr<Statement>& statement) {
+	void Compiler::statement(Statement* statement) {
 		switch (statement->get_type()) {
 		case NodeType::LOG_STATEMENT:
-			log_statement(std::static_pointer_cast<LogStatement>(statement));
+			log_statement(static_cast<LogStatement*>(statement));
 			break;
 		case NodeType::EXPRESSION_STATEMENT:
-			expression_statement(std::static_pointer_cast<ExpressionStatement>(statement));
+			expression_statement(static_cast<ExpressionStatement*>(statement));
 			break;
 		case NodeType::VARIABLE_DECLARATION:
-			variable_declaration(std::static_pointer_cast<VariableDeclaration>(statement));
+			variable_declaration(static_cast<VariableDeclaration*>(statement));
 			break;
 		case NodeType::ASSIGNMENT:
-			assignment(std::static_pointer_cast<Assignment>(statement));
+			assignment(static_cast<Assignment*>(statement));
 			break;
 		case NodeType::COMPOUND_ASSIGNMENT:
-			compound_assignment(std::static_pointer_cast<CompoundAssignment>(statement));
+			compound_assignment(static_cast<CompoundAssignment*>(statement));
 			break;
 		case NodeType::IF_STATEMENT:
-			if_statement(std::static_pointer_cast<IfStatement>(statement));
+			if_statement(static_cast<IfStatement*>(statement));
 			break;
 		case NodeType::WHILE_STATEMENT:
-			while_statement(std::static_pointer_cast<WhileStatement>(statement));
+			while_statement(static_cast<WhileStatement*>(statement));
 			break;
 		case NodeType::COMPOUND_STATEMENT:
-			compound_statement(std::static_pointer_cast<CompoundStatement>(statement));
+			compound_statement(static_cast<CompoundStatement*>(statement));
 			break;
 		case NodeType::BREAK_STATEMENT:
-			break_statement(std::static_pointer_cast<BreakStatement>(statement));
+			break_statement(static_cast<BreakStatement*>(statement));
 			break;
 		case NodeType::CONTINUE_STATEMENT:
-			continue_statement(std::static_pointer_cast<ContinueStatement>(statement));
+			continue_statement(static_cast<ContinueStatement*>(statement));
 			break;
 		case NodeType::FUNCTION_DECLARATION:
-			function_declaration(std::static_pointer_cast<FunctionDeclaration>(statement));
+			function_declaration(static_cast<FunctionDeclaration*>(statement));
 			break;
 		case NodeType::RETURN_STATEMENT:
-			return_statement(std::static_pointer_cast<ReturnStatement>(statement));
+			return_statement(static_cast<ReturnStatement*>(statement));
 			break;
 		case NodeType::CLASS_DECLARATION:
-			class_declaration(std::static_pointer_cast<ClassDeclaration>(statement));
+			class_declaration(static_cast<ClassDeclaration*>(statement));
 			break;
 		case NodeType::ENUM_DECLARATION:
-			enum_declaration(std::static_pointer_cast<EnumDeclaration>(statement));
+			enum_declaration(static_cast<EnumDeclaration*>(statement));
 			break;
 		case NodeType::VOID_STATEMENT:
 			break;
 		}
 	}
-	void Compiler::log_statement(const std::shared_ptr<LogStatement>& log_statement) {
+	void Compiler::log_statement(LogStatement* log_statement) {
 		expression(log_statement->output);
 		if(log_statement->log_line)
 			write((uint8_t)Instruction::LOGL, (uint8_t)Instruction::POP);
@@ -265,47 +352,57 @@ namespace Tusk {
 			write((uint8_t)Instruction::LOG, (uint8_t)Instruction::POP);
 	}
 
-	void Compiler::expression_statement(const std::shared_ptr<ExpressionStatement>& expression_statement) {
+	void Compiler::expression_statement(ExpressionStatement* expression_statement) {
 		expression(expression_statement->expression);
 		write((uint8_t)Instruction::POP);
 	}
 
-	void Compiler::variable_declaration(const std::shared_ptr<VariableDeclaration>& variable_decl, bool make_member) {
+	void Compiler::variable_declaration(VariableDeclaration* variable_decl, bool make_member) {
 		if (variable_decl->value)
 			expression(variable_decl->value);
 		else
 			write((uint8_t)Instruction::VOID);
 		if (make_member)
-			write((uint8_t)Instruction::MAKE_MEMBER, add_constant(Value(variable_decl->variable_name)));
+			write_op(Instruction::MAKE_MEMBER, { add_symbol(variable_decl->variable_name) });
 		else
 			make_name(variable_decl->variable_name);
 	}
 
 	void Compiler::make_name(const std::string& name) {
-		if (m_current_scope == -1) {
-			if (std::find(m_globals.begin(), m_globals.end(), name) != m_globals.end()) {
-				m_error_handler.report_error("Global name '" + name + "' already exists", {}, ErrorType::COMPILE_ERROR);
-			}
-
-			write((uint8_t)Instruction::MAKE_GLOBAL, add_constant(Value(std::make_shared<StringObject>(name))));
-			m_globals.push_back(name);
-		}
+		if (m_current_scope == -1)
+			write_op(Instruction::MAKE_GLOBAL, { declare_global(name) });
 		else {
-			m_locals.push_back(LocalName{ name, (uint8_t)(m_locals.size() - 1), m_current_scope });
+			push_local(name);
 			//write((uint8_t)Instruction::SET_LOCAL, add_constant((int64_t)(m_locals.size() - 1)));
 		}
 	}
 
-	void Compiler::assignment(const std::shared_ptr<Assignment>& assignment) {
-		std::shared_ptr<LValue> lval = assignment->lvalue->lvalue;
+	int32_t Compiler::find_global(const std::string& name) const {
+		int32_t slot = m_emulator.find_global(name);
+		return (uint32_t)slot < m_visible_globals ? slot : -1;
+	}
+
+	uint32_t Compiler::declare_global(const std::string& name) {
+		int32_t slot = m_emulator.find_global(name);
+		// A slot of an earlier REPL line whose code stopped before defining it can be declared again
+		if (slot != -1 && ((uint32_t)slot >= m_first_global || m_emulator.is_global_defined(slot)))
+			m_error_handler.report_error("Global name '" + name + "' already exists", {}, ErrorType::COMPILE_ERROR);
+		return m_emulator.declare_global(name);
+	}
+
+	void Compiler::assignment(Assignment* assignment) {
+		LValue* lval = assignment->lvalue->lvalue;
 		expression(assignment->expression);
 		int64_t local_idx = -1;
+		int32_t global_slot = -1;
 		if (!lval->access && lval->name->get_type() == NodeType::NAME) {
-			std::shared_ptr<Name> name = std::static_pointer_cast<Name>(lval->name);
-			if (std::find(m_globals.begin(), m_globals.end(), name->string) != m_globals.end())
-				write((uint8_t)Instruction::SET_GLOBAL, add_constant(Value(std::make_shared<StringObject>(name->string))));
-			else if ((local_idx = find_local(name->string)) != -1)
-				write((uint8_t)Instruction::SET_LOCAL, add_constant(Value(local_idx)));
+			Name* name = static_cast<Name*>(lval->name);
+			if ((local_idx = find_local(name->string)) != -1) {
+				write_op(Instruction::SET_LOCAL, { (uint32_t)local_idx });
+				write((uint8_t)Instruction::POP);
+			}
+			else if ((global_slot = find_global(name->string)) != -1)
+				write_op(Instruction::SET_GLOBAL, { (uint32_t)global_slot });
 			else
 				m_error_handler.report_error("Name '" + name->string + "' does not exist in this scope", {}, ErrorType::COMPILE_ERROR);
 		}
@@ -316,19 +413,17 @@ namespace Tusk {
 		}
 	}
 
-	void Compiler::compound_assignment(const std::shared_ptr<CompoundAssignment>& compound) {
-		std::shared_ptr<LValue> lval = compound->lvalue->lvalue;
-		bool is_global = false;
+	void Compiler::compound_assignment(CompoundAssignment* compound) {
+		LValue* lval = compound->lvalue->lvalue;
 		bool is_member = false;
 		int64_t local_idx = -1;
+		int32_t global_slot = -1;
 		if (!lval->access && lval->name->get_type() == NodeType::NAME) {
-			std::shared_ptr<Name> name = std::static_pointer_cast<Name>(lval->name);
-			if (std::find(m_globals.begin(), m_globals.end(), name->string) != m_globals.end()) {
-				write((uint8_t)Instruction::GET_GLOBAL, add_constant(Value(std::make_shared<StringObject>(name->string))));
-				is_global = true;
-			}
-			else if ((local_idx = find_local(name->string)) != -1)
-				write((uint8_t)Instruction::GET_LOCAL, add_constant(Value(local_idx)));
+			Name* name = static_cast<Name*>(lval->name);
+			if ((local_idx = find_local(name->string)) != -1)
+				write_op(Instruction::GET_LOCAL, { (uint32_t)local_idx });
+			else if ((global_slot = find_global(name->string)) != -1)
+				write_op(Instruction::GET_GLOBAL, { (uint32_t)global_slot });
 			else
 				m_error_handler.report_error("Name '" + name->string + "' does not exist in this scope", {}, ErrorType::COMPILE_ERROR);
 		}
@@ -350,112 +445,201 @@ namespace Tusk {
 		case CompoundAssignment::DIVIDE:
 			write((uint8_t)Instruction::DIVIDE);
 			break;
+		case CompoundAssignment::MODULO:
+			write((uint8_t)Instruction::MODULO);
+			break;
 		}
 		if (is_member) {
 			m_set_member = true;
 			lvalue_start(compound->lvalue);
 			m_set_member = false;
 		}
-		else if (is_global) {
-			std::shared_ptr<Name> name = std::static_pointer_cast<Name>(lval->name);
-			write((uint8_t)Instruction::SET_GLOBAL, add_constant(Value(std::make_shared<StringObject>(name->string))));
+		else if (global_slot != -1)
+			write_op(Instruction::SET_GLOBAL, { (uint32_t)global_slot });
+		else {
+			write_op(Instruction::SET_LOCAL, { (uint32_t)local_idx });
+			write((uint8_t)Instruction::POP);
 		}
-		else
-			write((uint8_t)Instruction::SET_LOCAL, add_constant(Value(local_idx)));
 	}
 
-	void Compiler::if_statement(const std::shared_ptr<IfStatement>& stmt) {
+	void Compiler::if_statement(IfStatement* stmt) {
 		expression(stmt->condition);
-		uint8_t false_index = add_constant(current_unit()->index());
-		write((uint8_t)Instruction::JUMP_IF_FALSE, false_index);
+		size_t false_jump = write_jump(Instruction::JUMP_IF_FALSE);
 		statement(stmt->body);
-		uint8_t end_index{ 0 };
-		if (stmt->else_body) {
-			end_index = add_constant(current_unit()->index());
-			write((uint8_t)Instruction::JUMP, end_index);
-		}
+		size_t end_jump{ 0 };
+		if (stmt->else_body)
+			end_jump = write_jump(Instruction::JUMP);
 		
-		current_unit()->get_values()[false_index] = current_unit()->index();
+		patch_jump(false_jump);
 		if (stmt->else_body) {
 			
 			statement(stmt->else_body);
-			current_unit()->get_values()[end_index] = current_unit()->index();
+			patch_jump(end_jump);
 		}
 	}
 
-	void Compiler::while_statement(const std::shared_ptr<WhileStatement>& stmt) {
-		uint8_t top_of_loop = add_constant(current_unit()->index());
+	void Compiler::while_statement(WhileStatement* stmt) {
+		size_t top_of_loop = current_unit()->index();
 		expression(stmt->condition);
-		uint8_t false_index = add_constant(current_unit()->index());
-		m_loop_stack.push_back({top_of_loop, false_index});
-		write((uint8_t)Instruction::JUMP_IF_FALSE, false_index);
+		m_loop_stack.push_back({ top_of_loop, m_locals.size(), {} });
+		size_t false_jump = write_jump(Instruction::JUMP_IF_FALSE);
 		statement(stmt->body);
-		write((uint8_t)Instruction::JUMP, top_of_loop);
-		current_unit()->get_values()[false_index] = current_unit()->index();
-		
+		write_jump_back(top_of_loop);
+		patch_jump(false_jump);
+		for (size_t break_jump : m_loop_stack[m_loop_stack.size() - 1].breaks)
+			patch_jump(break_jump);
+		m_loop_stack.pop_back();
 	}
 
-	void Compiler::compound_statement(const std::shared_ptr<CompoundStatement>& compound) {
+	void Compiler::compound_statement(CompoundStatement* compound) {
 		m_current_scope++;
 		for (const auto& stmt : compound->statements) {
 			statement(stmt);
 		}
 		m_current_scope--;
-		for (int64_t i = m_locals.size() - 1; m_locals.size() > 0; m_locals.pop_back(), i--) {
-			if (m_locals[i].scope_depth <= m_current_scope)
-				break;
-			if(m_locals[i].name != "this")
+		while (!m_locals.empty() && m_locals.back().scope_depth > m_current_scope) {
+			if (m_locals.back().name != "this")
 				write((uint8_t)Instruction::POP);
+			pop_local();
 		}
 		
 	}
 
-	void Compiler::break_statement(const std::shared_ptr<BreakStatement>& break_stmt) {
+	void Compiler::pop_loop_locals() {						// Jumps out of the body leave at the depth the loop started at
+		for (size_t i = m_loop_stack[m_loop_stack.size() - 1].locals_count; i < m_locals.size(); i++)
+			write((uint8_t)Instruction::POP);
+	}
+
+	void Compiler::break_statement(BreakStatement* break_stmt) {
 		if (m_loop_stack.empty()) {
 			m_error_handler.report_error("Cannot use 'break' outside loops", {}, ErrorType::COMPILE_ERROR);
 			return;
 		}
-		write((uint8_t)Instruction::JUMP, m_loop_stack[m_loop_stack.size() - 1].end_index);
+		pop_loop_locals();
+		m_loop_stack[m_loop_stack.size() - 1].breaks.push_back(write_jump(Instruction::JUMP));
 	}
-	void Compiler::continue_statement(const std::shared_ptr<ContinueStatement>& continue_stmt) {
+	void Compiler::continue_statement(ContinueStatement* continue_stmt) {
 		if (m_loop_stack.empty()) {
 			m_error_handler.report_error("Cannot use 'continue' outside loops", {}, ErrorType::COMPILE_ERROR);
 			return;
 		}
-		write((uint8_t)Instruction::JUMP, m_loop_stack[m_loop_stack.size() - 1].condition_index);
+		pop_loop_locals();
+		write_jump_back(m_loop_stack[m_loop_stack.size() - 1].condition_index);
+	}
+
+	void Compiler::function_declaration(FunctionDeclaration* function_decl, bool make_member) {
+		int32_t global_slot = -1;
+		if (!make_member && m_current_scope == -1)			// Declared before the body so the function can call itself
+			global_slot = declare_global(function_decl->function_name);
+		FunctionObject* func = m_heap.allocate<FunctionObject>(function_decl->function_name, (uint32_t)function_decl->arguments.size());
+		if (m_lazy) {
+			uint32_t visible_globals = std::min(m_visible_globals, (uint32_t)m_emulator.get_global_names().size());
+			func->lazy_body = std::make_unique<LazyFunction>(m_self, function_decl, make_member, m_in_class_decl, m_current_scope, visible_globals);
+		}
+		else
+			function_body(func, function_decl, make_member);
+		write_op(Instruction::VAL_INDEX, { add_constant(Value(func)) });
+		if (make_member)
+			write_op(Instruction::MAKE_MEMBER, { add_symbol(func->function_name) });
+		else if (global_slot != -1)
+			write_op(Instruction::MAKE_GLOBAL, { (uint32_t)global_slot });
+		else
+			make_name(function_decl->function_name);
 	}
 
-	void Compiler::function_declaration(const std::shared_ptr<FunctionDeclaration>& function_decl, bool make_member) {
-		if (make_member && function_decl->function_name == "make")
-			m_in_constructor = true;
-		std::shared_ptr<FunctionObject> func = std::make_shared<FunctionObject>();
-		func->function_name = function_decl->function_name;
+	void Compiler::function_body(FunctionObject* func, FunctionDeclaration* function_decl, bool make_member) {
 		func->code_unit = std::make_shared<Unit>();
+		if (!function_decl->body && !parse_skipped_body(function_decl))
+			return;											// The syntax errors are reported, the unit never runs
+		bool enclosing_constructor = m_in_constructor;
+		m_in_constructor = make_member && function_decl->function_name == "make";
 		m_func_stack.push_back(nullptr);
 		push_unit(func->code_unit.get());
+		std::vector<LocalName> enclosing_locals = std::move(m_locals);	// Local indices start again at the frame of the function
+		std::unordered_map<std::string_view, int32_t> enclosing_names = std::move(m_local_names);
+		std::vector<Loop> enclosing_loops = std::move(m_loop_stack);
+		m_locals.clear();
+		m_local_names.clear();
+		m_loop_stack.clear();
 		m_current_scope++;
-		m_locals.push_back(LocalName{ "this", (uint8_t)(m_locals.size() - 1), m_current_scope});
+		push_local("this");
 		for (const auto& arg : function_decl->arguments) {
-			m_locals.push_back(LocalName{ arg->name, (uint8_t)(m_locals.size() - 1), m_current_scope });
+			push_local(arg.name);
 		}
 		
 		m_current_scope--;
 		statement(function_decl->body);
 		write((uint8_t)Instruction::VOID, (uint8_t)Instruction::RETURN);
+		m_locals = std::move(enclosing_locals);
+		m_local_names = std::move(enclosing_names);
+		m_loop_stack = std::move(enclosing_loops);
 		pop_unit();
 		m_func_stack.pop_back();
-		func->arg_count = function_decl->arguments.size();
-		write((uint8_t)Instruction::VAL_INDEX, add_constant(Value(func)));
-		if (make_member)
-			write((uint8_t)Instruction::MAKE_MEMBER, add_constant(Value(func->function_name)));
-		else
-			make_name(function_decl->function_name);
+		m_in_constructor = enclosing_constructor;
+	}
+
+	bool Compiler::parse_skipped_body(FunctionDeclaration* function_decl) {
+		if (!Parser::parse_body(function_decl, m_ast->arena, m_error_handler))
+			return false;
+		if (m_simplify_skipped) {
+			Simplifier simplifier(m_emulator, false);
+			simplifier.simplify(function_decl, m_ast->arena);
+		}
+		return true;
+	}
 
-		if (make_member && function_decl->function_name == "make")
-			m_in_constructor = false;
+	bool Compiler::compile_lazy(FunctionObject& function, const LazyFunction& lazy) {
+		size_t errors = m_error_handler.get_errors().size();
+		int32_t enclosing_scope = m_current_scope;
+		bool enclosing_class_decl = m_in_class_decl;
+		uint32_t enclosing_globals = m_visible_globals;
+		m_current_scope = lazy.scope;						// Compiled as if it was still where it was declared
+		m_in_class_decl = lazy.in_class_decl;
+		m_visible_globals = lazy.visible_globals;
+		function_body(&function, lazy.declaration, lazy.member);
+		m_current_scope = enclosing_scope;
+		m_in_class_decl = enclosing_class_decl;
+		m_visible_globals = enclosing_globals;
+		if (m_error_handler.get_errors().size() != errors) {
+			function.code_unit = nullptr;
+			return false;
+		}
+		m_optimizer.optimize(*function.code_unit);
+		return true;
 	}
 
-	void Compiler::return_statement(const std::shared_ptr<ReturnStatement>& return_stmt) {
+	bool Compiler::compile_remaining(const Unit& unit) {
+		bool compiled = true;
+		for (const Value& value : unit.get_values()) {
+			if (!value.is_object(ObjectType::FUNCTION))
+				continue;
+			FunctionObject* function = value.get_object<FunctionObject>();
+			if (function->lazy_body) {
+				std::unique_ptr<LazyBody> lazy = std::move(function->lazy_body);
+				if (!lazy->compile(*function)) {
+					compiled = false;
+					continue;
+				}
+				m_heap.remember(function);						// May have been promoted while the script ran
+			}
+			if (function->code_unit && !compile_remaining(*function->code_unit))
+				compiled = false;
+		}
+		return compiled;
+	}
+
+	static Call* plain_call(Expression* expression) {
+		if (expression->get_type() == NodeType::CALL)
+			return static_cast<Call*>(expression);
+		if (expression->get_type() != NodeType::LVALUE_START)
+			return nullptr;
+		LValue* lval = static_cast<LValueStartNode*>(expression)->lvalue;
+		if (lval->access || lval->name->get_type() != NodeType::CALL)	// The result of 'f().x' is not the result of the call
+			return nullptr;
+		return static_cast<Call*>(lval->name);
+	}
+
+	void Compiler::return_statement(ReturnStatement* return_stmt) {
 		if (m_func_stack.empty()) {
 			m_error_handler.report_error("Cannot use return outside a function", {}, ErrorType::COMPILE_ERROR);
 			return;
@@ -463,66 +647,76 @@ namespace Tusk {
 		if (return_stmt->expr) {
 			if (m_in_constructor)
 				m_error_handler.report_error("Cannot return a value from a constructor", {}, ErrorType::COMPILE_ERROR);
-			expression(return_stmt->expr);
+			Call* tail_call = plain_call(return_stmt->expr);
+			if (tail_call)										// 'return f(...)' reuses the frame of the returning function
+				call(tail_call, false, true);
+			else
+				expression(return_stmt->expr);
 		}
 		else
 			write((uint8_t)Instruction::VOID);
 		write((uint8_t)Instruction::RETURN);
 	}
 
-	void Compiler::call(const std::shared_ptr<Call>& call, bool invoke_method) {
+	void Compiler::call(Call* call, bool invoke_method, bool tail) {
 		if (!invoke_method) {
 			name(call->name);
 			for (const auto& param : call->parameters)
 				expression(param);
 
-			write((uint8_t)Instruction::CALL, (uint8_t)call->parameters.size());
+			write_op(tail ? Instruction::TAIL_CALL : Instruction::CALL, { (uint32_t)call->parameters.size() });
 		}
 		else {
 			for (const auto& param : call->parameters)
 				expression(param);
-			write((uint8_t)Instruction::METHOD_CALL, (uint8_t)call->parameters.size());
-			write((uint8_t)add_constant(Value(std::make_shared<StringObject>(call->name->string))));
+			write_op(Instruction::METHOD_CALL, { (uint32_t)call->parameters.size(), add_symbol(call->name->string), current_unit()->add_cache() });
 		}
 	}
 
-	void Compiler::class_declaration(const std::shared_ptr<ClassDeclaration>& class_decl) {
-		std::shared_ptr<ClassObject> class_obj = std::make_shared<ClassObject>();
+	void Compiler::class_declaration(ClassDeclaration* class_decl) {
+		int32_t global_slot = -1;
+		if (m_current_scope == -1)							// Methods can refer to their own class
+			global_slot = declare_global(class_decl->class_name);
+		ClassObject* class_obj = m_heap.allocate<ClassObject>();
 		class_obj->class_name = class_decl->class_name;
 
 		m_in_class_decl = true;
 
-		write((uint8_t)Instruction::VAL_INDEX, add_constant(Value(class_obj)));
+		write_op(Instruction::VAL_INDEX, { add_constant(Value(class_obj)) });
 		if (class_decl->parent_class != "") {
-			name(std::make_shared<Name>(class_decl->parent_class));
+			Name parent{ class_decl->parent_class };
+			name(&parent);
 			write((uint8_t)Instruction::INHERIT);
 		}
 		for (const auto& stmt : class_decl->body->statements) {
 			switch (stmt->get_type()) {
 			case NodeType::FUNCTION_DECLARATION:
-				function_declaration(std::static_pointer_cast<FunctionDeclaration>(stmt), true);
+				function_declaration(static_cast<FunctionDeclaration*>(stmt), true);
 				break;
 			case NodeType::VARIABLE_DECLARATION:
-				variable_declaration(std::static_pointer_cast<VariableDeclaration>(stmt), true);
+				variable_declaration(static_cast<VariableDeclaration*>(stmt), true);
 				break;
 			}
 		}
 		//name();
 		
-		make_name(class_decl->class_name);
+		if (global_slot != -1)
+			write_op(Instruction::MAKE_GLOBAL, { (uint32_t)global_slot });
+		else
+			make_name(class_decl->class_name);
 		
 
 		m_in_class_decl = false;
 	}
-	void Compiler::enum_declaration(const std::shared_ptr<EnumDeclaration>& enum_decl) {
-		std::shared_ptr<EnumObject> enum_obj = std::make_shared<EnumObject>();
+	void Compiler::enum_declaration(EnumDeclaration* enum_decl) {
+		EnumObject* enum_obj = m_heap.allocate<EnumObject>();
 		enum_obj->name = enum_decl->enum_name;
 
-		write((uint8_t)Instruction::VAL_INDEX, add_constant(Value(enum_obj)));
+		write_op(Instruction::VAL_INDEX, { add_constant(Value(enum_obj)) });
 		for (const auto& val : enum_decl->values) {
 			enum_obj->values.push_back(val);
 		}
 
-		make_name(enum_obj->name);
+		make_name(enum_decl->enum_name);
 	}
 }
\ No newline at end of file
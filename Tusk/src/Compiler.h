@@ -2,27 +2,83 @@
 #include "Bytecode.h"
 #include "Parser.h"
 #include "Value.h"
+#include "Emulator.h"
+#include "Optimizer.h"
+#include "Simplifier.h"
 #include <unordered_map>
 
 namespace Tusk {
-	class Optimizer {};
-
 	class Compiler {
 	public:
-		Compiler(const std::shared_ptr<AST>& tree, ErrorHandler& handler) : m_ast{ tree }, m_error_handler { handler } {}
+		// Bumped whenever the same source compiles to different code, by a change to the parser, Simplifier, Compiler
+		// or Optimizer. Part of the key of cached units, so the ones an older build made are compiled again
+		static constexpr uint32_t VERSION = 3;
+
+		Compiler(AST* tree, Emulator& emulator, ErrorHandler& handler)
+			: m_ast{ tree }, m_emulator{ emulator }, m_heap{ emulator.get_heap() }, m_error_handler{ handler } {}
+		~Compiler() { *m_self = nullptr; }
+		Compiler(const Compiler&) = delete;
+		Compiler& operator=(const Compiler&) = delete;
 
 		const Unit& compile();
+		void set_optimization_level(uint32_t level) {	// See Optimizer, 2 by default
+			m_optimizer = Optimizer(level);
+			m_simplify_skipped = level > 0;
+		}
+		// Function bodies are compiled on their first call instead of up front, errors in them are reported then.
+		// Bodies not called while the compiler and the tree exist can't be compiled anymore. Off by default
+		void set_lazy(bool lazy) { m_lazy = lazy; }
+		// Compiles every body still waiting for its first call, so the unit can be saved. Returns false if one of
+		// them has errors, they are reported like any other compile error
+		bool compile_remaining() { return compile_remaining(m_bytecode_out); }
+		const OptimizerStats& get_optimizer_stats() const { return m_optimizer.get_stats(); }
 	private:
-		std::shared_ptr<AST> m_ast;
+		AST* m_ast;
 		Unit m_bytecode_out;
+		Emulator& m_emulator;							// Owns the global slots names are resolved to
+		Heap& m_heap;									// Constants are allocated on the heap of the emulator that will run them
 		ErrorHandler& m_error_handler;
+		Optimizer m_optimizer;
 		std::vector<Unit*> m_unit_stack;
 		std::vector<nullptr_t> m_func_stack;
 
+		// LAZY COMPILATION
+		// Everything the body of a function depends on where it was declared, kept to compile it on its first call
+		struct LazyFunction : LazyBody {
+			std::shared_ptr<Compiler*> compiler;			// Null once the compiler is destroyed
+			FunctionDeclaration* declaration;
+			bool member;
+			bool in_class_decl;
+			int32_t scope;
+			uint32_t visible_globals;
+
+			LazyFunction(std::shared_ptr<Compiler*> compiler, FunctionDeclaration* declaration, bool member, bool in_class_decl, int32_t scope, uint32_t visible_globals)
+				: compiler{ std::move(compiler) }, declaration{ declaration }, member{ member }, in_class_decl{ in_class_decl }, scope{ scope }, visible_globals{ visible_globals } {}
+			bool compile(FunctionObject& function) override { return *compiler && (*compiler)->compile_lazy(function, *this); }
+		};
+
+		bool m_lazy = false;
+		std::shared_ptr<Compiler*> m_self{ std::make_shared<Compiler*>(this) };
+		uint32_t m_visible_globals = UINT32_MAX;		// Globals declared later are not in scope of a lazily compiled body
+		bool compile_lazy(FunctionObject& function, const LazyFunction& lazy);
+		bool compile_remaining(const Unit& unit);
+		void function_body(FunctionObject* function, FunctionDeclaration* function_decl, bool make_member);
+
+		// Bodies the parser skipped (see Parser::set_preparse) are parsed when they are compiled, and simplified
+		// like the rest of the tree was before compiling
+		bool m_simplify_skipped = true;
+		bool parse_skipped_body(FunctionDeclaration* function_decl);
+
 		// UTILS
 		void write(uint8_t byte);						// Writes one byte to the bytecode
 		void write(uint8_t byte_a, uint8_t byte_b);		// Writes two bytes to the bytecode
-		uint8_t add_constant(Value value);				// Adds a constant to the constant pool and returns its index
+		void write_op(Instruction instruction, std::initializer_list<uint32_t> operands);	// Uses the wide variant if an operand needs it
+		void write_int(int64_t value);					// Integer as an immediate if it fits, otherwise as a constant
+		size_t write_jump(Instruction instruction);		// Writes a jump to be patched, returns the position of its offset
+		void patch_jump(size_t offset_index);			// Points a jump written by write_jump to the current position
+		void write_jump_back(size_t target);			// Writes a JUMP to an earlier position
+		uint32_t add_constant(Value value);				// Adds a constant to the constant pool and returns its index
+		uint32_t add_symbol(const std::string& string);	// Same for the interned string, which is added once per unit
 		void push_unit(Unit* unit) {					// New unit for functions, write outputs to outermost unit
 			m_unit_stack.push_back(unit);
 		}
@@ -42,51 +98,60 @@ namespace Tusk {
 		bool m_in_class_decl = false;
 
 		void make_name(const std::string& name);
+		uint32_t declare_global(const std::string& name);	// Reserves a global slot and returns its index
+		uint32_t m_first_global = 0;					// Globals declared before this compile
+		int32_t find_global(const std::string& name) const;	// Returns -1 if the name is not a global in scope
 
+		// Locals in slot order, each name resolves to its innermost declaration through m_local_names and goes back
+		// to the one it shadowed when it's popped. Names point into the tree, which outlives the compiler
 		struct LocalName {
-			std::string name;
-			uint8_t index;
+			std::string_view name;
 			int32_t scope_depth;
+			int32_t shadowed;								// Slot of the local with the same name this one hides, -1 if none
 		};
 
-		int32_t find_local(const std::string& name);
+		int32_t find_local(std::string_view name) const;	// Returns -1 if the name is not a local of the current function
+		void push_local(std::string_view name);
+		void pop_local();
 		int32_t m_current_scope = -1;
 		std::vector<LocalName> m_locals;
-		std::vector<std::string> m_globals;
+		std::unordered_map<std::string_view, int32_t> m_local_names;
 
 		struct Loop {
-			uint8_t condition_index;
-			uint8_t end_index;
+			size_t condition_index;
+			size_t locals_count;							// Locals declared before the loop, the rest are popped by break and continue
+			std::vector<size_t> breaks;					// Jumps to patch once the end of the loop is known
 		};
 
 		std::vector<Loop> m_loop_stack;
+		void pop_loop_locals();
 
 		// Expressions
-		void expression(const std::shared_ptr<Expression>& expression);
-		void binary_operation(const std::shared_ptr<BinaryOperation>& operation);
-		void unary_operation(const std::shared_ptr<UnaryOperation>& operation);
-		void number(const std::shared_ptr<Number>& number);
-		void boolean(const std::shared_ptr<BoolValue>& boolean);
-		void name(const std::shared_ptr<Name>& name);
-		void call(const std::shared_ptr<Call>& call, bool invoke_method = false);
-		void lvalue_start(const std::shared_ptr<LValueStartNode>& lvalue_start);
-		void lvalue(const std::shared_ptr<LValue>& l_value);
+		void expression(Expression* expression);
+		void binary_operation(BinaryOperation* operation);
+		void unary_operation(UnaryOperation* operation);
+		void number(Number* number);
+		void boolean(BoolValue* boolean);
+		void name(Name* name);
+		void call(Call* call, bool invoke_method = false, bool tail = false);
+		void lvalue_start(LValueStartNode* lvalue_start);
+		void lvalue(LValue* l_value, Instruction member_instruction = Instruction::GET_MEMBER);
 
 		// Statements
-		void statement(const std::shared_ptr<Statement>& statement);
-		void log_statement(const std::shared_ptr<LogStatement>& log_statement);
-		void expression_statement(const std::shared_ptr<ExpressionStatement>& expression_statement);
-		void variable_declaration(const std::shared_ptr<VariableDeclaration>& variable_decl, bool make_member = false);
-		void assignment(const std::shared_ptr<Assignment>& assignment);
-		void compound_assignment(const std::shared_ptr<CompoundAssignment>& assignment);
-		void if_statement(const std::shared_ptr<IfStatement>& statement);
-		void while_statement(const std::shared_ptr<WhileStatement>& statement);
-		void compound_statement(const std::shared_ptr<CompoundStatement>& statement);
-		void break_statement(const std::shared_ptr<BreakStatement>& break_stmt);
-		void continue_statement(const std::shared_ptr<ContinueStatement>& continue_stmt);
-		void function_declaration(const std::shared_ptr<FunctionDeclaration>& function_decl, bool make_member = false);
-		void return_statement(const std::shared_ptr<ReturnStatement>& return_stmt);
-		void class_declaration(const std::shared_ptr<ClassDeclaration>& function_decl);
-		void enum_declaration(const std::shared_ptr<EnumDeclaration>& function_decl);
+		void statement(Statement* statement);
+		void log_statement(LogStatement* log_statement);
+		void expression_statement(ExpressionStatement* expression_statement);
+		void variable_declaration(VariableDeclaration* variable_decl, bool make_member = false);
+		void assignment(Assignment* assignment);
+		void compound_assignment(CompoundAssignment* assignment);
+		void if_statement(IfStatement* statement);
+		void while_statement(WhileStatement* statement);
+		void compound_statement(CompoundStatement* statement);
+		void break_statement(BreakStatement* break_stmt);
+		void continue_statement(ContinueStatement* continue_stmt);
+		void function_declaration(FunctionDeclaration* function_decl, bool make_member = false);
+		void return_statement(ReturnStatement* return_stmt);
+		void class_declaration(ClassDeclaration* function_decl);
+		void enum_declaration(EnumDeclaration* function_decl);
 	};
 }
\ No newline at end of file
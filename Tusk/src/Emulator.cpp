@@ -2,6 +2,13 @@
 #include "Emulator.h"
 #include "Bytecode.h"
 #include "Standard.h"
+#include <cmath>
+
+// GCC and Clang support taking the address of a label, which the dispatch loop uses to jump straight from
+// one instruction handler to the next. Define TK_SWITCH_DISPATCH to use the portable switch loop instead.
+#if defined(__GNUC__) && !defined(TK_SWITCH_DISPATCH)
+	#define TK_COMPUTED_GOTO
+#endif
 
 namespace Tusk {
 	inline bool is_true(const Value& val) {
@@ -11,80 +18,143 @@ namespace Tusk {
 	}
 
 	inline bool is_num(const Value& val) {
-		return val.is<int64_t>() || val.is<double>();
+		return val.is_number();
 	}
 
 	inline bool is_str(const Value& val) {
-		return val.is<std::shared_ptr<ValueObject>>() && val.get_object_type() == ObjectType::STRING;
+		return val.is_object(ObjectType::STRING);
 	}
 
-	inline uint8_t Emulator::next_byte() {
-		return (*bytes())[instruction_index()++];			// Return byte at index and advance it
+	static inline uint32_t read_wide(const uint8_t*& ip) {	// Reads a three byte operand and advances past it
+		uint32_t operand = ip[0] | (ip[1] << 8) | (ip[2] << 16);
+		ip += 3;
+		return operand;
 	}
 
-	inline const Value& Emulator::read_value() {
-		return (*bytes()).get_values()[next_byte()];		// Get the constant index and pass it to the constant pool to return the value
+	static inline uint32_t read_operand(const uint8_t*& ip, bool wide) {
+		return wide ? read_wide(ip) : *ip++;
 	}
 
-
-
 	void Emulator::init() {
+		m_names = { m_heap.intern("make"), m_heap.intern("append"), m_heap.intern("add"), m_heap.intern("size"),
+			m_heap.intern("pop"), m_heap.intern("get") };
+		set_max_call_depth(DEFAULT_MAX_CALL_DEPTH);
+		set_stack_size(DEFAULT_STACK_SIZE);
 		make_standard_fn("read", Standard::read);
 		make_standard_fn("List", Standard::List);
 	}
 
-	void Emulator::push_stack(const Value& val) {			// Push value to the stack
-		m_stack.push_back(val);
+	void Emulator::set_max_call_depth(size_t depth) {
+		m_max_call_depth = std::max<size_t>(depth, 1);		// The script needs a frame too
+		m_frames = std::make_unique<CallFrame[]>(m_max_call_depth);
+		m_frames_top = m_frames.get();
 	}
 
-	Value Emulator::pop_stack() {							// Pop stack value and return it
-		Value to_ret = m_stack[m_stack.size() - 1];
-		m_stack.pop_back();
-		return to_ret;
+	void Emulator::set_stack_size(size_t values) {
+		m_stack = std::make_unique<Value[]>(values);
+		m_stack_top = m_stack.get();
+		m_stack_end = m_stack.get() + values;
 	}
 
-	Result Emulator::binary_operation(TokenType operation) {
-		if (!is_num(stack_top(1)) || !is_num(stack_top())) {
-			m_error_handler.report_error("Operands must be numbers", {}, ErrorType::RUNTIME_ERROR);
-			return Result::RUNTIME_ERROR;
-		}
-		Value b = pop_stack();
-		Value a = pop_stack();
-
+	// Integers stay int64 and wrap around on overflow like two's complement, results outside the 48 bit range
+	// are boxed on the heap. Without a heap those fail, the Simplifier leaves them to the emulator.
+	// Division only gives an integer when it is exact, dividing by zero follows the double rules.
+	// Shift counts only use their lowest six bits
+	static bool int_arithmetic(TokenType operation, int64_t a, int64_t b, Value& result, Heap* heap) {
+		int64_t integer;
 		switch (operation) {
-		case TokenType::PLUS:
-			push_stack((a.is<double>() ? a.get<double>() : a.get<int64_t>())
-				+ (b.is<double>() ? b.get<double>() : b.get<int64_t>()));
-			break;
-		case TokenType::MINUS:
-			push_stack((a.is<double>() ? a.get<double>() : a.get<int64_t>())
-				- (b.is<double>() ? b.get<double>() : b.get<int64_t>()));
-			break;
-		case TokenType::STAR:
-			push_stack((a.is<double>() ? a.get<double>() : a.get<int64_t>())
-				* (b.is<double>() ? b.get<double>() : b.get<int64_t>()));
-			break;
+		case TokenType::PLUS: integer = (int64_t)((uint64_t)a + (uint64_t)b); break;
+		case TokenType::MINUS: integer = (int64_t)((uint64_t)a - (uint64_t)b); break;
+		case TokenType::STAR: integer = (int64_t)((uint64_t)a * (uint64_t)b); break;
 		case TokenType::SLASH:
-			push_stack((a.is<double>() ? a.get<double>() : a.get<int64_t>())
-				/ (b.is<double>() ? b.get<double>() : b.get<int64_t>()));
-			break;
-		case TokenType::LESS:
-			push_stack((a.is<double>() ? a.get<double>() : a.get<int64_t>())
-				< (b.is<double>() ? b.get<double>() : b.get<int64_t>()));
-			break;
-		case TokenType::GREATER:
-			push_stack((a.is<double>() ? a.get<double>() : a.get<int64_t>())
-				> (b.is<double>() ? b.get<double>() : b.get<int64_t>()));
-			break;
-		case TokenType::GREATER_EQUAL:
-			push_stack((a.is<double>() ? a.get<double>() : a.get<int64_t>())
-				>= (b.is<double>() ? b.get<double>() : b.get<int64_t>()));
+			if (b == -1)												// The int64 minimum divided by -1 wraps to itself
+				integer = (int64_t)(0 - (uint64_t)a);
+			else if (b != 0 && a % b == 0)
+				integer = a / b;
+			else {
+				result = Value((double)a / (double)b);
+				return true;
+			}
 			break;
-		case TokenType::LESS_EQUAL:
-			push_stack((a.is<double>() ? a.get<double>() : a.get<int64_t>())
-				<= (b.is<double>() ? b.get<double>() : b.get<int64_t>()));
+		case TokenType::PERCENT:
+			if (b == 0) {
+				result = Value(std::fmod((double)a, (double)b));
+				return true;
+			}
+			integer = b == -1 ? 0 : a % b;
 			break;
+		case TokenType::AMPERSAND: integer = a & b; break;
+		case TokenType::PIPE: integer = a | b; break;
+		case TokenType::CAP: integer = a ^ b; break;
+		case TokenType::L_SHIFT: integer = (int64_t)((uint64_t)a << (b & 63)); break;
+		case TokenType::R_SHIFT: integer = a >> (b & 63); break;
+		case TokenType::LESS: result = Value(a < b); return true;
+		case TokenType::GREATER: result = Value(a > b); return true;
+		case TokenType::LESS_EQUAL: result = Value(a <= b); return true;
+		case TokenType::GREATER_EQUAL: result = Value(a >= b); return true;
+		default: return false;
 		}
+		if (Value::fits_inline(integer))
+			result = Value(integer);
+		else if (heap)
+			result = heap->make_int(integer);
+		else
+			return false;
+		return true;
+	}
+
+	static bool double_arithmetic(TokenType operation, double a, double b, Value& result) {
+		switch (operation) {
+		case TokenType::PLUS: result = Value(a + b); return true;
+		case TokenType::MINUS: result = Value(a - b); return true;
+		case TokenType::STAR: result = Value(a * b); return true;
+		case TokenType::SLASH: result = Value(a / b); return true;
+		case TokenType::PERCENT: result = Value(std::fmod(a, b)); return true;
+		case TokenType::LESS: result = Value(a < b); return true;
+		case TokenType::GREATER: result = Value(a > b); return true;
+		case TokenType::LESS_EQUAL: result = Value(a <= b); return true;
+		case TokenType::GREATER_EQUAL: result = Value(a >= b); return true;
+		default: return false;										// Bitwise operators only take integers
+		}
+	}
+
+	enum NumberTypes {											// Both operand types combined into one tag
+		INT_INT = 0,
+		INT_DOUBLE = 1,
+		DOUBLE_INT = 3,
+		DOUBLE_DOUBLE = 4
+	};
+
+	static inline uint32_t number_tag(const Value& val) {
+		return val.is<int64_t>() ? 0 : val.is<double>() ? 1 : val.is_int() ? 0 : 2;
+	}
+
+	bool Emulator::arithmetic(TokenType operation, const Value& a, const Value& b, Value& result, Heap* heap) {
+		switch (number_tag(a) * 3 + number_tag(b)) {
+		case INT_INT:
+			return int_arithmetic(operation, a.as_int(), b.as_int(), result, heap);
+		case DOUBLE_DOUBLE:
+			return double_arithmetic(operation, a.get<double>(), b.get<double>(), result);
+		case INT_DOUBLE:
+		case DOUBLE_INT:
+			return double_arithmetic(operation, a.as_number(), b.as_number(), result);
+		default:
+			return false;
+		}
+	}
+
+	Result Emulator::binary_operation(TokenType operation) {
+		Value result;
+		if (!arithmetic(operation, stack_top(1), stack_top(), result, &m_heap)) {
+			if (is_num(stack_top(1)) && is_num(stack_top()))
+				m_error_handler.report_error("Operands must be integers", {}, ErrorType::RUNTIME_ERROR);
+			else
+				m_error_handler.report_error("Operands must be numbers", {}, ErrorType::RUNTIME_ERROR);
+			return Result::RUNTIME_ERROR;
+		}
+		m_stack_top--;
+		stack_top() = result;
+		safepoint();											// The result may have been boxed
 		return Result::OK;
 	}
 
@@ -92,102 +162,231 @@ namespace Tusk {
 		Value b = pop_stack();
 		Value a = pop_stack();
 
-		if (is_num(a) && is_num(b)) {
-			return (a.is<double>() ? a.get<double>() : a.get<int64_t>())
-				== (b.is<double>() ? b.get<double>() : b.get<int64_t>());
-		}
+		if (a.is<int64_t>() && b.is<int64_t>())
+			return a.same(b);
+		if (a.is_int() && b.is_int())							// One of them is boxed
+			return a.as_int() == b.as_int();
+		if (is_num(a) && is_num(b))
+			return a.as_number() == b.as_number();
 		if (b.get_type() != a.get_type())
 				return false;
-		if (b.is<bool>())
-			return a.get<bool>() == b.get<bool>();
+		if (is_str(a) && is_str(b)) {
+			StringObject* string_a = a.get_object<StringObject>();
+			StringObject* string_b = b.get_object<StringObject>();
+			if (string_a == string_b || (string_a->interned && string_b->interned))	// Equal interned strings are one object
+				return string_a == string_b;
+			return string_a->length == string_b->length && string_a->get() == string_b->get();
+		}
+		if (a.is_object(ObjectType::ENUM_VALUE) && b.is_object(ObjectType::ENUM_VALUE)) {	// Each member access makes a new value
+			EnumValue* value_a = a.get_object<EnumValue>();
+			EnumValue* value_b = b.get_object<EnumValue>();
+			return value_a->enum_obj == value_b->enum_obj && value_a->enum_name == value_b->enum_name;
+		}
+		return a.same(b);										// Booleans, void and object identity
 	}
 
 	Result Emulator::run(const Unit* unit) {
-		push_data({unit});
+		if (!has_room(*unit))
+			return stack_overflow("script");
+		*m_frames_top++ = { nullptr, unit, unit->code(), m_stack_top, false };
 		Result res = run();
-		//m_instruction_index = 0;
-		pop_data();
-		m_stack.clear();
+		m_frames_top = m_frames.get();						// Frames left behind by a runtime error are dropped with their values
+		m_stack_top = m_stack.get();
 		return res;
 	}
 
-	void Emulator::str_concatenate(const std::shared_ptr<StringObject>& str1, const std::shared_ptr<StringObject>& str2) {
-		push_stack(Value(std::make_shared<StringObject>(str1->string + str2->string)));
+	void Emulator::str_concatenate(StringObject* str1, StringObject* str2) {
+		if (str1->length + str2->length <= MAX_FLAT_CONCATENATION && !str1->is_rope() && !str2->is_rope())
+			push_stack(m_heap.make_string(str1->string + str2->string));
+		else
+			push_stack(Value(m_heap.allocate<StringObject>(str1, str2)));
 	}
 
 	Result Emulator::run() {
- 		Instruction instruction;
+		const Unit* unit;										// The running frame, kept in locals and reloaded when calls push or pop one
+		const uint8_t* ip;
+		const Value* constants;
+		Value* frame;
+		bool wide;
+		Value bound;
+		Value result;
+
+#define LOAD_FRAME() do { \
+			const CallFrame& running = running_frame(); \
+			unit = running.unit; ip = running.ip; constants = unit->get_values().data(); frame = running.base; \
+		} while (false)
+		LOAD_FRAME();
+
+#ifdef TK_DISPATCH_STATS
+#define COUNT_DISPATCH() m_dispatch_count++
+#else
+#define COUNT_DISPATCH()
+#endif
+
+#ifdef TK_COMPUTED_GOTO
+		static void* const dispatch_table[] = {		// In the order of Instruction
+			&&op_ADD, &&op_SUBTRACT, &&op_MULTIPLY, &&op_DIVIDE,
+			&&op_MODULO, &&op_BIT_AND, &&op_BIT_OR, &&op_BIT_XOR, &&op_SHIFT_LEFT, &&op_SHIFT_RIGHT, &&op_RETURN,
+			&&op_VAL_INDEX, &&op_VAL_INDEX_WIDE, &&op_VAL_INT, &&op_VAL_INT_WIDE,
+			&&op_POP, &&op_LOG, &&op_LOGL, &&op_NEGATE,
+			&&op_EQUAL, &&op_NOT_EQUAL, &&op_GREATER, &&op_LESS, &&op_GREATER_EQUAL, &&op_LESS_EQUAL,
+			&&op_NOT, &&op_AND, &&op_OR, &&op_VOID,
+			&&op_MAKE_GLOBAL, &&op_MAKE_GLOBAL_WIDE, &&op_GET_GLOBAL, &&op_GET_GLOBAL_WIDE, &&op_SET_GLOBAL, &&op_SET_GLOBAL_WIDE,
+			&&op_JUMP, &&op_JUMP_IF_FALSE,
+			&&op_SET_LOCAL, &&op_SET_LOCAL_WIDE, &&op_GET_LOCAL, &&op_GET_LOCAL_WIDE,
+			&&op_CALL, &&op_CALL_WIDE, &&op_TAIL_CALL, &&op_TAIL_CALL_WIDE,
+			&&op_GET_MEMBER, &&op_GET_MEMBER_WIDE, &&op_SET_MEMBER, &&op_SET_MEMBER_WIDE,
+			&&op_MAKE_MEMBER, &&op_MAKE_MEMBER_WIDE, &&op_METHOD_CALL, &&op_METHOD_CALL_WIDE,
+			&&op_INHERIT,
+			&&op_LOG_POP, &&op_LOGL_POP, &&op_RETURN_VOID, &&op_SET_LOCAL_POP, &&op_ADD_LOCALS,
+			&&op_LESS_CONST_JUMP_IF_FALSE, &&op_LESS_INT_JUMP_IF_FALSE,
+			&&op_ADD_INT_INT, &&op_ADD_F64, &&op_CONCAT_STR, &&op_SUBTRACT_INT_INT, &&op_SUBTRACT_F64,
+			&&op_MULTIPLY_INT_INT, &&op_MULTIPLY_F64, &&op_LESS_INT, &&op_LESS_EQUAL_INT, &&op_GREATER_INT,
+			&&op_GREATER_EQUAL_INT, &&op_GET_MEMBER_CACHED,
+		};
+		static_assert(sizeof(dispatch_table) / sizeof(void*) == INSTRUCTION_COUNT, "Every instruction needs a dispatch table entry");
+#define TARGET(name) op_##name
+#define DISPATCH() do { COUNT_DISPATCH(); goto *dispatch_table[*ip++]; } while (false)
+		DISPATCH();
+		{
+#else
+#define TARGET(name) case Instruction::name
+#define DISPATCH() continue
 		while (true) {
-			switch (instruction = (Instruction)next_byte()) {
-			case Instruction::VAL_INDEX:
-				m_stack.push_back(read_value());
-				break;
-			case Instruction::ADD:
-				if (is_str(stack_top()) && is_str(stack_top(1)))
-					str_concatenate(pop_stack().get_object<StringObject>(), pop_stack().get_object<StringObject>());
+			COUNT_DISPATCH();
+			switch ((Instruction)*ip++) {
+#endif
+			TARGET(VAL_INDEX):
+				push_stack(constants[*ip++]);
+				DISPATCH();
+			TARGET(VAL_INDEX_WIDE):
+				push_stack(constants[read_wide(ip)]);
+				DISPATCH();
+			TARGET(VAL_INT):
+				push_stack(Value((int64_t)(int8_t)*ip++));
+				DISPATCH();
+			TARGET(VAL_INT_WIDE):
+				push_stack(Value((int64_t)Unit::to_offset(read_wide(ip))));
+				DISPATCH();
+			TARGET(ADD):
+				quicken_binary(*unit, ip - 1, Instruction::ADD_INT_INT, Instruction::ADD_F64, Instruction::CONCAT_STR);
+			add:
+				if (is_str(stack_top()) && is_str(stack_top(1))) {
+					StringObject* right = pop_stack().get_object<StringObject>();
+					StringObject* left = pop_stack().get_object<StringObject>();
+					str_concatenate(left, right);
+					safepoint();
+				}
 				else if (binary_operation(TokenType::PLUS) != Result::OK)
 					return Result::RUNTIME_ERROR;
-				break;
-			case Instruction::SUBTRACT:
+				DISPATCH();
+			TARGET(SUBTRACT):
+				quicken_binary(*unit, ip - 1, Instruction::SUBTRACT_INT_INT, Instruction::SUBTRACT_F64, Instruction::SUBTRACT);
+			subtract:
 				if (binary_operation(TokenType::MINUS) != Result::OK)
 					return Result::RUNTIME_ERROR;
-				break;
-			case Instruction::MULTIPLY:
+				DISPATCH();
+			TARGET(MULTIPLY):
+				quicken_binary(*unit, ip - 1, Instruction::MULTIPLY_INT_INT, Instruction::MULTIPLY_F64, Instruction::MULTIPLY);
+			multiply:
 				if (binary_operation(TokenType::STAR) != Result::OK)
 					return Result::RUNTIME_ERROR;
-				break;
-			case Instruction::DIVIDE:
+				DISPATCH();
+			TARGET(DIVIDE):
 				if (binary_operation(TokenType::SLASH) != Result::OK)
 					return Result::RUNTIME_ERROR;
-				break;
-			case Instruction::RETURN:
-				//std::cout << pop_stack();
-				if (m_call_stack.size() != 1) {
-					m_return_value_register = pop_stack();
-				}
-				return Result::OK;
-			case Instruction::LOG:
+				DISPATCH();
+			TARGET(MODULO):
+				if (binary_operation(TokenType::PERCENT) != Result::OK)
+					return Result::RUNTIME_ERROR;
+				DISPATCH();
+			TARGET(BIT_AND):
+				if (binary_operation(TokenType::AMPERSAND) != Result::OK)
+					return Result::RUNTIME_ERROR;
+				DISPATCH();
+			TARGET(BIT_OR):
+				if (binary_operation(TokenType::PIPE) != Result::OK)
+					return Result::RUNTIME_ERROR;
+				DISPATCH();
+			TARGET(BIT_XOR):
+				if (binary_operation(TokenType::CAP) != Result::OK)
+					return Result::RUNTIME_ERROR;
+				DISPATCH();
+			TARGET(SHIFT_LEFT):
+				if (binary_operation(TokenType::L_SHIFT) != Result::OK)
+					return Result::RUNTIME_ERROR;
+				DISPATCH();
+			TARGET(SHIFT_RIGHT):
+				if (binary_operation(TokenType::R_SHIFT) != Result::OK)
+					return Result::RUNTIME_ERROR;
+				DISPATCH();
+			TARGET(RETURN):
+				if (call_depth() == 1)
+					return Result::OK;
+				result = stack_top();
+			return_from_frame: {
+				const CallFrame& returning = running_frame();
+				if (!returning.constructor)						// A constructor leaves the instance it was called on
+					*returning.base = result;
+				m_stack_top = returning.base + 1;				// The arguments and locals go away with the frame
+				m_frames_top--;
+				LOAD_FRAME();
+				DISPATCH();
+			}
+			TARGET(LOG):
 				std::cout << stack_top();
-				break;
-			case Instruction::LOGL:
+				DISPATCH();
+			TARGET(LOGL):
 				std::cout << stack_top() << '\n';
-				break;
-			case Instruction::POP:
+				DISPATCH();
+			TARGET(POP):
 				pop_stack();
-				break;
-			case Instruction::NEGATE: {
+				DISPATCH();
+			TARGET(NEGATE): {
 				Value val = pop_stack();
-				if (val.is<int64_t>() || val.is<double>())
-					push_stack(-(val.is<int64_t>() ? val.get<int64_t>() : val.get<double>()));
+				if (val.is_int()) {
+					push_stack(m_heap.make_int((int64_t)(0 - (uint64_t)val.as_int())));	// Wraps around at the int64 minimum
+					safepoint();
+				}
+				else if (val.is<double>())
+					push_stack(Value(-val.get<double>()));
 				else {
 					m_error_handler.report_error("Operand must be number", {}, ErrorType::RUNTIME_ERROR);
 					return Result::RUNTIME_ERROR;
 				}
-				break;
+				DISPATCH();
 			}
-			case Instruction::LESS:
+			TARGET(LESS):
+				quicken_binary(*unit, ip - 1, Instruction::LESS_INT, Instruction::LESS, Instruction::LESS);
+			less:
 				if (binary_operation(TokenType::LESS) != Result::OK)
 					return Result::RUNTIME_ERROR;
-				break;
-			case Instruction::GREATER:
+				DISPATCH();
+			TARGET(GREATER):
+				quicken_binary(*unit, ip - 1, Instruction::GREATER_INT, Instruction::GREATER, Instruction::GREATER);
+			greater:
 				if (binary_operation(TokenType::GREATER) != Result::OK)
 					return Result::RUNTIME_ERROR;
-				break;
-			case Instruction::GREATER_EQUAL:
+				DISPATCH();
+			TARGET(GREATER_EQUAL):
+				quicken_binary(*unit, ip - 1, Instruction::GREATER_EQUAL_INT, Instruction::GREATER_EQUAL, Instruction::GREATER_EQUAL);
+			greater_equal:
 				if (binary_operation(TokenType::GREATER_EQUAL) != Result::OK)
 					return Result::RUNTIME_ERROR;
-				break;
-			case Instruction::LESS_EQUAL:
+				DISPATCH();
+			TARGET(LESS_EQUAL):
+				quicken_binary(*unit, ip - 1, Instruction::LESS_EQUAL_INT, Instruction::LESS_EQUAL, Instruction::LESS_EQUAL);
+			less_equal:
 				if (binary_operation(TokenType::LESS_EQUAL) != Result::OK)
 					return Result::RUNTIME_ERROR;
-				break;
-			case Instruction::EQUAL:
+				DISPATCH();
+			TARGET(EQUAL):
 				push_stack(equality());
-				break;
-			case Instruction::NOT_EQUAL:
+				DISPATCH();
+			TARGET(NOT_EQUAL):
 				push_stack(!equality());
-				break;
-			case Instruction::NOT: {
+				DISPATCH();
+			TARGET(NOT): {
 				Value val = pop_stack();
 				if (val.is<bool>())
 					push_stack(!val.get<bool>());
@@ -195,82 +394,156 @@ namespace Tusk {
 					m_error_handler.report_error("Operand must be boolean", {}, ErrorType::RUNTIME_ERROR);
 					return Result::RUNTIME_ERROR;
 				}
-				break;
+				DISPATCH();
 			}
-			case Instruction::VOID:
-				push_stack(Value(std::make_shared<VoidObject>()));
-				break;
-			case Instruction::MAKE_GLOBAL: {
-				std::shared_ptr<StringObject> val = read_value().get_object<StringObject>();
-				if (m_global_table.find(val->string) != m_global_table.end()) {
-					m_error_handler.report_error("Global name '" + val->string + "' already exists", {}, ErrorType::RUNTIME_ERROR);
+			TARGET(AND):
+			TARGET(OR): {
+				if (!stack_top().is<bool>() || !stack_top(1).is<bool>()) {
+					m_error_handler.report_error("Operands must be boolean", {}, ErrorType::RUNTIME_ERROR);
 					return Result::RUNTIME_ERROR;
 				}
-				m_global_table[val->string] = pop_stack();
-				break;
-			}
-			case Instruction::GET_GLOBAL: {
-				std::shared_ptr<StringObject> val = read_value().get_object<StringObject>();
-				push_stack(m_global_table[val->string]);
-				break;
+				bool b = pop_stack().get<bool>();
+				stack_top() = Value((Instruction)ip[-1] == Instruction::AND ? stack_top().get<bool>() && b : stack_top().get<bool>() || b);
+				DISPATCH();
 			}
-			case Instruction::SET_GLOBAL: {
-				std::shared_ptr<StringObject> val = read_value().get_object<StringObject>();
-				m_global_table[val->string] = pop_stack();
-				break;
+			TARGET(VOID):
+				push_stack(Value(nullptr));
+				DISPATCH();
+			TARGET(MAKE_GLOBAL_WIDE):
+				wide = true;
+				goto make_global;
+			TARGET(MAKE_GLOBAL):
+				wide = false;
+			make_global: {
+				uint32_t slot = read_operand(ip, wide);
+				if (m_global_defined[slot]) {
+					m_error_handler.report_error("Global name '" + m_global_names[slot] + "' already exists", {}, ErrorType::RUNTIME_ERROR);
+					return Result::RUNTIME_ERROR;
+				}
+				m_globals[slot] = pop_stack();
+				m_global_defined[slot] = true;
+				DISPATCH();
 			}
-			case Instruction::JUMP_IF_FALSE: {
-				int64_t val = read_value().get<int64_t>();
+			TARGET(GET_GLOBAL):
+				push_stack(m_globals[*ip++]);
+				DISPATCH();
+			TARGET(GET_GLOBAL_WIDE):
+				push_stack(m_globals[read_wide(ip)]);
+				DISPATCH();
+			TARGET(SET_GLOBAL):
+				m_globals[*ip++] = pop_stack();
+				DISPATCH();
+			TARGET(SET_GLOBAL_WIDE):
+				m_globals[read_wide(ip)] = pop_stack();
+				DISPATCH();
+			TARGET(JUMP_IF_FALSE): {
+				int32_t offset = Unit::to_offset(read_wide(ip));
 				if (!is_true(pop_stack()))
-					instruction_index() = val;
-				break;
+					ip += offset;
+				DISPATCH();
 			}
-			case Instruction::JUMP: {
-				instruction_index() = read_value().get<int64_t>();
-				break;
-			}
-			case Instruction::SET_LOCAL: {
-				int64_t val = read_value().get<int64_t>();
-				m_stack[val + m_call_stack[m_call_stack.size() - 1].stack_size_before_args] = stack_top();
-				break;
-			}
-			case Instruction::GET_LOCAL: {
-				int64_t val = read_value().get<int64_t>();
-				push_stack(m_stack[val + m_call_stack[m_call_stack.size() - 1].stack_size_before_args]);
-				break;
-			}
-			case Instruction::CALL: {
-				uint8_t arg_count = next_byte();
+			TARGET(JUMP):
+				ip += Unit::to_offset(read_wide(ip));
+				DISPATCH();
+			TARGET(SET_LOCAL):
+				frame[*ip++] = stack_top();
+				DISPATCH();
+			TARGET(SET_LOCAL_WIDE):
+				frame[read_wide(ip)] = stack_top();
+				DISPATCH();
+			TARGET(GET_LOCAL):
+				push_stack(frame[*ip++]);
+				DISPATCH();
+			TARGET(GET_LOCAL_WIDE):
+				push_stack(frame[read_wide(ip)]);
+				DISPATCH();
+			TARGET(CALL_WIDE):
+				wide = true;
+				goto call_function;
+			TARGET(CALL):
+				wide = false;
+			call_function: {
+				uint32_t arg_count = read_operand(ip, wide);
+				running_frame().ip = ip;
 				Result res = call(stack_top(arg_count), arg_count);
 				if (res != Result::OK)
 					return res;
-				break;
+				LOAD_FRAME();
+				safepoint();
+				DISPATCH();
+			}
+			TARGET(TAIL_CALL_WIDE):
+				wide = true;
+				goto tail_call;
+			TARGET(TAIL_CALL):
+				wide = false;
+			tail_call: {
+				uint32_t arg_count = read_operand(ip, wide);
+				Value callee = stack_top(arg_count);
+				const CallFrame& current = running_frame();
+				// Only function frames are replaced, the script has no caller and a constructor must keep its instance
+				if (callee.is_object(ObjectType::FUNCTION) && call_depth() != 1 && !current.constructor) {
+					FunctionObject* func = callee.get_object<FunctionObject>();
+					if (func->arg_count != arg_count) {
+						m_error_handler.report_error("Function '" + func->function_name + "' expects " + std::to_string(func->arg_count) + " arguments but got " + std::to_string(arg_count), {}, ErrorType::RUNTIME_ERROR);
+						return Result::RUNTIME_ERROR;
+					}
+					if (!func->code_unit && !compile_lazy(func))
+						return Result::RUNTIME_ERROR;
+					Value* base = current.base;
+					std::copy(m_stack_top - arg_count - 1, m_stack_top, base);
+					m_stack_top = base + arg_count + 1;
+					if (!has_room(*func->code_unit))
+						return stack_overflow(func->function_name);
+					running_frame() = { func, func->code_unit.get(), func->code_unit->code(), base, false };
+					LOAD_FRAME();
+					safepoint();
+					DISPATCH();
+				}
+				running_frame().ip = ip;						// Anything else is called normally, the RETURN after it still runs
+				Result res = call(callee, arg_count);
+				if (res != Result::OK)
+					return res;
+				LOAD_FRAME();
+				safepoint();
+				DISPATCH();
 			}
-			case Instruction::GET_MEMBER: {
+			TARGET(GET_MEMBER_WIDE):
+				wide = true;
+				goto get_member;
+			TARGET(GET_MEMBER):
+				wide = false;
+			get_member: {
+				const uint8_t* site = ip - 1;
 				Value val = pop_stack();
-				if (val.is<std::shared_ptr<ValueObject>>()) {
+				if (val.is_object()) {
 					switch (val.get_object_type())
 					{
 					case ObjectType::INSTANCE: {
-						std::shared_ptr<InstanceObject> instance = val.get_object<InstanceObject>();
-						const std::string& name = read_value().get_object<StringObject>()->string;
-						if (instance->public_members.find(name) == instance->public_members.end()) {
-							m_error_handler.report_error("Instance of class " + instance->class_ref.class_name + " does not have member " + name, {}, ErrorType::RUNTIME_ERROR);
+						InstanceObject* instance = val.get_object<InstanceObject>();
+						const Value& name = constants[read_operand(ip, wide)];
+						uint32_t cache_index = read_operand(ip, wide);
+						Value member;
+						if (!get_member_cached(instance, name, cache_index, member)) {
+							m_error_handler.report_error("Instance of class " + instance->class_ref.class_name + " does not have member " + name.get_object<StringObject>()->string, {}, ErrorType::RUNTIME_ERROR);
 							return Result::RUNTIME_ERROR;
 						}
-						else
-							push_stack(instance->public_members[name]);
+						push_stack(member);
+						if (!wide)
+							quicken_member(*unit, site, cache_index);
 						break;
 					}
 					case ObjectType::ENUM: {
-						std::shared_ptr<EnumObject> instance = val.get_object<EnumObject>();
-						const std::string& name = read_value().get_object<StringObject>()->string;
+						EnumObject* instance = val.get_object<EnumObject>();
+						const std::string& name = constants[read_operand(ip, wide)].get_object<StringObject>()->string;
+						read_operand(ip, wide);						// Enum values are not cached
 						if (std::find(instance->values.begin(), instance->values.end(), name) == instance->values.end()) {
 							m_error_handler.report_error("Enum " + instance->name + " does not have value " + name, {}, ErrorType::RUNTIME_ERROR);
 							return Result::RUNTIME_ERROR;
 						}
 						else
-							push_stack(Value(std::make_shared<EnumValue>(instance, name)));
+							push_stack(Value(m_heap.allocate<EnumValue>(instance, name)));
+						safepoint();
 						break;
 					}
 					default:
@@ -283,115 +556,297 @@ namespace Tusk {
 					return Result::RUNTIME_ERROR;
 				}
 				
-				break;
+				DISPATCH();
 			}
-			case Instruction::SET_MEMBER: {
+			TARGET(SET_MEMBER_WIDE):
+				wide = true;
+				goto set_member;
+			TARGET(SET_MEMBER):
+				wide = false;
+			set_member: {
 				Value val = pop_stack();
-				if (!(val.is<std::shared_ptr<ValueObject>>() && val.get_object_type() == ObjectType::INSTANCE)) {
+				if (!val.is_object(ObjectType::INSTANCE)) {
 					m_error_handler.report_error("Cannot set members of a non-instance", {}, ErrorType::RUNTIME_ERROR);
 					return Result::RUNTIME_ERROR;
 				}
-				std::shared_ptr<InstanceObject> instance = val.get_object<InstanceObject>();
-				const std::string& name = read_value().get_object<StringObject>()->string;
+				InstanceObject* instance = val.get_object<InstanceObject>();
+				const Value& name = constants[read_operand(ip, wide)];
+				uint32_t cache_index = read_operand(ip, wide);
 				//if (instance->public_members.find(name) == instance->public_members.end()) {
 				//	m_error_handler.report_error("Instance of class " + instance->class_ref.class_name + " does not have member " + name, {}, ErrorType::RUNTIME_ERROR);
 				//	return Result::RUNTIME_ERROR;
 				//}
 				//else
-				instance->public_members[name] = pop_stack();
-				break;
+				Value member = pop_stack();
+				set_member_cached(instance, name, cache_index, member);
+				m_heap.write_barrier(instance, member);
+				DISPATCH();
 			}
-			case Instruction::MAKE_MEMBER: {
-				std::shared_ptr<StringObject> val = read_value().get_object<StringObject>();
-				if (m_global_table.find(val->string) != m_global_table.end()) {
+			TARGET(MAKE_MEMBER_WIDE):
+				wide = true;
+				goto make_member;
+			TARGET(MAKE_MEMBER):
+				wide = false;
+			make_member: {
+				const StringObject* val = constants[read_operand(ip, wide)].get_object<StringObject>();
+				int32_t slot = find_global(val->string);
+				if (slot != -1 && m_global_defined[slot]) {
 					m_error_handler.report_error("Global name '" + val->string + "' already exists", {}, ErrorType::RUNTIME_ERROR);
 					return Result::RUNTIME_ERROR;
 				}
-				stack_top().get_object<ClassObject>()->public_members[val->string] = pop_stack();
-				break;
+				Value member = pop_stack();
+				if (!stack_top().is_object(ObjectType::CLASS)) {	// Only a damaged saved unit gets here with anything else
+					m_error_handler.report_error("Cannot add members to a non-class", {}, ErrorType::RUNTIME_ERROR);
+					return Result::RUNTIME_ERROR;
+				}
+				ClassObject* class_obj = stack_top().get_object<ClassObject>();
+				if (member.is_object(ObjectType::FUNCTION))
+					class_obj->methods[val] = member;
+				else
+					class_obj->declare_field(val, member);
+				m_heap.write_barrier(class_obj, member);
+				DISPATCH();
 			}
-			case Instruction::METHOD_CALL: {
-				uint8_t arg_count = next_byte();
-				const std::string& name = read_value().get_object<StringObject>()->string;
+			TARGET(METHOD_CALL_WIDE):
+				wide = true;
+				goto method_call;
+			TARGET(METHOD_CALL):
+				wide = false;
+			method_call: {
+				uint32_t arg_count = read_operand(ip, wide);
+				const Value& name = constants[read_operand(ip, wide)];
+				uint32_t cache_index = read_operand(ip, wide);
 				Value val = stack_top(arg_count);
-				if (val.is<std::shared_ptr<ValueObject>>() && val.get_object_type() == ObjectType::LIST) {
-					std::shared_ptr<ListValue> list = val.get_object<ListValue>();
-					if (list_function(list, name, arg_count) != Result::OK)
+				if (val.is_object(ObjectType::LIST)) {
+					ListValue* list = val.get_object<ListValue>();
+					if (list_function(list, name.get_object<StringObject>(), arg_count) != Result::OK)
 						return Result::RUNTIME_ERROR;
-					break;
+					safepoint();
+					DISPATCH();
 				}
-				if (!(val.is<std::shared_ptr<ValueObject>>() && val.get_object_type() == ObjectType::INSTANCE)) {
+				if (!val.is_object(ObjectType::INSTANCE)) {
 					m_error_handler.report_error("Cannot access members of a non-instance", {}, ErrorType::RUNTIME_ERROR);
 					return Result::RUNTIME_ERROR;
 				}
-				std::shared_ptr<InstanceObject> instance = val.get_object<InstanceObject>();
-				if (instance->public_members.find(name) == instance->public_members.end()) {
-					m_error_handler.report_error("Instance of class " + instance->class_ref.class_name + " does not have member " + name, {}, ErrorType::RUNTIME_ERROR);
+				InstanceObject* instance = val.get_object<InstanceObject>();
+				Value method;
+				if (!get_member_cached(instance, name, cache_index, method)) {
+					m_error_handler.report_error("Instance of class " + instance->class_ref.class_name + " does not have member " + name.get_object<StringObject>()->string, {}, ErrorType::RUNTIME_ERROR);
 					return Result::RUNTIME_ERROR;
 				}
-				if (instance->public_members[name].get_object_type() != ObjectType::FUNCTION) {
+				if (!method.is_object(ObjectType::FUNCTION)) {
 					m_error_handler.report_error("Cannot call non-function and non-class objects", {}, ErrorType::RUNTIME_ERROR);
 					return Result::RUNTIME_ERROR;
 				}
-				Result res = call_method(name, arg_count);
+				running_frame().ip = ip;
+				Result res = push_frame(method.get_object<FunctionObject>(), arg_count);
 				if (res != Result::OK)
 					return res;
-				break;
+				LOAD_FRAME();
+				safepoint();
+				DISPATCH();
 			}
-			case Instruction::INHERIT: {
+			TARGET(INHERIT): {
 				Value val = pop_stack();
-				if (!(val.is<std::shared_ptr<ValueObject>>() && val.get_object_type() == ObjectType::CLASS)) {
+				if (!val.is_object(ObjectType::CLASS)) {
 					m_error_handler.report_error("Cannot inherit from non-class objects", {}, ErrorType::RUNTIME_ERROR);
 					return Result::RUNTIME_ERROR;
 				}
-				std::shared_ptr<ClassObject> _class = stack_top().get_object<ClassObject>();
-				for (const auto& [key, value] : val.get_object<ClassObject>()->public_members) {
-					_class->public_members[key] = value;
+				if (!stack_top().is_object(ObjectType::CLASS)) {
+					m_error_handler.report_error("Cannot inherit into a non-class", {}, ErrorType::RUNTIME_ERROR);
+					return Result::RUNTIME_ERROR;
+				}
+				ClassObject* _class = stack_top().get_object<ClassObject>();
+				ClassObject* parent = val.get_object<ClassObject>();
+				for (const auto& [key, value] : parent->methods) {
+					_class->methods[key] = value;
 				}
+				for (uint32_t i = 0; i < parent->field_defaults.size(); i++)
+					_class->declare_field(parent->instance_shape->field_names[i], parent->field_defaults[i]);
+				m_heap.remember(_class);
+				DISPATCH();
 			}
-
+			TARGET(LOG_POP):
+				std::cout << pop_stack();
+				DISPATCH();
+			TARGET(LOGL_POP):
+				std::cout << pop_stack() << '\n';
+				DISPATCH();
+			TARGET(RETURN_VOID):
+				if (call_depth() == 1)
+					return Result::OK;
+				result = Value();
+				goto return_from_frame;
+			TARGET(SET_LOCAL_POP):
+				frame[*ip++] = pop_stack();
+				DISPATCH();
+			TARGET(ADD_LOCALS):
+				push_stack(frame[ip[0]]);
+				push_stack(frame[ip[1]]);
+				ip += 2;
+				goto add;
+			TARGET(LESS_CONST_JUMP_IF_FALSE):
+				bound = constants[*ip++];
+				goto less_jump;
+			TARGET(LESS_INT_JUMP_IF_FALSE):
+				bound = Value((int64_t)(int8_t)*ip++);
+			less_jump: {
+				int32_t offset = Unit::to_offset(read_wide(ip));
+				if (!is_num(stack_top()) || !is_num(bound)) {
+					m_error_handler.report_error("Operands must be numbers", {}, ErrorType::RUNTIME_ERROR);
+					return Result::RUNTIME_ERROR;
+				}
+				Value value = pop_stack();
+				bool less = value.is_int() && bound.is_int() ? value.as_int() < bound.as_int()
+					: value.as_number() < bound.as_number();
+				if (!less)
+					ip += offset;
+				DISPATCH();
 			}
-
+			TARGET(ADD_INT_INT):
+				if (stack_top().is<int64_t>() && stack_top(1).is<int64_t>()) {
+					int_arithmetic(TokenType::PLUS, stack_top(1).get<int64_t>(), stack_top().get<int64_t>(), stack_top(1), &m_heap);
+					m_stack_top--;
+					safepoint();
+					DISPATCH();
+				}
+				deoptimize(*unit, ip - 1, Instruction::ADD);
+				goto add;
+			TARGET(ADD_F64):
+				if (stack_top().is<double>() && stack_top(1).is<double>()) {
+					stack_top(1) = Value(stack_top(1).get<double>() + stack_top().get<double>());
+					m_stack_top--;
+					DISPATCH();
+				}
+				deoptimize(*unit, ip - 1, Instruction::ADD);
+				goto add;
+			TARGET(CONCAT_STR):
+				if (is_str(stack_top()) && is_str(stack_top(1))) {
+					StringObject* right = pop_stack().get_object<StringObject>();
+					StringObject* left = pop_stack().get_object<StringObject>();
+					str_concatenate(left, right);
+					safepoint();
+					DISPATCH();
+				}
+				deoptimize(*unit, ip - 1, Instruction::ADD);
+				goto add;
+			TARGET(SUBTRACT_INT_INT):
+				if (stack_top().is<int64_t>() && stack_top(1).is<int64_t>()) {
+					int_arithmetic(TokenType::MINUS, stack_top(1).get<int64_t>(), stack_top().get<int64_t>(), stack_top(1), &m_heap);
+					m_stack_top--;
+					safepoint();
+					DISPATCH();
+				}
+				deoptimize(*unit, ip - 1, Instruction::SUBTRACT);
+				goto subtract;
+			TARGET(SUBTRACT_F64):
+				if (stack_top().is<double>() && stack_top(1).is<double>()) {
+					stack_top(1) = Value(stack_top(1).get<double>() - stack_top().get<double>());
+					m_stack_top--;
+					DISPATCH();
+				}
+				deoptimize(*unit, ip - 1, Instruction::SUBTRACT);
+				goto subtract;
+			TARGET(MULTIPLY_INT_INT):
+				if (stack_top().is<int64_t>() && stack_top(1).is<int64_t>()) {
+					int_arithmetic(TokenType::STAR, stack_top(1).get<int64_t>(), stack_top().get<int64_t>(), stack_top(1), &m_heap);
+					m_stack_top--;
+					safepoint();
+					DISPATCH();
+				}
+				deoptimize(*unit, ip - 1, Instruction::MULTIPLY);
+				goto multiply;
+			TARGET(MULTIPLY_F64):
+				if (stack_top().is<double>() && stack_top(1).is<double>()) {
+					stack_top(1) = Value(stack_top(1).get<double>() * stack_top().get<double>());
+					m_stack_top--;
+					DISPATCH();
+				}
+				deoptimize(*unit, ip - 1, Instruction::MULTIPLY);
+				goto multiply;
+			TARGET(LESS_INT):
+				if (stack_top().is<int64_t>() && stack_top(1).is<int64_t>()) {
+					stack_top(1) = Value(stack_top(1).get<int64_t>() < stack_top().get<int64_t>());
+					m_stack_top--;
+					DISPATCH();
+				}
+				deoptimize(*unit, ip - 1, Instruction::LESS);
+				goto less;
+			TARGET(LESS_EQUAL_INT):
+				if (stack_top().is<int64_t>() && stack_top(1).is<int64_t>()) {
+					stack_top(1) = Value(stack_top(1).get<int64_t>() <= stack_top().get<int64_t>());
+					m_stack_top--;
+					DISPATCH();
+				}
+				deoptimize(*unit, ip - 1, Instruction::LESS_EQUAL);
+				goto less_equal;
+			TARGET(GREATER_INT):
+				if (stack_top().is<int64_t>() && stack_top(1).is<int64_t>()) {
+					stack_top(1) = Value(stack_top(1).get<int64_t>() > stack_top().get<int64_t>());
+					m_stack_top--;
+					DISPATCH();
+				}
+				deoptimize(*unit, ip - 1, Instruction::GREATER);
+				goto greater;
+			TARGET(GREATER_EQUAL_INT):
+				if (stack_top().is<int64_t>() && stack_top(1).is<int64_t>()) {
+					stack_top(1) = Value(stack_top(1).get<int64_t>() >= stack_top().get<int64_t>());
+					m_stack_top--;
+					DISPATCH();
+				}
+				deoptimize(*unit, ip - 1, Instruction::GREATER_EQUAL);
+				goto greater_equal;
+			TARGET(GET_MEMBER_CACHED): {
+				const InlineCache::Entry& entry = unit->get_cache(ip[1]).entries[0];
+				if (stack_top().is_object(ObjectType::INSTANCE)) {
+					InstanceObject* instance = stack_top().get_object<InstanceObject>();
+					if (instance->shape->id == entry.shape_id) {
+						m_cache_stats.hits++;
+						stack_top() = instance->slots[entry.slot];
+						ip += 2;
+						DISPATCH();
+					}
+				}
+				deoptimize(*unit, ip - 1, Instruction::GET_MEMBER);
+				wide = false;
+				goto get_member;
+			}
+#ifdef TK_COMPUTED_GOTO
 		}
+#else
+			}
+		}
+#endif
+#undef TARGET
+#undef DISPATCH
+#undef COUNT_DISPATCH
+#undef LOAD_FRAME
 	}
 
-	Result Emulator::call(const Value& value_to_call, uint8_t arg_count) {
-		if (value_to_call.is<std::shared_ptr<ValueObject>>()) {
+	Result Emulator::call(const Value& value_to_call, uint32_t arg_count) {
+		if (value_to_call.is_object()) {
 			switch (value_to_call.get_object_type()) {
-			case ObjectType::FUNCTION: {
-				std::shared_ptr<FunctionObject> func = value_to_call.get_object<FunctionObject>();
-				push_data({ func->code_unit.get(), 0 });
-				m_call_stack.push_back(CallInfo{ func->function_name, m_stack.size() - arg_count - 1 });
-				Result res = run();
-				m_call_stack.pop_back();
-				pop_data();
-
-				push_stack(m_return_value_register);
-				return res;
-			}
+			case ObjectType::FUNCTION:
+				return push_frame(value_to_call.get_object<FunctionObject>(), arg_count);
 			case ObjectType::CLASS: {
-				std::shared_ptr<ClassObject> class_obj = value_to_call.get_object<ClassObject>();
-				std::shared_ptr<InstanceObject> instance = std::make_shared<InstanceObject>(*class_obj.get());
-				instance->private_members = class_obj->private_members;
-				instance->public_members = class_obj->public_members;
-				Result res = Result::OK;
-				m_stack[m_stack.size() - arg_count - 1] = Value(instance);
-				if (instance->public_members.find("make") != instance->public_members.end()) {
-					res = call(instance->public_members["make"], arg_count);
-					pop_stack();
-				}
-				return res;
+				ClassObject* class_obj = value_to_call.get_object<ClassObject>();
+				InstanceObject* instance = m_heap.make_instance(*class_obj);
+				stack_top(arg_count) = Value(instance);
+				auto constructor = class_obj->methods.find(m_names.make);
+				if (constructor != class_obj->methods.end())
+					return push_frame(constructor->second.get_object<FunctionObject>(), arg_count, true);
+				m_stack_top -= arg_count;						// Without a constructor the instance is the result
+				return Result::OK;
 			}
 			case ObjectType::STANDARD_FN: {
 				StandardFnType std_func = value_to_call.get_object<StandardFn>()->function;
-				Standard::FunctionReturn ret = std_func(arg_count, &stack_top() - arg_count);
+				Standard::FunctionReturn ret = std_func(m_heap, arg_count, &stack_top() - arg_count);
 				if (ret.res != Standard::FunctionResult::OK) {
 					m_error_handler.report_error(ret.error_msg, {}, ErrorType::RUNTIME_ERROR);
 					return Result::RUNTIME_ERROR;
 				}
 				Value res = ret.val;
-				for (int i = 0; i <= arg_count; i++)
-					m_stack.pop_back();
+				m_stack_top -= arg_count + 1;
 				push_stack(res);
 				return Result::OK;
 			}
@@ -403,47 +858,228 @@ namespace Tusk {
 		return Result::RUNTIME_ERROR;
 	}
 
-	Result Emulator::call_method(const std::string& name, uint8_t arg_count) {
-		Value value_to_call = stack_top(arg_count);
-		if (value_to_call.is<std::shared_ptr<ValueObject>>()) {
-			if(value_to_call.get_object_type() == ObjectType::INSTANCE) {
-				std::shared_ptr<FunctionObject> func = value_to_call.get_object<InstanceObject>()->public_members[name].get_object<FunctionObject>();
-				push_data({ func->code_unit.get(), 0 });
-				m_call_stack.push_back(CallInfo{ func->function_name, m_stack.size() - arg_count - 1 });
-				Result res = run();
-				m_call_stack.pop_back();
-				pop_data();
-				pop_stack();
-				push_stack(m_return_value_register);
-				return res;
-			}
+	Result Emulator::push_frame(FunctionObject* func, uint32_t arg_count, bool constructor) {
+		if (func->arg_count != arg_count) {
+			m_error_handler.report_error("Function '" + func->function_name + "' expects " + std::to_string(func->arg_count) + " arguments but got " + std::to_string(arg_count), {}, ErrorType::RUNTIME_ERROR);
+			return Result::RUNTIME_ERROR;
 		}
-		m_error_handler.report_error("Cannot call non-function and non-class objects", {}, ErrorType::RUNTIME_ERROR);
+		if (call_depth() >= m_max_call_depth) {
+			m_error_handler.report_error("Stack overflow, more than " + std::to_string(m_max_call_depth) + " calls deep in '" + func->function_name + "'", {}, ErrorType::RUNTIME_ERROR);
+			return Result::RUNTIME_ERROR;
+		}
+		if (!func->code_unit && !compile_lazy(func))
+			return Result::RUNTIME_ERROR;
+		if (!has_room(*func->code_unit))
+			return stack_overflow(func->function_name);
+		*m_frames_top++ = { func, func->code_unit.get(), func->code_unit->code(), m_stack_top - arg_count - 1, constructor };
+		return Result::OK;
+	}
+
+	bool Emulator::compile_lazy(FunctionObject* func) {
+		bool compiled = func->lazy_body && func->lazy_body->compile(*func);
+		func->lazy_body = nullptr;							// Compiled once, a body with errors isn't tried again
+		m_heap.remember(func);								// The new unit's constants are young, the function may already be old
+		if (!compiled)
+			m_error_handler.report_error("Function '" + func->function_name + "' could not be compiled", {}, ErrorType::RUNTIME_ERROR);
+		return compiled;
+	}
+
+	Result Emulator::stack_overflow(const std::string& function_name) {
+		m_error_handler.report_error("Stack overflow, the value stack is full in '" + function_name + "'", {}, ErrorType::RUNTIME_ERROR);
 		return Result::RUNTIME_ERROR;
 	}
 
+	enum OperandTypes : uint8_t {								// Type feedback of binary instructions, one bit per combination
+		INT_OPERANDS = 1,
+		DOUBLE_OPERANDS = 2,
+		STRING_OPERANDS = 4,
+		OTHER_OPERANDS = 8,
+		DEOPTIMIZED = 0xFF
+	};
+
+	static inline uint8_t operand_types(const Value& a, const Value& b) {
+		if (a.is<int64_t>() && b.is<int64_t>())
+			return INT_OPERANDS;
+		if (a.is<double>() && b.is<double>())
+			return DOUBLE_OPERANDS;
+		if (is_str(a) && is_str(b))
+			return STRING_OPERANDS;
+		return OTHER_OPERANDS;
+	}
+
+	void Emulator::quicken_binary(const Unit& unit, const uint8_t* site, Instruction int_form, Instruction double_form, Instruction string_form) {
+		if (!m_quickening)
+			return;
+		uint8_t& seen = unit.type_feedback(site - unit.code());
+		uint8_t types = operand_types(stack_top(1), stack_top());
+		seen |= types;
+		if (seen != types)											// More than one combination, stays generic
+			return;
+		Instruction form = types == INT_OPERANDS ? int_form : types == DOUBLE_OPERANDS ? double_form
+			: types == STRING_OPERANDS ? string_form : (Instruction)*site;
+		if (form == (Instruction)*site)								// No specialized form for these types
+			return;
+		unit.rewrite(site - unit.code(), form);
+		m_quicken_stats.quickened++;
+	}
+
+	void Emulator::quicken_member(const Unit& unit, const uint8_t* site, uint32_t cache_index) {
+		if (!m_quickening || unit.type_feedback(site - unit.code()) == DEOPTIMIZED)
+			return;
+		const InlineCache& cache = unit.get_cache(cache_index);
+		if (cache.count != 1 || cache.megamorphic || cache.entries[0].kind != InlineCache::Kind::FIELD)
+			return;
+		unit.rewrite(site - unit.code(), Instruction::GET_MEMBER_CACHED);
+		m_quicken_stats.quickened++;
+	}
+
+	void Emulator::deoptimize(const Unit& unit, const uint8_t* site, Instruction generic) {
+		unit.rewrite(site - unit.code(), generic);
+		unit.type_feedback(site - unit.code()) = DEOPTIMIZED;
+		m_quicken_stats.deoptimized++;
+	}
+
+	bool Emulator::get_member_cached(InstanceObject* instance, const Value& name, uint32_t cache_index, Value& out) {
+		InlineCache& cache = bytes()->get_cache(cache_index);
+		if (const InlineCache::Entry* entry = cache.find(instance->shape->id)) {
+			m_cache_stats.hits++;
+			out = entry->kind == InlineCache::Kind::FIELD ? instance->slots[entry->slot] : entry->method;
+			return true;
+		}
+
+		const StringObject* str = name.get_object<StringObject>();	// Slow path, look the name up and fill the cache
+		if (cache.megamorphic) {
+			m_cache_stats.megamorphic++;
+			return instance->get_member(str, out);
+		}
+		m_cache_stats.misses++;
+		InlineCache::Entry entry;
+		entry.shape_id = instance->shape->id;
+		int32_t slot = instance->shape->find(str);
+		if (slot != -1) {
+			entry.kind = InlineCache::Kind::FIELD;
+			entry.slot = (uint32_t)slot;
+			out = instance->slots[slot];
+		}
+		else {
+			auto method = instance->class_ref.methods.find(str);
+			if (method == instance->class_ref.methods.end())
+				return false;
+			entry.kind = InlineCache::Kind::METHOD;
+			entry.method = method->second;
+			out = method->second;
+		}
+		cache.add(entry);
+		return true;
+	}
+
+	void Emulator::set_member_cached(InstanceObject* instance, const Value& name, uint32_t cache_index, const Value& value) {
+		InlineCache& cache = bytes()->get_cache(cache_index);
+		if (const InlineCache::Entry* entry = cache.find(instance->shape->id)) {
+			m_cache_stats.hits++;
+			if (entry->kind == InlineCache::Kind::TRANSITION)
+				instance->append_field(entry->next_shape, value);
+			else
+				instance->slots[entry->slot] = value;
+			return;
+		}
+
+		const StringObject* str = name.get_object<StringObject>();
+		if (cache.megamorphic) {
+			m_cache_stats.megamorphic++;
+			instance->set_field(str, value);
+			return;
+		}
+		m_cache_stats.misses++;
+		InlineCache::Entry entry;
+		entry.shape_id = instance->shape->id;
+		int32_t slot = instance->shape->find(str);
+		if (slot != -1) {
+			entry.kind = InlineCache::Kind::FIELD;
+			entry.slot = (uint32_t)slot;
+			instance->slots[slot] = value;
+		}
+		else {
+			entry.kind = InlineCache::Kind::TRANSITION;
+			entry.next_shape = instance->shape->add_field(str);
+			instance->append_field(entry.next_shape, value);
+		}
+		cache.add(entry);
+	}
+
 	void Emulator::make_standard_fn(const std::string& name, StandardFnType func) {
 		//push_stack(Value(std::make_shared<StandardFn>(func)));
-		m_global_table[name] = Value(std::make_shared<StandardFn>(func));
+		uint32_t slot = declare_global(name);
+		m_globals[slot] = Value(m_heap.allocate<StandardFn>(func));
+		m_global_defined[slot] = true;
 	}
 
-	Result Emulator::list_function(const std::shared_ptr<ListValue>& list, const std::string& func, uint8_t arg_count) {
+	int32_t Emulator::find_global(const std::string& name) const {
+		auto slot = m_global_slots.find(name);
+		return slot == m_global_slots.end() ? -1 : (int32_t)slot->second;
+	}
+
+	uint32_t Emulator::declare_global(const std::string& name) {
+		int32_t existing = find_global(name);
+		if (existing != -1)
+			return existing;
+		uint32_t slot = (uint32_t)m_globals.size();
+		m_globals.emplace_back();
+		m_global_defined.push_back(false);
+		m_global_names.push_back(name);
+		m_global_slots[name] = slot;
+		return slot;
+	}
+
+	void Emulator::forget_globals(uint32_t count) {
+		for (uint32_t slot = count; slot < m_global_names.size(); slot++)
+			m_global_slots.erase(m_global_names[slot]);
+		m_globals.resize(count);
+		m_global_defined.resize(count);
+		m_global_names.resize(count);
+	}
+
+	void Emulator::mark_roots_and_collect() {
+		m_heap.begin_collection();
+		for (const Value* value = m_stack.get(); value < m_stack_top; value++)
+			m_heap.mark(*value);
+		for (const Value& value : m_globals)
+			m_heap.mark(value);
+		for (const CallFrame* call_frame = m_frames.get(); call_frame < m_frames_top; call_frame++) {
+			if (call_frame->function)						// Running methods are not on the stack, their instance is
+				m_heap.mark(Value(call_frame->function));
+			m_heap.mark_unit(*call_frame->unit);				// Constant pools of the units being executed
+		}
+		m_heap.end_collection();
+	}
+
+	void Emulator::collect_garbage(bool major) {
+		if (major)
+			m_heap.request_major();
+		mark_roots_and_collect();
+	}
+
+	Result Emulator::list_function(ListValue* list, const StringObject* func, uint32_t arg_count) {
 		Standard::FunctionReturn ret;
-		if (func == "append")
+		if (func == m_names.append) {
 			ret = Standard::ListUtils::append(list, arg_count, &stack_top(arg_count ? arg_count - 1 : 0));
-		else if (func == "add")
+			m_heap.remember(list);
+		}
+		else if (func == m_names.add) {
 			ret = Standard::ListUtils::add(list, arg_count, &stack_top(arg_count ? arg_count - 1 : 0));
-		else if (func == "size")
+			m_heap.remember(list);
+		}
+		else if (func == m_names.size)
 			ret = Standard::ListUtils::size(list, arg_count, &stack_top(arg_count ? arg_count - 1 : 0));
-		else if (func == "pop")
+		else if (func == m_names.pop)
 			ret = Standard::ListUtils::pop(list, arg_count, &stack_top(arg_count ? arg_count - 1 : 0));
-		else if (func == "get")
+		else if (func == m_names.get)
 			ret = Standard::ListUtils::get(list, arg_count, &stack_top(arg_count ? arg_count - 1 : 0));
 		else {
-			m_error_handler.report_error("List object does not have method " + func, {}, ErrorType::RUNTIME_ERROR);
+			m_error_handler.report_error("List object does not have method " + func->string, {}, ErrorType::RUNTIME_ERROR);
 			return Result::RUNTIME_ERROR;
 		}
-		pop_stack();
+		m_stack_top -= arg_count + 1;						// The list and the arguments
 		push_stack(ret.val);
 		return Result::OK;
 	}
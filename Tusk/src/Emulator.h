@@ -6,6 +6,7 @@
 #include "Bytecode.h"
 #include "Token.h"
 #include "Error.h"
+#include "Heap.h"
 #include <unordered_map>
 
 namespace Tusk {
@@ -20,68 +21,127 @@ namespace Tusk {
 		RUNTIME_ERROR
 	};
 
+	struct CacheStats {
+		uint64_t hits{ 0 };
+		uint64_t misses{ 0 };
+		uint64_t megamorphic{ 0 };							// Lookups at sites that stopped caching
+	};
+
+	struct QuickenStats {
+		uint64_t quickened{ 0 };							// Sites rewritten into a type specialized instruction
+		uint64_t deoptimized{ 0 };							// Specialized sites that met other types and went back to generic
+	};
+
 	class Emulator {
 	public:
-		Emulator(ErrorHandler& handler) : m_error_handler(handler) { m_call_stack.push_back({}); init(); }
-		Emulator(const Unit* bytes, ErrorHandler& handler) : m_error_handler{ handler } { m_call_stack.push_back({}); init(); }
+		Emulator(ErrorHandler& handler) : m_error_handler(handler) { init(); }
+		Emulator(const Unit* bytes, ErrorHandler& handler) : m_error_handler{ handler } { init(); }
 		
 		Result run(const Unit* bytes);
-		const std::unordered_map<std::string, Value>& get_global_table() { return m_global_table; }
+		// GLOBALS
+		// Globals live in slots, the compiler resolves names to slot indices through these
+		int32_t find_global(const std::string& name) const;		// Returns -1 if the name was never declared
+		uint32_t declare_global(const std::string& name);
+		void forget_globals(uint32_t count);						// Drops the slots declared after the first count
+		bool is_global_defined(uint32_t slot) const { return m_global_defined[slot]; }	// MAKE_GLOBAL ran for it
+		const std::unordered_map<std::string, uint32_t>& get_global_table() const { return m_global_slots; }
+		const std::vector<std::string>& get_global_names() const { return m_global_names; }	// In slot order
+		const Value& get_global(uint32_t slot) const { return m_globals[slot]; }
+		Heap& get_heap() { return m_heap; }
+		const CacheStats& get_cache_stats() const { return m_cache_stats; }
+		uint64_t get_dispatch_count() const { return m_dispatch_count; }	// Only counted when built with TK_DISPATCH_STATS
+		const QuickenStats& get_quicken_stats() const { return m_quicken_stats; }
+		void set_quickening(bool enabled) { m_quickening = enabled; }
+		void set_max_call_depth(size_t depth);			// Deeper calls are a runtime error, only safe between runs
+		void set_stack_size(size_t values);				// Capacity of the value stack, only safe between runs
+		void collect_garbage(bool major = false);		// Forces a collection, only safe between runs
+
+		// Applies a binary arithmetic, comparison or bitwise operator to two numbers, the Simplifier folds
+		// constants with it too. Returns false if the operands cannot be used with the operator, or if an integer
+		// result has to be boxed and there is no heap to box it on
+		static bool arithmetic(TokenType operation, const Value& a, const Value& b, Value& result, Heap* heap = nullptr);
 	private:
 		void init();
 		Result run();
 
-		struct CallInfo {
-			std::string function_name{"script"};
-			uint64_t stack_size_before_args{ 0 };
+		// Every call gets a frame, run() executes all of them in one loop instead of recursing for each call.
+		// Frames live in an array allocated up to the maximum depth, so calls never allocate
+		struct CallFrame {
+			FunctionObject* function{ nullptr };			// Null for the script
+			const Unit* unit{ nullptr };
+			const uint8_t* ip{ nullptr };					// Where the frame continues, only up to date while it is not running
+			Value* base{ nullptr };							// Local 0, the called function or the instance of a method. Gets the result
+			bool constructor{ false };						// Returns the instance in local 0 instead of the returned value
 		};
 
-		std::vector<Value> m_stack;
-		std::vector<CallInfo> m_call_stack;
+		// The value stack never grows. Every unit knows how deep it can get, so a call checks once that its
+		// frame fits and pushes inside it need no checks
+		static constexpr size_t DEFAULT_STACK_SIZE = 1 << 18;
+		std::unique_ptr<Value[]> m_stack;
+		Value* m_stack_top{ nullptr };						// One past the top value
+		Value* m_stack_end{ nullptr };
 
-		Value m_return_value_register;
-		//const Unit* m_bytes{ nullptr };
-		//uint32_t* m_instruction_index{ 0 };
-		const Unit* bytes() { return m_program_data[m_program_data.size() - 1].bytes; }
-		uint32_t& instruction_index() { return m_program_data[m_program_data.size() - 1].instruction_index; }
-		ErrorHandler& m_error_handler;
+		static constexpr size_t DEFAULT_MAX_CALL_DEPTH = 10000;
+		std::unique_ptr<CallFrame[]> m_frames;
+		CallFrame* m_frames_top{ nullptr };					// One past the running frame
+		size_t m_max_call_depth{ 0 };
 
-		struct ProgramData {
-			const Unit* bytes{ nullptr };
-			uint32_t instruction_index{ 0 };
-		};
+		CallFrame& running_frame() { return m_frames_top[-1]; }
+		size_t call_depth() const { return m_frames_top - m_frames.get(); }
+		const Unit* bytes() { return running_frame().unit; }
+		ErrorHandler& m_error_handler;
+		Heap m_heap;
+		CacheStats m_cache_stats;
+		uint64_t m_dispatch_count{ 0 };
+		QuickenStats m_quicken_stats;
+		bool m_quickening{ true };
 
-		std::vector<ProgramData> m_program_data;
-		void push_data(const ProgramData& data) {
-			m_program_data.push_back(data);
-			//m_instruction_index = &m_program_data[m_program_data.size() - 1].instruction_index;
-			//m_bytes = m_program_data[m_program_data.size() - 1].bytes;
-		}
-		void pop_data() {
-			m_program_data.pop_back();
-			//m_instruction_index = &m_program_data[m_program_data.size() - 1].instruction_index;
-			//m_bytes = m_program_data[m_program_data.size() - 1].bytes;
-		}
+		struct Names {										// Interned names the emulator looks up itself
+			const StringObject* make;
+			const StringObject* append;
+			const StringObject* add;
+			const StringObject* size;
+			const StringObject* pop;
+			const StringObject* get;
+		} m_names{};
 
 		// TABLE
-		std::unordered_map<std::string, Value> m_global_table;
+		std::vector<Value> m_globals;
+		std::vector<bool> m_global_defined;					// Set once MAKE_GLOBAL ran for the slot
+		std::vector<std::string> m_global_names;
+		std::unordered_map<std::string, uint32_t> m_global_slots;
 
 		// UTIL
-		uint8_t next_byte();
-		const Value& read_value();
-		void push_stack(const Value& val);
-		Value pop_stack();
-		Value& stack_top(uint32_t offset = 0) { return m_stack[m_stack.size() - 1 - offset]; }
+		void push_stack(const Value& val) { *m_stack_top++ = val; }
+		Value pop_stack() { return std::move(*--m_stack_top); }
+		Value& stack_top(uint32_t offset = 0) { return m_stack_top[-1 - (ptrdiff_t)offset]; }
+		bool has_room(const Unit& unit) const { return unit.get_max_stack() <= (size_t)(m_stack_end - m_stack_top); }
+		void safepoint() { if (m_heap.should_collect()) mark_roots_and_collect(); }	// Collects if the heap asked for it
+		void mark_roots_and_collect();
 
 		//
 		Result binary_operation(TokenType operation);
-		void str_concatenate(const std::shared_ptr<StringObject>& str1, const std::shared_ptr<StringObject>& str2);
+		static constexpr size_t MAX_FLAT_CONCATENATION = 64;	// Longer results become ropes, copying short ones is cheaper
+		void str_concatenate(StringObject* str1, StringObject* str2);
 		bool equality();
-		Result call(const Value& value_to_call, uint8_t arg_count);
-		Result call_method(const std::string& name, uint8_t arg_count);
+		// Functions and constructors only get a frame pushed, run() continues in it. Anything else is done on return
+		Result call(const Value& value_to_call, uint32_t arg_count);
+		Result push_frame(FunctionObject* func, uint32_t arg_count, bool constructor = false);
+		Result stack_overflow(const std::string& function_name);
+		bool compile_lazy(FunctionObject* func);		// Compiles a function on its first call, reports an error if it can't be
+		bool get_member_cached(InstanceObject* instance, const Value& name, uint32_t cache_index, Value& out);
+		void set_member_cached(InstanceObject* instance, const Value& name, uint32_t cache_index, const Value& value);
+
+		// QUICKENING
+		// Generic instructions record the operand types they see. A site that only ever saw one combination is
+		// rewritten into the specialized form for it, a specialized form that sees another combination
+		// deoptimizes and the site stays generic from then on
+		void quicken_binary(const Unit& unit, const uint8_t* site, Instruction int_form, Instruction double_form, Instruction string_form);
+		void quicken_member(const Unit& unit, const uint8_t* site, uint32_t cache_index);
+		void deoptimize(const Unit& unit, const uint8_t* site, Instruction generic);
 
 		void make_standard_fn(const std::string& name, StandardFnType func);
 
-		Result list_function(const std::shared_ptr<ListValue>& list, const std::string& name, uint8_t arg_count);
+		Result list_function(ListValue* list, const StringObject* name, uint32_t arg_count);
 	};
 }
\ No newline at end of file
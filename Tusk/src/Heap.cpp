@@ -0,0 +1,181 @@
+#include "pch.h"
+#include "Heap.h"
+#include "Bytecode.h"
+#include <algorithm>
+#include <chrono>
+
+namespace Tusk {
+	static double now_ms() {
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static void free_list(ValueObject* list) {
+		while (list) {
+			ValueObject* next = list->next;
+			delete list;
+			list = next;
+		}
+	}
+
+	Heap::~Heap() {
+		free_list(m_young);
+		free_list(m_old);
+	}
+
+	size_t Heap::owned_bytes(const ValueObject* object) {
+		switch (object->get_type()) {
+		case ObjectType::STRING:
+			return static_cast<const StringObject*>(object)->string.capacity();
+		case ObjectType::LIST:
+			return static_cast<const ListValue*>(object)->values.capacity() * sizeof(Value);
+		default:
+			return 0;
+		}
+	}
+
+	void Heap::set_config(const GCConfig& config) {
+		m_config = config;
+		m_next_major = std::max((size_t)(m_old_bytes * m_config.heap_growth_factor), m_config.initial_heap_size);
+	}
+
+	StringObject* Heap::intern(const std::string& str) {
+		auto found = m_interned.find(str);
+		if (found != m_interned.end())
+			return found->second;
+		StringObject* string = allocate<StringObject>(str);
+		string->hash = std::hash<std::string_view>{}(str);
+		string->interned = true;
+		m_interned.emplace(string->string, string);
+		return string;
+	}
+
+	void Heap::begin_collection() {
+		m_collection_start = now_ms();
+		m_collecting_major = m_major_requested || m_old_bytes >= m_next_major;
+		for (const auto& [contents, string] : m_interned)	// Interned strings are always roots
+			mark_object(string);
+		if (!m_collecting_major)
+			for (ValueObject* object : m_remembered)			// Old objects pointing into the nursery act as extra roots
+				trace_references(object);
+	}
+
+	void Heap::mark_object(ValueObject* object) {
+		if (object->marked || (object->old && !m_collecting_major))
+			return;
+		object->marked = true;
+		m_gray.push_back(object);
+	}
+
+	void Heap::mark_unit(const Unit& unit) {
+		for (const Value& value : unit.get_values())
+			mark(value);
+		for (const InlineCache& cache : unit.get_caches())		// Methods held by the inline caches
+			for (uint32_t i = 0; i < cache.count; i++)
+				mark(cache.entries[i].method);
+	}
+
+	void Heap::trace_references(ValueObject* object) {
+		switch (object->get_type()) {
+		case ObjectType::FUNCTION: {
+			FunctionObject* function = static_cast<FunctionObject*>(object);
+			if (function->code_unit)
+				mark_unit(*function->code_unit);
+			break;
+		}
+		case ObjectType::CLASS: {
+			ClassObject* class_obj = static_cast<ClassObject*>(object);
+			for (const auto& [name, value] : class_obj->methods)
+				mark(value);
+			for (const Value& value : class_obj->field_defaults)
+				mark(value);
+			break;
+		}
+		case ObjectType::INSTANCE: {
+			InstanceObject* instance = static_cast<InstanceObject*>(object);
+			mark_object(&instance->class_ref);
+			for (uint32_t i = 0; i < instance->shape->slot_count(); i++)
+				mark(instance->slots[i]);
+			break;
+		}
+		case ObjectType::STRING: {
+			StringObject* string = static_cast<StringObject*>(object);
+			if (string->is_rope()) {
+				mark_object(string->left);
+				mark_object(string->right);
+			}
+			break;
+		}
+		case ObjectType::ENUM_VALUE:
+			mark_object(static_cast<EnumValue*>(object)->enum_obj);
+			break;
+		case ObjectType::LIST:
+			for (const Value& value : static_cast<ListValue*>(object)->values)
+				mark(value);
+			break;
+		default:
+			break;
+		}
+	}
+
+	void Heap::sweep(ValueObject*& list, bool promote) {
+		ValueObject** link = &list;
+		while (*link) {
+			ValueObject* object = *link;
+			if (object->marked) {
+				object->marked = false;
+				if (promote) {									// Survivors of the nursery move to the old generation
+					*link = object->next;
+					object->old = true;
+					object->next = m_old;
+					m_old = object;
+					m_old_bytes += object->size;
+					m_stats.objects_promoted++;
+				}
+				else
+					link = &object->next;
+			}
+			else {
+				*link = object->next;
+				if (object->old)
+					m_old_bytes -= object->size;
+				m_stats.objects_freed++;
+				m_stats.bytes_freed += object->size;
+				delete object;
+			}
+		}
+	}
+
+	void Heap::end_collection() {
+		while (!m_gray.empty()) {
+			ValueObject* object = m_gray.back();
+			m_gray.pop_back();
+			trace_references(object);
+		}
+
+		for (ValueObject* object : m_remembered)				// Everything young gets promoted, no old object will point into the nursery
+			object->remembered = false;
+		m_remembered.clear();
+
+		if (m_collecting_major)
+			sweep(m_old, false);
+		sweep(m_young, true);
+		m_young_bytes = 0;
+
+		if (m_collecting_major) {
+			m_next_major = std::max((size_t)(m_old_bytes * m_config.heap_growth_factor), m_config.initial_heap_size);
+			m_stats.major_collections++;
+		}
+		else
+			m_stats.minor_collections++;
+
+		m_collect_requested = false;
+		m_major_requested = false;
+		m_collecting_major = false;
+		m_stats.live_bytes = m_old_bytes;
+
+		double pause = now_ms() - m_collection_start;
+		m_stats.last_pause_ms = pause;
+		m_stats.total_pause_ms += pause;
+		m_stats.max_pause_ms = std::max(m_stats.max_pause_ms, pause);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,132 @@
+#pragma once
+#include <utility>
+#include <new>
+#include <vector>
+#include <string_view>
+#include <unordered_map>
+#include "Value.h"
+
+namespace Tusk {
+	struct GCConfig {
+		size_t nursery_size{ 256 * 1024 };					// Bytes allocated in the nursery before a minor collection is requested
+		size_t initial_heap_size{ 1024 * 1024 };			// Old generation size that triggers the first major collection
+		double heap_growth_factor{ 2.0 };					// After a major collection the next one triggers at live size * factor
+	};
+
+	struct GCStats {
+		uint64_t minor_collections{ 0 };
+		uint64_t major_collections{ 0 };
+		uint64_t objects_allocated{ 0 };
+		uint64_t objects_freed{ 0 };
+		uint64_t objects_promoted{ 0 };
+		uint64_t bytes_allocated{ 0 };
+		uint64_t bytes_freed{ 0 };
+		size_t live_bytes{ 0 };								// Young and old generation together
+		double total_pause_ms{ 0.0 };
+		double max_pause_ms{ 0.0 };
+		double last_pause_ms{ 0.0 };
+	};
+
+	// Owns every object a script or the compiler creates. Values only carry raw pointers into the heap.
+	// Objects are reclaimed by a precise, non-moving, generational mark and sweep collector: new objects
+	// go to the nursery, survivors of a collection are promoted to the old generation. Minor collections
+	// only trace the nursery (plus old objects recorded by the write barrier), major collections trace everything.
+	//
+	// The heap never collects on its own. Allocation only requests a collection, the emulator performs it
+	// at a safepoint where every live value is reachable from its roots:
+	//   begin_collection() -> mark(...) for every root -> end_collection()
+	class Heap {
+	public:
+		Heap() = default;
+		~Heap();
+
+		Heap(const Heap&) = delete;
+		Heap& operator=(const Heap&) = delete;
+
+		template<typename T, typename... Args>
+		T* allocate(Args&&... args) {
+			return track(new T(std::forward<Args>(args)...), sizeof(T));
+		}
+
+		// Allocates the object with extra_bytes of trailing storage in the same block
+		template<typename T, typename... Args>
+		T* allocate_extra(size_t extra_bytes, Args&&... args) {
+			void* memory = ::operator new(sizeof(T) + extra_bytes);
+			return track(new (memory) T(std::forward<Args>(args)...), sizeof(T) + extra_bytes);
+		}
+
+		// Shorthand for the most common allocation
+		Value make_string(const std::string& str) { return Value(allocate<StringObject>(str)); }
+		// Integers are only boxed when they don't fit inline in the Value
+		Value make_int(int64_t integer) { return Value::fits_inline(integer) ? Value(integer) : Value(allocate<IntegerObject>(integer)); }
+		// Returns the one string object with these contents, equal interned strings are the same pointer.
+		// The compiler interns names and string literals, interned strings live as long as the heap
+		StringObject* intern(const std::string& str);
+		InstanceObject* make_instance(ClassObject& class_obj) {
+			uint32_t capacity = std::max(class_obj.instance_shape->slot_count(), class_obj.expected_slots);
+			return allocate_extra<InstanceObject>(InstanceObject::inline_size(capacity), class_obj, capacity);
+		}
+
+		// Must be called after storing a value inside an existing object
+		void write_barrier(ValueObject* owner, const Value& value) {
+			if (owner->old && value.is_object() && !value.get<ValueObject*>()->old)
+				remember(owner);
+		}
+		// Conservative barrier for bulk stores (e.g. appending many values to a list)
+		void remember(ValueObject* owner) {
+			if (owner->old && !owner->remembered) {
+				owner->remembered = true;
+				m_remembered.push_back(owner);
+			}
+		}
+
+		bool should_collect() const { return m_collect_requested; }
+		void request_major() { m_major_requested = true; m_collect_requested = true; }
+
+		// COLLECTION
+		void begin_collection();
+		void mark(const Value& value) { if (value.is_object()) mark_object(value.get<ValueObject*>()); }
+		void mark_object(ValueObject* object);
+		void mark_unit(const Unit& unit);
+		void end_collection();
+
+		const GCConfig& get_config() const { return m_config; }
+		void set_config(const GCConfig& config);
+		const GCStats& get_stats() const { return m_stats; }
+	private:
+		template<typename T>
+		T* track(T* object, size_t size) {
+			object->size = (uint32_t)(size + owned_bytes(object));
+			object->next = m_young;
+			m_young = object;
+			m_young_bytes += object->size;
+			m_stats.objects_allocated++;
+			m_stats.bytes_allocated += object->size;
+			if (m_young_bytes >= m_config.nursery_size)
+				m_collect_requested = true;
+			return object;
+		}
+
+		static size_t owned_bytes(const ValueObject* object);
+		void trace_references(ValueObject* object);
+		void sweep(ValueObject*& list, bool promote);
+
+		ValueObject* m_young{ nullptr };
+		ValueObject* m_old{ nullptr };
+		size_t m_young_bytes{ 0 };
+		size_t m_old_bytes{ 0 };
+		size_t m_next_major{ 1024 * 1024 };
+
+		std::unordered_map<std::string_view, StringObject*> m_interned;	// Keys view the string of the object
+		std::vector<ValueObject*> m_remembered;				// Old objects written to since the last collection
+		std::vector<ValueObject*> m_gray;					// Marked objects whose references are not traced yet
+
+		bool m_collect_requested{ false };
+		bool m_major_requested{ false };
+		bool m_collecting_major{ false };
+		double m_collection_start{ 0.0 };
+
+		GCConfig m_config;
+		GCStats m_stats;
+	};
+}
\ No newline at end of file
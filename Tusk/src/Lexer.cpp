@@ -1,41 +1,27 @@
 #include "pch.h"
 #include "lexer.h"
+#include "Scan.h"
+#include <algorithm>
 
 namespace Tusk {
     Token Lexer::lex() {
         next();
 
-        while (m_current_char == ' ' || m_current_char == '\n' || m_current_char == '\t' || m_current_char == '/') {    // Skip whitespace
-            if (m_current_char == '\n')                                                                           // Change line on newline character
-                m_line++;
-            else if (m_current_char == '/') {                                                                     // Skip comments
-                if (match('/')) {
-                    while (m_current_char != '\n' && m_index < m_source.size())
-                        next();
-                }
-                else if (m_index < m_source.size() && match('*')) {
-                    next();
-                    next();
-                    while (m_index < m_source.size()) {
-                        if (m_current_char == '\n') {
-                            m_line++;
-                            next();
-                        }
-                        else if (m_current_char == '*' && match('/')) {
-                            next();
-                            next();
-                            break;
-                        }
-                        else {
-                            next();
-                        }
-                    }
-                }
-                else
-                    break;
+        const char* source = m_source.data();
+        while (true) {                                                                          // Skip whitespace and comments
+            m_index = (int)Scan::skip_whitespace(source, m_index, m_source.size(), m_line);
+            if (m_index + 1 < m_source.size() && source[m_index] == '/' && source[m_index + 1] == '/')
+                m_index = (int)Scan::find(source, m_index + 2, m_source.size(), '\n', m_line);   // The newline is skipped as whitespace
+            else if (m_index + 1 < m_source.size() && source[m_index] == '/' && source[m_index + 1] == '*') {
+                size_t start = m_index + 2, slash = start;                                      // Banners are full of '*', look for the '/' instead
+                while ((slash = Scan::find(source, slash, m_source.size(), '/', m_line)) < m_source.size() && (slash == start || source[slash - 1] != '*'))
+                    slash++;
+                m_index = (int)std::min(slash + 1, m_source.size());                            // Past the end if the comment is never closed
             }
-            next();
+            else
+                break;
         }
+        m_current_char = m_index < m_source.size() ? source[m_index] : '\0';
 
         if (is_digit(m_current_char)) return (number());                        // Make number token
         if (is_alpha(m_current_char)) return (identifier());                    // Make identifier/keyword token
@@ -53,6 +39,7 @@ namespace Tusk {
         case '.': return (Token{ TokenType::DOT, "", m_line, old_index, m_index });
         case '^': return (Token{ TokenType::CAP, "", m_line, old_index, m_index });
         case '&': return (Token{ TokenType::AMPERSAND, "", m_line, old_index, m_index });
+        case '|': return (Token{ TokenType::PIPE, "", m_line, old_index, m_index });
         case '~': return (Token{ TokenType::TILDE, "", m_line, old_index, m_index });
         case '%': return (Token{
             match('=') ? TokenType::PERCENT_EQUAL : TokenType::PERCENT, "", m_line, old_index, m_index });
@@ -87,6 +74,7 @@ namespace Tusk {
     }
 
     const std::vector<Token>& Lexer::analyze() {
+        m_out.reserve(m_source.size() / 2 + 1);     // Scripts rarely have more than a token every two characters, capacity never touched costs no memory
         do {
             m_out.push_back(lex());
         } while (m_current_char != '\0');
@@ -94,32 +82,24 @@ namespace Tusk {
     }
 
     Token Lexer::string() {
-        std::string string;
-        bool interpolated = false;
         int old_index = m_index;
-        next();
-        while (m_current_char != '"' && m_current_char != '\0') {               // Make the string body
-            if (m_current_char == '\n')
-                m_line++;
-            string += m_current_char;
-            next();
-        }
+        m_index = (int)Scan::find(m_source.data(), m_index + 1, m_source.size(), '"', m_line);   // Find the end of the string body
+        m_current_char = m_index < m_source.size() ? m_source[m_index] : '\0';
 
         if (m_current_char == '\0') {                                        // If the lexer reaches the end without closing the string return an error
             m_error_handler.report_error("Unterminated String", {m_line, old_index, m_index}, ErrorType::SYNTAX_ERROR);
             return Token{ TokenType::ERROR, "", m_line, old_index, m_index };
         }
-        return Token{ TokenType::STR, string, m_line, old_index, m_index };
+        return Token{ TokenType::STR, m_source.substr(old_index + 1, m_index - old_index - 1), m_line, old_index, m_index };
     }
 
     Token Lexer::number() {
         int old_index = m_index;
-        std::string num_string;
         bool is_float = false;
         bool has_error = false;
         int dot_index = 0;
 
-        while (is_digit(m_current_char) || m_current_char == '.' || m_current_char == '_') {          // Make number string
+        while (is_digit(m_current_char) || m_current_char == '.' || m_current_char == '_') {    // Underscores are allowed for readability, the parser skips them
             if (m_current_char == '.') {
                 if (is_float) {
                     has_error = true;                                                           // If there already was a dot, report error
@@ -127,18 +107,10 @@ namespace Tusk {
                 }
                 else
                     is_float = true;                                                            // Else set the type as float
-                num_string += m_current_char;
-                next();
-
-            }
-            else if (m_current_char == '_')                                                       // Allow underscores in numbers for readability
-                next();
-            else {
-
-                num_string += m_current_char;
-                next();
             }
+            next();
         }
+        std::string_view num_string = m_source.substr(old_index, m_index - old_index);
         back();
 
         if (has_error) {                                                                        // Error double dot
@@ -152,29 +124,55 @@ namespace Tusk {
 
     Token Lexer::identifier() {
         int old_index = m_index;
-        std::string string;
-
-        while (is_alpha(m_current_char) || is_digit(m_current_char)) {                          // Make identifier body
-            string += m_current_char;
+        while (is_alpha(m_current_char) || is_digit(m_current_char))                            // Find the end of the identifier body
             next();
-        }
+        std::string_view string = m_source.substr(old_index, m_index - old_index);
         back();
 
-        if (std::find(keywords.begin(), keywords.end(), string) != keywords.end())              // Check if name is identifier or keyword
-            return Token{ TokenType::KEYWORD, string, m_line, old_index, m_index };
-        //else if (std::find(types.begin(), types.end(), string) != types.end())                // Check if name is type keyword
-        //    return Token{ TokenType::TYPE, string, m_line, old_index, m_index };
-        else if (string == "and")
-            return Token{ TokenType::AND, string, m_line, old_index, m_index };
-        else if (string == "or")
-            return Token{ TokenType::OR, string, m_line, old_index, m_index };
-        else if (string == "true")
-            return Token{ TokenType::TRUE, string, m_line, old_index, m_index };
-        else if (string == "false")
-            return Token{ TokenType::FALSE, string, m_line, old_index, m_index };
-        else if (string == "void")
-            return Token{ TokenType::VOID, string, m_line, old_index, m_index };
-        return Token{ TokenType::ID, string, m_line, old_index, m_index };
+        return Token{ keyword_type(string), string, m_line, old_index, m_index };               // Check if name is identifier or keyword
+    }
+
+    // Keywords are told apart by length and first character, so an identifier costs one switch and at most two comparisons
+    TokenType Lexer::keyword_type(std::string_view name) {
+        auto either = [name](std::string_view keyword, TokenType type) { return name == keyword ? type : TokenType::ID; };
+        switch (name.size()) {
+        case 2:
+            switch (name[0]) {
+            case 'f': return either("fn", TokenType::KEYWORD);
+            case 'i': return either("if", TokenType::KEYWORD);
+            case 'd': return either("do", TokenType::KEYWORD);
+            case 'o': return either("or", TokenType::OR);
+            }
+            break;
+        case 3:
+            switch (name[0]) {
+            case 'l': return name == "let" || name == "log" ? TokenType::KEYWORD : TokenType::ID;
+            case 'f': return either("for", TokenType::KEYWORD);
+            case 'a': return either("and", TokenType::AND);
+            }
+            break;
+        case 4:
+            switch (name[0]) {
+            case 'e': return name == "else" || name == "enum" ? TokenType::KEYWORD : TokenType::ID;
+            case 'l': return either("logl", TokenType::KEYWORD);
+            case 't': return name == "true" ? TokenType::TRUE : either("this", TokenType::KEYWORD);
+            case 'v': return either("void", TokenType::VOID);
+            }
+            break;
+        case 5:
+            switch (name[0]) {
+            case 'w': return either("while", TokenType::KEYWORD);
+            case 'b': return either("break", TokenType::KEYWORD);
+            case 'c': return either("class", TokenType::KEYWORD);
+            case 'f': return either("false", TokenType::FALSE);
+            }
+            break;
+        case 6:
+            return either("return", TokenType::KEYWORD);
+        case 8:
+            return either("continue", TokenType::KEYWORD);
+        }
+        return TokenType::ID;
     }
 
     bool Lexer::match(char expected) {                                                          // If next character matches the expected one,
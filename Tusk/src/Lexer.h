@@ -1,21 +1,24 @@
 #pragma once
 #include <string>
 #include <vector>
-#include <array>
+#include <string_view>
 #include "token.h"
 #include "Error.h"
 
 namespace Tusk {
 	class Lexer {
 	public:
-		Lexer(const std::string& source, ErrorHandler& handler) : m_source(source), m_error_handler{ handler } {}
+		// Tokens point into the source, so it has to outlive them. line is the line the source starts on
+		Lexer(std::string_view source, ErrorHandler& handler, int line = 1) : m_line{ line }, m_source(source), m_error_handler{ handler } {}
 		//Lexer() { m_source = ""; }
 
 		const std::vector<Token>& analyze();					// Lexes the source code and returns vector of tokens
+		Token next_token() { return lex(); }					// Lexes one token at a time, _EOF from the end of the source on
 
-		std::array<std::string, 15> keywords{ "return", "let", "fn", "log", "if", "else", 
-			"while", "do", "for", "break", "continue", "class", "this", "enum", "logl"};
-		//std::array<std::string, 15> types{ "isize", "fsize", "i8", "i16", "i32", "i64", "f32", "f64", "u8", "usize", "u16", "u32", "u64", "string", "void" };
+		// KEYWORD for "return", "let", "fn", "log", "if", "else", "while", "do", "for", "break", "continue", "class",
+		// "this", "enum" and "logl", the type of the token for "and", "or", "true", "false" and "void" and ID for the rest
+		static TokenType keyword_type(std::string_view name);
+		std::string_view source() const { return m_source; }
 	private:
 		static bool is_digit(char character);					// Check if a character is a digit
 		static bool is_alpha(char character);					// Check if a character is alphanumeric
@@ -35,7 +38,7 @@ namespace Tusk {
 		int m_index{ -1 };										// Current index
 		int m_line{ 1 };										// Current line inside a file
 
-		std::string m_source{};									// The source code to lex
+		std::string_view m_source{};							// The source code to lex
 
 		ErrorHandler& m_error_handler;
 
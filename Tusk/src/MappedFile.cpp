@@ -0,0 +1,75 @@
+#include "pch.h"
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Tusk {
+#ifdef _WIN32
+	MappedFile::MappedFile(const std::string& path, bool copy_on_write) {
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return;
+		m_file = file;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size))
+			return;
+		m_size = (size_t)size.QuadPart;
+		m_open = true;
+		if (m_size == 0)								// Empty files can't be mapped
+			return;
+		m_mapping = CreateFileMappingA(file, nullptr, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+		if (m_mapping)
+			m_data = static_cast<char*>(MapViewOfFile(m_mapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0));
+		if (!m_data) {
+			m_size = 0;
+			m_open = false;
+		}
+	}
+
+	MappedFile::~MappedFile() {
+		if (m_data)
+			UnmapViewOfFile(m_data);
+		if (m_mapping)
+			CloseHandle(m_mapping);
+		if (m_file)
+			CloseHandle(m_file);
+	}
+#else
+	MappedFile::MappedFile(const std::string& path, bool copy_on_write) {
+		int file = open(path.c_str(), O_RDONLY);
+		if (file < 0)
+			return;
+		struct stat info;
+		if (fstat(file, &info) == 0) {
+			m_size = (size_t)info.st_size;
+			m_open = true;
+			if (m_size > 0) {								// Empty files can't be mapped
+				void* data = mmap(nullptr, m_size, copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, file, 0);
+				if (data == MAP_FAILED) {
+					m_size = 0;
+					m_open = false;
+				}
+				else {
+					madvise(data, m_size, MADV_SEQUENTIAL);
+					m_data = static_cast<char*>(data);
+				}
+			}
+		}
+		close(file);										// The mapping stays valid without the descriptor
+	}
+
+	MappedFile::~MappedFile() {
+		if (m_data)
+			munmap(m_data, m_size);
+	}
+#endif
+}
\ No newline at end of file
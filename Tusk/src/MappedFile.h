@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+namespace Tusk {
+	// A whole file mapped into memory. Nothing is copied, the system reads pages in as they are touched.
+	// A copy-on-write mapping can be written to, each page written gets a private copy and the file never changes
+	class MappedFile {
+	public:
+		MappedFile(const std::string& path, bool copy_on_write = false);
+		~MappedFile();
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool is_open() const { return m_open; }
+		std::string_view contents() const { return { m_data, m_size }; }
+		char* data() const { return m_data; }				// Only to be written to through a copy-on-write mapping
+		size_t size() const { return m_size; }
+	private:
+		char* m_data{ nullptr };
+		size_t m_size{ 0 };
+		bool m_open{ false };
+#ifdef _WIN32
+		void* m_file{ nullptr };
+		void* m_mapping{ nullptr };
+#endif
+	};
+}
\ No newline at end of file
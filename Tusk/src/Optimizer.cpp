@@ -0,0 +1,499 @@
+#include "pch.h"
+#include "Optimizer.h"
+#include <cassert>
+
+namespace Tusk {
+	static size_t encoded_size(Instruction instruction) {
+		return layout(instruction).size();
+	}
+
+	static bool is_pure_push(Instruction instruction) {		// Pushes one value and has no other effect
+		switch (instruction) {
+		case Instruction::VAL_INDEX:
+		case Instruction::VAL_INDEX_WIDE:
+		case Instruction::VAL_INT:
+		case Instruction::VAL_INT_WIDE:
+		case Instruction::VOID:
+		case Instruction::GET_LOCAL:
+		case Instruction::GET_LOCAL_WIDE:
+		case Instruction::GET_GLOBAL:
+		case Instruction::GET_GLOBAL_WIDE:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	struct StackEffect {
+		int32_t net{ 0 };									// Values pushed minus values popped
+		int32_t peak{ 0 };									// Highest the stack gets above where the instruction started
+		int32_t pops{ 0 };									// Values it takes from the top of the stack
+	};
+
+	static StackEffect stack_effect(const Instruction instruction, uint32_t first_operand) {
+		switch (instruction) {
+		case Instruction::VAL_INDEX:
+		case Instruction::VAL_INDEX_WIDE:
+		case Instruction::VAL_INT:
+		case Instruction::VAL_INT_WIDE:
+		case Instruction::VOID:
+		case Instruction::GET_GLOBAL:
+		case Instruction::GET_GLOBAL_WIDE:
+		case Instruction::GET_LOCAL:
+		case Instruction::GET_LOCAL_WIDE:
+			return { 1, 1 };
+		case Instruction::ADD_LOCALS:						// Pushes both locals before adding them
+			return { 1, 2 };
+		case Instruction::JUMP:
+		case Instruction::RETURN_VOID:
+			return {};
+		case Instruction::NEGATE:
+		case Instruction::NOT:
+		case Instruction::LOG:
+		case Instruction::LOGL:
+		case Instruction::SET_LOCAL:
+		case Instruction::SET_LOCAL_WIDE:
+		case Instruction::GET_MEMBER:
+		case Instruction::GET_MEMBER_WIDE:
+		case Instruction::GET_MEMBER_CACHED:
+		case Instruction::RETURN:
+			return { 0, 0, 1 };
+		case Instruction::SET_MEMBER:						// Pops the instance and the value
+		case Instruction::SET_MEMBER_WIDE:
+			return { -2, 0, 2 };
+		case Instruction::CALL:								// The callee and arguments become the result
+		case Instruction::CALL_WIDE:
+		case Instruction::TAIL_CALL:
+		case Instruction::TAIL_CALL_WIDE:
+		case Instruction::METHOD_CALL:
+		case Instruction::METHOD_CALL_WIDE:
+			return { -(int32_t)first_operand, 0, (int32_t)first_operand + 1 };
+		case Instruction::POP:								// Stores that pop and conditional jumps
+		case Instruction::LOG_POP:
+		case Instruction::LOGL_POP:
+		case Instruction::MAKE_GLOBAL:
+		case Instruction::MAKE_GLOBAL_WIDE:
+		case Instruction::SET_GLOBAL:
+		case Instruction::SET_GLOBAL_WIDE:
+		case Instruction::SET_LOCAL_POP:
+		case Instruction::JUMP_IF_FALSE:
+		case Instruction::LESS_CONST_JUMP_IF_FALSE:
+		case Instruction::LESS_INT_JUMP_IF_FALSE:
+			return { -1, 0, 1 };
+		default:											// Binary operators, and members and parents added to the class below them
+			return { -1, 0, 2 };
+		}
+	}
+
+	static bool ends_block(Instruction instruction) {		// Control never falls through to the next instruction
+		return instruction == Instruction::JUMP || instruction == Instruction::RETURN || instruction == Instruction::RETURN_VOID;
+	}
+
+	void Optimizer::optimize(Unit& unit) {
+		for (const Value& value : unit.get_values())
+			if (value.is_object(ObjectType::FUNCTION) && value.get_object<FunctionObject>()->code_unit)
+				optimize(*value.get_object<FunctionObject>()->code_unit);
+
+		std::vector<Op> ops = decode(unit);
+		m_stats.instructions_before += ops.size();
+		if (m_level > 0) {
+			bool changed = true;
+			while (changed) {								// Every pass can expose work for the others
+				mark_jump_targets(ops);
+				changed = thread_jumps(ops);
+				mark_jump_targets(ops);
+				if (m_level > 1) {
+					changed |= remove_unreachable(ops);
+					mark_jump_targets(ops);
+					changed |= remove_dead_pushes(ops);
+				}
+				changed |= fuse(ops);
+				if (m_level > 1) {
+					mark_jump_targets(ops);
+					changed |= remove_dead_stores(ops);
+				}
+			}
+			unit.set_code(encode(ops));
+		}
+		unit.set_max_stack(max_stack(ops));
+		for (const Op& op : ops)
+			if (!op.removed)
+				m_stats.instructions_after++;
+	}
+
+	std::vector<Optimizer::Op> Optimizer::decode(const Unit& unit) const {
+		std::vector<Op> ops;
+		std::vector<size_t> op_at(unit.size() + 1, 0);		// Op index of every instruction start, for the jump targets
+		size_t index = 0;
+		while (index < unit.size()) {
+			Op op{ (Instruction)unit[index] };
+			InstructionLayout op_layout = layout(op.instruction);
+			op_at[index] = ops.size();
+			index++;
+			for (uint32_t i = 0; i < op_layout.operand_count; i++) {
+				op.operands[i] = op_layout.operand_size == 3 ? unit.read_wide(index) : unit[index];
+				index += op_layout.operand_size;
+			}
+			if (op_layout.jump) {
+				op.target = index + 3 + Unit::to_offset(unit.read_wide(index));	// Byte position for now
+				index += 3;
+			}
+			ops.push_back(op);
+		}
+		op_at[unit.size()] = ops.size();
+		for (Op& op : ops)
+			if (layout(op.instruction).jump)
+				op.target = op_at[op.target];
+		return ops;
+	}
+
+	std::vector<uint8_t> Optimizer::encode(const std::vector<Op>& ops) const {
+		std::vector<size_t> position(ops.size() + 1);		// Removed ops get the position of the next live one
+		size_t size = 0;
+		for (size_t i = 0; i < ops.size(); i++) {
+			position[i] = size;
+			if (!ops[i].removed)
+				size += encoded_size(ops[i].instruction);
+		}
+		position[ops.size()] = size;
+
+		std::vector<uint8_t> code;
+		code.reserve(size);
+		auto write_wide = [&](uint32_t operand) {
+			code.push_back((uint8_t)operand);
+			code.push_back((uint8_t)(operand >> 8));
+			code.push_back((uint8_t)(operand >> 16));
+		};
+		for (size_t i = 0; i < ops.size(); i++) {
+			const Op& op = ops[i];
+			if (op.removed)
+				continue;
+			InstructionLayout op_layout = layout(op.instruction);
+			code.push_back((uint8_t)op.instruction);
+			for (uint32_t j = 0; j < op_layout.operand_count; j++) {
+				if (op_layout.operand_size == 3)
+					write_wide(op.operands[j]);
+				else
+					code.push_back((uint8_t)op.operands[j]);
+			}
+			if (op_layout.jump)
+				write_wide((uint32_t)((int64_t)position[op.target] - (int64_t)(position[i] + encoded_size(op.instruction))));
+		}
+		return code;
+	}
+
+	size_t Optimizer::next_live(const std::vector<Op>& ops, size_t index) const {
+		while (index < ops.size() && ops[index].removed)
+			index++;
+		return index;
+	}
+
+	void Optimizer::mark_jump_targets(std::vector<Op>& ops) const {
+		for (Op& op : ops)
+			op.jump_target = false;
+		for (const Op& op : ops)
+			if (!op.removed && layout(op.instruction).jump) {
+				size_t target = next_live(ops, op.target);
+				if (target < ops.size())
+					ops[target].jump_target = true;
+			}
+	}
+
+	bool Optimizer::thread_jumps(std::vector<Op>& ops) {
+		bool changed = false;
+		for (size_t i = 0; i < ops.size(); i++) {
+			Op& op = ops[i];
+			if (op.removed || !layout(op.instruction).jump)
+				continue;
+			size_t target = next_live(ops, op.target);
+			for (uint32_t hops = 0; target < ops.size() && ops[target].instruction == Instruction::JUMP && target != i && hops < 16; hops++)
+				target = next_live(ops, ops[target].target);
+			if (target != next_live(ops, op.target)) {
+				op.target = target;
+				m_stats.jumps_threaded++;
+				changed = true;
+			}
+			if (op.instruction == Instruction::JUMP && target == next_live(ops, i + 1)) {	// Jump to the next instruction
+				op.removed = true;
+				m_stats.instructions_removed++;
+				changed = true;
+			}
+		}
+		return changed;
+	}
+
+	bool Optimizer::fuse(std::vector<Op>& ops) {
+		bool changed = false;
+		for (size_t i = next_live(ops, 0); i < ops.size(); i = next_live(ops, i + 1)) {
+			size_t second = next_live(ops, i + 1);
+			if (second == ops.size() || ops[second].jump_target)
+				continue;
+			Op& a = ops[i];
+			Op& b = ops[second];
+			Instruction fused = a.instruction;
+			switch (a.instruction) {						// Two instruction sequences
+			case Instruction::LOG:
+				if (b.instruction == Instruction::POP)
+					fused = Instruction::LOG_POP;
+				break;
+			case Instruction::LOGL:
+				if (b.instruction == Instruction::POP)
+					fused = Instruction::LOGL_POP;
+				break;
+			case Instruction::VOID:
+				if (b.instruction == Instruction::RETURN)
+					fused = Instruction::RETURN_VOID;
+				break;
+			case Instruction::SET_LOCAL:
+				if (b.instruction == Instruction::POP)
+					fused = Instruction::SET_LOCAL_POP;
+				break;
+			default:
+				break;
+			}
+			if (fused != a.instruction) {
+				a.instruction = fused;
+				b.removed = true;
+				m_stats.superinstructions++;
+				changed = true;
+				continue;
+			}
+
+			size_t third = next_live(ops, second + 1);
+			if (third == ops.size() || ops[third].jump_target)
+				continue;
+			Op& c = ops[third];
+			if (a.instruction == Instruction::GET_LOCAL && b.instruction == Instruction::GET_LOCAL && c.instruction == Instruction::ADD) {
+				a.instruction = Instruction::ADD_LOCALS;
+				a.operands[1] = b.operands[0];
+			}
+			else if ((a.instruction == Instruction::VAL_INDEX || a.instruction == Instruction::VAL_INT)
+				&& b.instruction == Instruction::LESS && c.instruction == Instruction::JUMP_IF_FALSE) {
+				a.instruction = a.instruction == Instruction::VAL_INDEX ? Instruction::LESS_CONST_JUMP_IF_FALSE : Instruction::LESS_INT_JUMP_IF_FALSE;
+				a.target = c.target;
+			}
+			else
+				continue;
+			b.removed = true;
+			c.removed = true;
+			m_stats.superinstructions++;
+			changed = true;
+		}
+		return changed;
+	}
+
+	bool Optimizer::remove_unreachable(std::vector<Op>& ops) {
+		bool changed = false;
+		bool reachable = true;
+		for (Op& op : ops) {
+			if (op.removed)
+				continue;
+			if (op.jump_target)
+				reachable = true;
+			if (!reachable) {
+				op.removed = true;
+				m_stats.instructions_removed++;
+				changed = true;
+				continue;
+			}
+			if (ends_block(op.instruction))
+				reachable = false;
+		}
+		return changed;
+	}
+
+	bool Optimizer::remove_dead_pushes(std::vector<Op>& ops) {
+		bool changed = false;
+		for (size_t i = next_live(ops, 0); i < ops.size(); i = next_live(ops, i + 1)) {
+			size_t next = next_live(ops, i + 1);
+			if (next < ops.size() && is_pure_push(ops[i].instruction) && ops[next].instruction == Instruction::POP && !ops[next].jump_target) {
+				ops[i].removed = true;
+				ops[next].removed = true;
+				m_stats.instructions_removed += 2;
+				changed = true;
+			}
+		}
+		return changed;
+	}
+
+	// A store is dead if the same local is stored again, or the frame returns, before anything reads it.
+	// Only straight line code is considered, the scan stops at jumps and jump targets.
+	bool Optimizer::remove_dead_stores(std::vector<Op>& ops) {
+		bool changed = false;
+		for (size_t i = next_live(ops, 0); i < ops.size(); i = next_live(ops, i + 1)) {
+			if (ops[i].instruction != Instruction::SET_LOCAL_POP)
+				continue;
+			uint32_t slot = ops[i].operands[0];
+			bool dead = false;
+			for (size_t j = next_live(ops, i + 1); j < ops.size() && !ops[j].jump_target; j = next_live(ops, j + 1)) {
+				const Op& op = ops[j];
+				if (op.instruction == Instruction::RETURN || op.instruction == Instruction::RETURN_VOID
+					|| ((op.instruction == Instruction::SET_LOCAL || op.instruction == Instruction::SET_LOCAL_POP) && op.operands[0] == slot)) {
+					dead = true;
+					break;
+				}
+				bool reads = (op.instruction == Instruction::GET_LOCAL && op.operands[0] == slot)
+					|| (op.instruction == Instruction::ADD_LOCALS && (op.operands[0] == slot || op.operands[1] == slot))
+					|| op.instruction == Instruction::GET_LOCAL_WIDE || op.instruction == Instruction::SET_LOCAL_WIDE;
+				if (reads || layout(op.instruction).jump)
+					break;
+			}
+			if (dead) {
+				ops[i].instruction = Instruction::POP;
+				m_stats.instructions_removed++;
+				changed = true;
+			}
+		}
+		return changed;
+	}
+
+	bool Optimizer::verify(Unit& unit, uint32_t frame_size, size_t global_count) const {
+		std::vector<bool> starts(unit.size(), false);		// Jumps may only land where an instruction starts
+		size_t position = 0;
+		while (position < unit.size()) {
+			Instruction instruction = (Instruction)unit[position];
+			if (unit[position] >= INSTRUCTION_COUNT || generic(instruction) != instruction)
+				return false;								// Quickened instructions are never saved
+			starts[position] = true;
+			position += encoded_size(instruction);
+		}
+		if (position != unit.size())
+			return false;
+		for (position = 0; position < unit.size(); position += encoded_size((Instruction)unit[position])) {
+			InstructionLayout op_layout = layout((Instruction)unit[position]);
+			if (!op_layout.jump)
+				continue;
+			size_t end = position + op_layout.size();
+			int64_t target = (int64_t)end + Unit::to_offset(unit.read_wide(end - 3));
+			if (target < 0 || target >= (int64_t)unit.size() || !starts[target])
+				return false;
+		}
+
+		std::vector<Op> ops = decode(unit);
+		const std::vector<Value>& constants = unit.get_values();
+		size_t cache_count = unit.get_caches().size();
+		auto is_name = [&](uint32_t index) { return index < constants.size() && constants[index].is_object(ObjectType::STRING); };
+		for (const Op& op : ops) {
+			bool valid = true;
+			switch (op.instruction) {
+			case Instruction::VAL_INDEX:
+			case Instruction::VAL_INDEX_WIDE:
+			case Instruction::LESS_CONST_JUMP_IF_FALSE:
+				valid = op.operands[0] < constants.size();
+				break;
+			case Instruction::MAKE_GLOBAL:
+			case Instruction::MAKE_GLOBAL_WIDE:
+			case Instruction::GET_GLOBAL:
+			case Instruction::GET_GLOBAL_WIDE:
+			case Instruction::SET_GLOBAL:
+			case Instruction::SET_GLOBAL_WIDE:
+				valid = op.operands[0] < global_count;
+				break;
+			case Instruction::GET_MEMBER:
+			case Instruction::GET_MEMBER_WIDE:
+			case Instruction::SET_MEMBER:
+			case Instruction::SET_MEMBER_WIDE:
+				valid = is_name(op.operands[0]) && op.operands[1] < cache_count;
+				break;
+			case Instruction::MAKE_MEMBER:
+			case Instruction::MAKE_MEMBER_WIDE:
+				valid = is_name(op.operands[0]);
+				break;
+			case Instruction::METHOD_CALL:
+			case Instruction::METHOD_CALL_WIDE:
+				valid = is_name(op.operands[1]) && op.operands[2] < cache_count;
+				break;
+			default:
+				break;
+			}
+			if (!valid)
+				return false;
+		}
+
+		// Same walk as max_stack, counting the values of the whole frame so local slots can be checked too
+		std::vector<int64_t> values(ops.size(), -1);		// Values in the frame before each instruction, -1 until a path reaches it
+		std::vector<size_t> work;
+		auto reach = [&](size_t next, int64_t count) {
+			if (next == ops.size())
+				return false;
+			if (values[next] == -1) {
+				values[next] = count;
+				work.push_back(next);
+			}
+			return values[next] == count;
+		};
+		if (!reach(0, frame_size))
+			return false;
+		while (!work.empty()) {
+			size_t index = work.back();
+			work.pop_back();
+			const Op& op = ops[index];
+			int64_t in = values[index];
+			StackEffect effect = stack_effect(op.instruction, op.operands[0]);
+			if (op.instruction == Instruction::RETURN && frame_size == 0)
+				effect.pops = 0;							// The script returns without a value
+			if (in < effect.pops)
+				return false;
+			switch (op.instruction) {
+			case Instruction::GET_LOCAL:
+			case Instruction::GET_LOCAL_WIDE:
+			case Instruction::SET_LOCAL:
+			case Instruction::SET_LOCAL_WIDE:
+			case Instruction::SET_LOCAL_POP:
+				if (op.operands[0] >= in)
+					return false;
+				break;
+			case Instruction::ADD_LOCALS:
+				if (op.operands[0] >= in || op.operands[1] >= in)
+					return false;
+				break;
+			default:
+				break;
+			}
+			int64_t out = in + effect.net;
+			if (layout(op.instruction).jump && !reach(op.target, out))
+				return false;
+			if (!ends_block(op.instruction) && !reach(index + 1, out))
+				return false;
+		}
+		unit.set_max_stack(max_stack(ops));				// Every path agrees on the depth
+		return true;
+	}
+
+	// Walks every path through the code. The compiler keeps the stack at the same depth wherever paths meet,
+	// so each instruction is visited once, at the depth the first path reaches it with. Paths that meet at
+	// another depth are a compiler bug
+	uint32_t Optimizer::max_stack(const std::vector<Op>& ops) const {
+		std::vector<int64_t> depth(ops.size(), -1);		// Stack depth before each instruction, -1 until a path reaches it
+		std::vector<size_t> work;
+		size_t start = next_live(ops, 0);
+		if (start < ops.size()) {
+			depth[start] = 0;
+			work.push_back(start);
+		}
+		int64_t max_depth = 0;
+		while (!work.empty()) {
+			size_t index = work.back();
+			work.pop_back();
+			const Op& op = ops[index];
+			int64_t in = depth[index];
+			StackEffect effect = stack_effect(op.instruction, op.operands[0]);
+			max_depth = std::max(max_depth, in + effect.peak);
+			int64_t out = in + effect.net;
+			auto reach = [&](size_t next) {
+				if (next >= ops.size())
+					return;
+				if (depth[next] == -1) {
+					depth[next] = out;
+					work.push_back(next);
+				}
+				assert(depth[next] == out && "Paths reach an instruction at different stack depths");
+			};
+			if (layout(op.instruction).jump)
+				reach(next_live(ops, op.target));
+			if (!ends_block(op.instruction))
+				reach(next_live(ops, index + 1));
+		}
+		return (uint32_t)max_depth;
+	}
+}
\ No newline at end of file
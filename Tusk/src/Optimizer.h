@@ -0,0 +1,55 @@
+#pragma once
+#include <vector>
+#include "Bytecode.h"
+
+namespace Tusk {
+	struct OptimizerStats {
+		uint64_t instructions_before{ 0 };
+		uint64_t instructions_after{ 0 };
+		uint64_t superinstructions{ 0 };
+		uint64_t jumps_threaded{ 0 };
+		uint64_t instructions_removed{ 0 };					// Unreachable code, dead stores and values popped right after a push
+	};
+
+	// Peephole pass over the bytecode the compiler wrote. Each level includes the ones below it:
+	//   0: leaves the bytecode untouched
+	//   1: fuses common sequences into superinstructions and threads jumps to jumps
+	//   2: removes unreachable code, pushes that are popped right away and stores to locals that are never read
+	class Optimizer {
+	public:
+		Optimizer(uint32_t level = 2) : m_level{ level } {}
+
+		void optimize(Unit& unit);							// Also optimizes the functions in the constant pool of the unit
+															// and records how deep each of them uses the stack
+		// Checks code that didn't come from the compiler (see BytecodeFile) before it can run, and records how deep it
+		// uses the stack. A frame starts out with frame_size values, the function and its arguments. Returns false
+		// if an operand is out of range of the unit or of the global_count globals, a jump doesn't land on an
+		// instruction inside the unit, a path could take more from the stack than the frame has, reach an
+		// instruction at another depth than other paths or run past the end
+		bool verify(Unit& unit, uint32_t frame_size, size_t global_count) const;
+		const OptimizerStats& get_stats() const { return m_stats; }
+	private:
+		struct Op {
+			Instruction instruction;
+			uint32_t operands[3]{ 0, 0, 0 };
+			size_t target{ 0 };								// Op a jump goes to, ops.size() for the end of the unit
+			bool removed{ false };							// Removed ops fall through, jumps to them go to the next live op
+			bool jump_target{ false };
+		};
+
+		std::vector<Op> decode(const Unit& unit) const;
+		std::vector<uint8_t> encode(const std::vector<Op>& ops) const;
+
+		size_t next_live(const std::vector<Op>& ops, size_t index) const;
+		void mark_jump_targets(std::vector<Op>& ops) const;
+		bool fuse(std::vector<Op>& ops);
+		bool thread_jumps(std::vector<Op>& ops);
+		bool remove_unreachable(std::vector<Op>& ops);
+		bool remove_dead_pushes(std::vector<Op>& ops);
+		bool remove_dead_stores(std::vector<Op>& ops);
+		uint32_t max_stack(const std::vector<Op>& ops) const;
+
+		uint32_t m_level;
+		OptimizerStats m_stats;
+	};
+}
\ No newline at end of file
@@ -1,9 +1,57 @@
 #include "pch.h"
 #include "Parser.h"
+#include <charconv>
 
 namespace Tusk {
-	const std::shared_ptr<AST>& Parser::parse() {
-		m_final_tree = std::make_shared<AST>();
+	AstArena::~AstArena() {
+		for (auto node = m_nodes.rbegin(); node != m_nodes.rend(); node++)
+			(*node)->~ASTNode();
+	}
+
+	void* AstArena::allocate(size_t size, size_t alignment) {
+		size_t padding = m_next ? (alignment - (uintptr_t)m_next % alignment) % alignment : 0;
+		if ((size_t)(m_end - m_next) < padding + size) {
+			m_blocks.emplace_back(new std::byte[BLOCK_SIZE]);	// Left uninitialized, nodes are constructed into it
+			m_next = m_blocks.back().get();
+			m_end = m_next + BLOCK_SIZE;
+			padding = 0;
+		}
+		void* memory = m_next + padding;
+		m_next += padding + size;
+		return memory;
+	}
+
+	Parser::Parser(Lexer& lexer, ErrorHandler& handler) : Parser(lexer, handler, m_own_arena) {}
+
+	Parser::Parser(Lexer& lexer, ErrorHandler& handler, AstArena& arena) : m_lexer{ lexer }, m_error_handler{ handler }, m_arena{ arena } {
+		for (Token& token : m_lookahead)
+			token = next_token();
+	}
+
+	Statement* Parser::parse_body(FunctionDeclaration* function_decl, AstArena& arena, ErrorHandler& handler) {
+		size_t errors = handler.get_errors().size();
+		Lexer lexer(function_decl->skipped_body, handler, function_decl->skipped_line);
+		Parser parser(lexer, handler, arena);
+		parser.set_preparse(true);							// Functions declared inside wait for their own first call
+		Statement* body = parser.compound_statement();
+		if (handler.get_errors().size() != errors)
+			return nullptr;
+		function_decl->body = body;
+		function_decl->skipped_body = {};
+		return body;
+	}
+
+	Token Parser::next_token() {
+		Token token = m_lexer.next_token();
+		while (token.type == TokenType::ERROR) {
+			m_lexical_error = true;
+			token = m_lexer.next_token();
+		}
+		return token;
+	}
+
+	AST* Parser::parse() {
+		m_final_tree = m_arena.make<AST>(m_arena);
 		while (current_token().type != TokenType::_EOF) {
 			m_final_tree->statements.push_back(statement());
 		}
@@ -19,96 +67,179 @@ namespace Tusk {
 			advance();
 	}
 
-	std::shared_ptr<Expression> Parser::expression() {
-		std::shared_ptr<Expression> left{ logical_and() };
-		std::shared_ptr<Expression> right{ nullptr };
-		const Token* token{ nullptr };
+	Expression* Parser::expression() {
+		Expression* left{ logical_and() };
+		Expression* right{ nullptr };
+		Token token;
 		while (current_token().type == TokenType::OR) {
-			token = &current_token();
+			token = current_token();
 			advance();
 			right = logical_and();
-			left = std::make_shared<BinaryOperation>(left, *token, right);
+			left = m_arena.make<BinaryOperation>(left, token, right);
 		}
 		return left;
 	}
 
-	std::shared_ptr<Expression> Parser::logical_and() {
-		std::shared_ptr<Expression> left{ equality() };
-		std::shared_ptr<Expression> right{ nullptr };
-		const Token* token{ nullptr };
+	Expression* Parser::logical_and() {
+		Expression* left{ equality() };
+		Expression* right{ nullptr };
+		Token token;
 		while (current_token().type == TokenType::AND) {
-			token = &current_token();
+			token = current_token();
 			advance();
 			right = equality();
-			left = std::make_shared<BinaryOperation>(left, *token, right);
+			left = m_arena.make<BinaryOperation>(left, token, right);
 		}
 		return left;
 	}
 
-	std::shared_ptr<Expression> Parser::equality() {
-		std::shared_ptr<Expression> left{ relational() };
-		std::shared_ptr<Expression> right{ nullptr };
-		const Token* token{ nullptr };
+	Expression* Parser::equality() {
+		Expression* left{ relational() };
+		Expression* right{ nullptr };
+		Token token;
 		while (current_token().type == TokenType::EQUAL_EQUAL || current_token().type == TokenType::BANG_EQUAL) {
-			token = &current_token();
+			token = current_token();
 			advance();
 			right = relational();
-			left = std::make_shared<BinaryOperation>(left, *token, right);
+			left = m_arena.make<BinaryOperation>(left, token, right);
 		}
 		return left;
 	}
 
-	std::shared_ptr<Expression> Parser::relational() {
-		std::shared_ptr<Expression> left{ arithmetic() };
-		std::shared_ptr<Expression> right{ nullptr };
-		const Token* token{ nullptr };
+	Expression* Parser::relational() {
+		Expression* left{ bitwise_or() };
+		Expression* right{ nullptr };
+		Token token;
 		while (current_token().type == TokenType::LESS || current_token().type == TokenType::GREATER
 			|| current_token().type == TokenType::LESS_EQUAL || current_token().type == TokenType::GREATER_EQUAL) {
-			token = &current_token();
+			token = current_token();
+			advance();
+			right = bitwise_or();
+			left = m_arena.make<BinaryOperation>(left, token, right);
+		}
+		return left;
+	}
+
+	// Bitwise operators bind tighter than comparisons, so 'x & 1 == 0' tests the lowest bit
+	Expression* Parser::bitwise_or() {
+		Expression* left{ bitwise_xor() };
+		Expression* right{ nullptr };
+		Token token;
+		while (current_token().type == TokenType::PIPE) {
+			token = current_token();
+			advance();
+			right = bitwise_xor();
+			left = m_arena.make<BinaryOperation>(left, token, right);
+		}
+		return left;
+	}
+
+	Expression* Parser::bitwise_xor() {
+		Expression* left{ bitwise_and() };
+		Expression* right{ nullptr };
+		Token token;
+		while (current_token().type == TokenType::CAP) {
+			token = current_token();
+			advance();
+			right = bitwise_and();
+			left = m_arena.make<BinaryOperation>(left, token, right);
+		}
+		return left;
+	}
+
+	Expression* Parser::bitwise_and() {
+		Expression* left{ shift() };
+		Expression* right{ nullptr };
+		Token token;
+		while (current_token().type == TokenType::AMPERSAND) {
+			token = current_token();
+			advance();
+			right = shift();
+			left = m_arena.make<BinaryOperation>(left, token, right);
+		}
+		return left;
+	}
+
+	Expression* Parser::shift() {
+		Expression* left{ arithmetic() };
+		Expression* right{ nullptr };
+		Token token;
+		while (current_token().type == TokenType::L_SHIFT || current_token().type == TokenType::R_SHIFT) {
+			token = current_token();
 			advance();
 			right = arithmetic();
-			left = std::make_shared<BinaryOperation>(left, *token, right);
+			left = m_arena.make<BinaryOperation>(left, token, right);
 		}
 		return left;
 	}
 
-	std::shared_ptr<Expression> Parser::arithmetic() {
-		std::shared_ptr<Expression> left{ term() };
-		std::shared_ptr<Expression> right{ nullptr };
-		const Token* token{ nullptr };
+	Expression* Parser::arithmetic() {
+		Expression* left{ term() };
+		Expression* right{ nullptr };
+		Token token;
 		while(current_token().type == TokenType::PLUS || current_token().type == TokenType::MINUS) {
-			token = &current_token();
+			token = current_token();
 			advance();
 			right = term();
-			left = std::make_shared<BinaryOperation>(left, *token, right);
+			left = m_arena.make<BinaryOperation>(left, token, right);
 		}
 		return left;
 	}
 
-	std::shared_ptr<Expression> Parser::term() {
-		std::shared_ptr<Expression> left{ factor() };
-		std::shared_ptr<Expression> right{ nullptr };
-		const Token* token{ nullptr };
-		while (current_token().type == TokenType::STAR || current_token().type == TokenType::SLASH) {
-			token = &current_token();
+	Expression* Parser::term() {
+		Expression* left{ factor() };
+		Expression* right{ nullptr };
+		Token token;
+		while (current_token().type == TokenType::STAR || current_token().type == TokenType::SLASH || current_token().type == TokenType::PERCENT) {
+			token = current_token();
 			advance();
 			right = factor();
-			left = std::make_shared<BinaryOperation>(left, *token, right);
+			left = m_arena.make<BinaryOperation>(left, token, right);
 		}
 		return left;
 	}
 
-	std::shared_ptr<Expression> Parser::factor() {
-		std::shared_ptr<Expression> to_ret{ nullptr };
+	// Number tokens are slices of the source that can still contain '_' separators, which from_chars doesn't accept
+	static Number* number_value(AstArena& arena, const Token& token) {	// Null if the number is out of range
+		std::string_view digits = token.value;
+		std::string stripped;
+		if (digits.find('_') != std::string_view::npos) {
+			for (char character : digits)
+				if (character != '_')
+					stripped += character;
+			digits = stripped;
+		}
+		const char* end = digits.data() + digits.size();
+		if (token.type == TokenType::FLOAT) {
+			double number{ 0 };
+			if (std::from_chars(digits.data(), end, number).ec != std::errc())
+				return nullptr;
+			return arena.make<Number>(Value(number));
+		}
+		int64_t number{ 0 };
+		if (std::from_chars(digits.data(), end, number).ec != std::errc())
+			return nullptr;
+		return arena.make<Number>(number);
+	}
+
+	Expression* Parser::factor() {
+		Expression* to_ret{ nullptr };
+		if (m_parsed_operand) {
+			to_ret = m_parsed_operand;
+			m_parsed_operand = nullptr;
+			return to_ret;
+		}
 		switch(current_token().type) {
 		case TokenType::INT:
-			to_ret = std::make_shared<Number>(Value{ (int64_t)stol(current_token().value) });
-			advance();
-			return to_ret;
-		case TokenType::FLOAT:
-			to_ret = std::make_shared<Number>(Value{ stod(current_token().value) });
+		case TokenType::FLOAT: {
+			to_ret = number_value(m_arena, current_token());
+			if (!to_ret) {
+				report_error("Number literal out of range");
+				to_ret = m_arena.make<Number>(Value());
+			}
 			advance();
 			return to_ret;
+		}
 		case TokenType::L_PAR:
 			advance();
 			to_ret = expression();
@@ -117,57 +248,57 @@ namespace Tusk {
 		case TokenType::MINUS: {
 			Token tok = current_token();
 			advance();
-			to_ret = std::make_shared<UnaryOperation>(tok, factor());
+			to_ret = m_arena.make<UnaryOperation>(tok, factor());
 			return to_ret;
 		}
 		case TokenType::TRUE:
 			advance();
-			return std::make_shared<BoolValue>(true);
+			return m_arena.make<BoolValue>(true);
 		case TokenType::FALSE:
 			advance();
-			return std::make_shared<BoolValue>(false);
+			return m_arena.make<BoolValue>(false);
 		case TokenType::BANG: {
 			Token tok = current_token();
 			advance();
-			to_ret = std::make_shared<UnaryOperation>(tok, factor());
+			to_ret = m_arena.make<UnaryOperation>(tok, factor());
 			return to_ret;
 		}
 		case TokenType::ID: {
 			/*const std::string& str = current_token().value;
-			to_ret = std::make_shared<Name>(str);
-			std::vector<std::shared_ptr<Expression>> expr{ };
+			to_ret = m_arena.make<Name>(str);
+			std::vector<Expression*> expr{ };
 			advance();
-			const Token* tok = &current_token();
+			Token tok = current_token();
 			if (current_token().type == TokenType::L_PAR) {
 				advance();
 				while (current_token().type != TokenType::R_PAR && current_token().type != TokenType::_EOF) {
-					tok = &current_token();
+					tok = current_token();
 					expr.push_back(expression());
 
 					if (current_token().type == TokenType::COMMA)
 						advance();
 				}
 				consume(TokenType::R_PAR, "Expected ')'");
-				to_ret = std::make_shared<Call>(std::static_pointer_cast<Name>(to_ret), expr);
+				to_ret = m_arena.make<Call>(static_cast<Name*>(to_ret), expr);
 			}
 			
 			return to_ret;*/
-			return std::make_shared<LValueStartNode>(identifier());
+			return m_arena.make<LValueStartNode>(identifier());
 		}
 						  
 		case TokenType::VOID: {
-			to_ret = std::make_shared<Void>();
+			to_ret = m_arena.make<Void>();
 			advance();
 			return to_ret;
 		}
 		case TokenType::STR: {
-			to_ret = std::make_shared<StringLiteral>(current_token().value);
+			to_ret = m_arena.make<StringLiteral>(current_token().value);
 			advance();
 			return to_ret;
 		}
 		case TokenType::KEYWORD:
 			if (current_token().value == "this")
-				return std::make_shared<LValueStartNode>(identifier());
+				return m_arena.make<LValueStartNode>(identifier());
 			// INTENTIONAL FALLTHROUGH
 		default:
 			report_error("Expected expression");
@@ -175,24 +306,24 @@ namespace Tusk {
 		return nullptr;
 	}
 
-	std::shared_ptr<LValue> Parser::identifier() {
-		std::shared_ptr<LValue> left = std::make_shared<LValue>();
-		left->name = std::make_shared<Name>(current_token().value);
-		const std::string& name = current_token().value;
+	LValue* Parser::identifier() {
+		LValue* left = m_arena.make<LValue>();
+		left->name = m_arena.make<Name>(current_token().value);
+		std::string_view name = current_token().value;
 		advance();
 		if (current_token().type == TokenType::L_PAR) {
-			std::vector<std::shared_ptr<Expression>> expr{ };
+			std::vector<Expression*> expr{ };
 			advance();
-			const Token* tok = &current_token();
+			Token tok = current_token();
 			while (current_token().type != TokenType::R_PAR && current_token().type != TokenType::_EOF) {
-				tok = &current_token();
+				tok = current_token();
 				expr.push_back(expression());
 
 				if (current_token().type == TokenType::COMMA)
 					advance();
 			}
 			consume(TokenType::R_PAR, "Expected ')'");
-			left->name = std::make_shared<Call>(std::make_shared<Name>(name), expr);
+			left->name = m_arena.make<Call>(m_arena.make<Name>(name), expr);
 		}
 		if (current_token().type == TokenType::DOT) {
 			advance();
@@ -201,12 +332,12 @@ namespace Tusk {
 		return left;
 	}
 
-	std::shared_ptr<Statement> Parser::statement() {
+	Statement* Parser::statement() {
 		if (m_panic_mode)
 			synchronize();
 		bool expect_semicolon = true;
-		std::shared_ptr<Statement> stmt{ nullptr };
-		const Token& tok = current_token();
+		Statement* stmt{ nullptr };
+		Token tok = current_token();
 		if (tok.type == TokenType::L_BRACE) {
 			stmt = compound_statement();
 			expect_semicolon = false;
@@ -219,11 +350,11 @@ namespace Tusk {
 			else if (tok.value == "let")
 				stmt = variable_declaration();
 			else if (tok.value == "break") {
-				stmt = std::make_shared<BreakStatement>();
+				stmt = m_arena.make<BreakStatement>();
 				advance();
 			}
 			else if (tok.value == "continue") {
-				stmt = std::make_shared<ContinueStatement>();
+				stmt = m_arena.make<ContinueStatement>();
 				advance();
 			}
 			else if (tok.value == "return") {
@@ -252,7 +383,7 @@ namespace Tusk {
 			else if (tok.value == "this")
 				stmt = assignment();
 			else {
-				report_error("Unexpected '" + tok.value + "'");
+				report_error(std::format("Unexpected '{}'", tok.value));
 				return nullptr;
 			}
 		}
@@ -260,7 +391,7 @@ namespace Tusk {
 			stmt = assignment();
 		else if (current_token().type == TokenType::SEMICOLON) {
 			advance();
-			return std::make_shared<VoidStatement>();
+			return m_arena.make<VoidStatement>();
 		}
 		else
 			stmt = expression_statement();
@@ -270,22 +401,22 @@ namespace Tusk {
 		return stmt;
 	}
 
-	std::shared_ptr<Statement> Parser::log_statement(bool line) {
+	Statement* Parser::log_statement(bool line) {
 		advance();
-		return std::make_shared<LogStatement>( expression(), line );
+		return m_arena.make<LogStatement>( expression(), line );
 	}
 
-	std::shared_ptr<Statement> Parser::expression_statement() {
-		return std::make_shared<ExpressionStatement>(expression());
+	Statement* Parser::expression_statement() {
+		return m_arena.make<ExpressionStatement>(expression());
 	}
 
-	std::shared_ptr<Statement> Parser::variable_declaration(bool allow_set_value) {
+	Statement* Parser::variable_declaration(bool allow_set_value) {
 		advance();
 		if (current_token().type != TokenType::ID) {
 			report_error("Expected identifier");
 			return nullptr;
 		}
-		std::shared_ptr<VariableDeclaration> declaration = std::make_shared<VariableDeclaration>();
+		VariableDeclaration* declaration = m_arena.make<VariableDeclaration>();
 
 		declaration->variable_name = current_token().value;
 		advance();
@@ -301,65 +432,68 @@ namespace Tusk {
 		return declaration;
 	}
 
-	std::shared_ptr<Statement> Parser::assignment() {
+	Statement* Parser::assignment() {
 		//const std::string& name = current_token().value;
 		//advance();
 		//advance();
-		//return std::make_shared<Assignment>(name, expression());
-		int current_index = m_current_index;
-		std::shared_ptr<LValueStartNode> lval = std::make_shared<LValueStartNode>(identifier());
+		//return m_arena.make<Assignment>(name, expression());
+		LValueStartNode* lval = m_arena.make<LValueStartNode>(identifier());
 
 		if (current_token().type == TokenType::EQUAL) {
 			advance();
-			return std::make_shared<Assignment>(lval, expression());
+			return m_arena.make<Assignment>(lval, expression());
 		}
 		else if (current_token().type == TokenType::PLUS_EQUAL) {
 			advance();
-			return std::make_shared<CompoundAssignment>(lval, expression(), CompoundAssignment::ADD);
+			return m_arena.make<CompoundAssignment>(lval, expression(), CompoundAssignment::ADD);
 		}
 		else if (current_token().type == TokenType::MINUS_EQUAL) {
 			advance();
-			return std::make_shared<CompoundAssignment>(lval, expression(), CompoundAssignment::SUBTRACT);
+			return m_arena.make<CompoundAssignment>(lval, expression(), CompoundAssignment::SUBTRACT);
 		}
 		else if (current_token().type == TokenType::STAR_EQUAL) {
 			advance();
-			return std::make_shared<CompoundAssignment>(lval, expression(), CompoundAssignment::MULTIPLY);
+			return m_arena.make<CompoundAssignment>(lval, expression(), CompoundAssignment::MULTIPLY);
 		}
 		else if (current_token().type == TokenType::SLASH_EQUAL) {
 			advance();
-			return std::make_shared<CompoundAssignment>(lval, expression(), CompoundAssignment::DIVIDE);
+			return m_arena.make<CompoundAssignment>(lval, expression(), CompoundAssignment::DIVIDE);
+		}
+		else if (current_token().type == TokenType::PERCENT_EQUAL) {
+			advance();
+			return m_arena.make<CompoundAssignment>(lval, expression(), CompoundAssignment::MODULO);
 		}
 		else {
-			m_current_index = current_index;
+			m_parsed_operand = lval;						// Not an assignment, the name starts an expression instead
 			return expression_statement();
 		}
 	}
 
-	std::shared_ptr<Statement> Parser::if_statement() {
+	Statement* Parser::if_statement() {
 		advance();
-		std::shared_ptr<Expression> condition = expression();
+		Expression* condition = expression();
 		consume(TokenType::ARROW, "Expected '->'");
-		std::shared_ptr<Statement> body = statement();
-		std::shared_ptr<Statement> else_body = nullptr;
+		Statement* body = statement();
+		Statement* else_body = nullptr;
 		if (current_token().type == TokenType::KEYWORD && current_token().value == "else") {
 			advance();
 			else_body = statement();
 		}
-		return std::make_shared<IfStatement>(condition, body, else_body);
+		return m_arena.make<IfStatement>(condition, body, else_body);
 	}
 
-	std::shared_ptr<Statement> Parser::while_statement() {
+	Statement* Parser::while_statement() {
 		advance();
-		std::shared_ptr<Expression> condition = expression();
+		Expression* condition = expression();
 		consume(TokenType::ARROW, "Expected '->'");
-		std::shared_ptr<Statement> body = statement();
+		Statement* body = statement();
 
-		return std::make_shared<WhileStatement>(condition, body);
+		return m_arena.make<WhileStatement>(condition, body);
 	}
 
-	std::shared_ptr<Statement> Parser::compound_statement() {
+	Statement* Parser::compound_statement() {
 		advance();
-		std::vector<std::shared_ptr<Statement>> statements;
+		std::vector<Statement*> statements;
 		while (current_token().type != TokenType::R_BRACE && current_token().type != TokenType::_EOF)
 			statements.push_back(statement());
 
@@ -370,29 +504,29 @@ namespace Tusk {
 		else
 			advance();
 
-		return std::make_shared<CompoundStatement>(statements);
+		return m_arena.make<CompoundStatement>(statements);
 	}
 
-	std::shared_ptr<Statement> Parser::function() {
+	Statement* Parser::function() {
 		advance();
-		const Token& tok = current_token();
+		Token tok = current_token();
 		consume(TokenType::ID, "Expected identifier");
 
-		std::string name = tok.value;
-		std::vector<std::shared_ptr<Argument>> args;
+		std::string_view name = tok.value;
+		std::vector<Argument> args;
 		if (current_token().type == TokenType::L_PAR) {
 			advance();
-			const Token* tok = &current_token();
+			Token tok = current_token();
 			while (current_token().type != TokenType::R_PAR && current_token().type != TokenType::_EOF) {
-				tok = &current_token();
-				if (tok->type != TokenType::ID) {
+				tok = current_token();
+				if (tok.type != TokenType::ID) {
 					consume(TokenType::ID, "Expected argument name");
 					return nullptr;
 				}
 				else
 					advance();
 				
-				std::shared_ptr<Expression> expr{ nullptr };
+				Expression* expr{ nullptr };
 				if (current_token().type == TokenType::EQUAL) {
 					advance();
 					expr = expression();
@@ -400,26 +534,49 @@ namespace Tusk {
 				if (current_token().type == TokenType::COMMA)
 					advance();
 
-				args.push_back(std::make_shared<Argument>(tok->value, expr));
+				args.push_back(Argument{ std::string(tok.value), expr });
 			}
 			consume(TokenType::R_PAR, "Expected ')'");
 		}
 		consume(TokenType::ARROW, "Expected '->'");
-		std::shared_ptr<Statement> stmt = statement();
+		if (m_preparse && current_token().type == TokenType::L_BRACE) {
+			FunctionDeclaration* function_decl = m_arena.make<FunctionDeclaration>(name, args, nullptr);
+			skip_body(function_decl);
+			return function_decl;
+		}
+		Statement* stmt = statement();
+
+		return m_arena.make<FunctionDeclaration>(name, args, stmt);
+	}
 
-		return std::make_shared<FunctionDeclaration>(name, args, stmt);
+	void Parser::skip_body(FunctionDeclaration* function_decl) {
+		int start = current_token().start_idx;
+		int end = start;
+		function_decl->skipped_line = current_token().line;
+		uint32_t depth = 0;
+		do {
+			if (current_token().type == TokenType::L_BRACE)
+				depth++;
+			else if (current_token().type == TokenType::R_BRACE)
+				depth--;
+			end = current_token().end_idx + 1;
+			advance();
+		} while (depth > 0 && current_token().type != TokenType::_EOF);
+		if (depth > 0)
+			report_error("Expected '}'");
+		function_decl->skipped_body = m_lexer.source().substr(start, end - start);
 	}
 
-	std::shared_ptr<Statement> Parser::return_statement() {
+	Statement* Parser::return_statement() {
 		advance();
 		if(current_token().type != TokenType::SEMICOLON)
-			return std::make_shared<ReturnStatement>(expression());
-		return std::make_shared<ReturnStatement>(nullptr);
+			return m_arena.make<ReturnStatement>(expression());
+		return m_arena.make<ReturnStatement>(nullptr);
 	}
 
-	std::shared_ptr<Statement> Parser::class_declaration() {
+	Statement* Parser::class_declaration() {
 		advance();
-		const Token& tok = current_token();
+		Token tok = current_token();
 		std::string parent{ "" };
 		consume(TokenType::ID, "Expected identifier");
 		if (current_token().type == TokenType::ARROW) {
@@ -428,13 +585,13 @@ namespace Tusk {
 			consume(TokenType::ID, "Expected parent class name");
 		}
 
-		const std::string& name = tok.value;
+		std::string_view name = tok.value;
 		if (current_token().type != TokenType::L_BRACE) {
 			report_error("Expected '{'");
 			return nullptr;
 		}
 		advance();
-		std::vector<std::shared_ptr<Statement>> statements;
+		std::vector<Statement*> statements;
 		while (current_token().type != TokenType::R_BRACE && current_token().type != TokenType::_EOF)
 			statements.push_back(class_body());
 
@@ -445,11 +602,11 @@ namespace Tusk {
 		else
 			advance();
 
-		return std::make_shared<ClassDeclaration>(name, std::make_shared<CompoundStatement>(statements), parent);
+		return m_arena.make<ClassDeclaration>(name, m_arena.make<CompoundStatement>(statements), parent);
 	}
 
-	std::shared_ptr<Statement> Parser::class_body() {
-		std::shared_ptr<Statement> stmt{nullptr};
+	Statement* Parser::class_body() {
+		Statement* stmt{nullptr};
 		if (current_token().type == TokenType::KEYWORD) {
 			if (current_token().value == "fn")
 				stmt = function();
@@ -465,12 +622,12 @@ namespace Tusk {
 		return stmt;
 	}
 
-	std::shared_ptr<Statement> Parser::enum_declaration() {
+	Statement* Parser::enum_declaration() {
 		advance();
-		const Token& tok = current_token();
+		Token tok = current_token();
 		consume(TokenType::ID, "Expected identifier");
 
-		const std::string& name = tok.value;
+		std::string_view name = tok.value;
 		if (current_token().type != TokenType::L_BRACE) {
 			report_error("Expected '{'");
 			return nullptr;
@@ -478,11 +635,11 @@ namespace Tusk {
 		advance();
 		std::vector<std::string> names;
 		while (current_token().type != TokenType::R_BRACE && current_token().type != TokenType::_EOF) {
-			const Token& tok = current_token();
+			Token tok = current_token();
 			consume(TokenType::ID, "Expected identifier");
 			if (current_token().type == TokenType::COMMA)
 				advance();
-			names.push_back(tok.value);
+			names.emplace_back(tok.value);
 		}
 
 		if (current_token().type == TokenType::_EOF) {
@@ -492,6 +649,6 @@ namespace Tusk {
 		else
 			advance();
 
-		return std::make_shared<EnumDeclaration>(name, names);
+		return m_arena.make<EnumDeclaration>(name, names);
 	}
 }
\ No newline at end of file
@@ -1,8 +1,11 @@
 #pragma once
 #include <vector>
+#include <array>
 #include "Token.h"
+#include "Lexer.h"
 #include "Value.h"
 #include <memory>
+#include <new>
 #include <iostream>
 #include "Error.h"
 
@@ -49,6 +52,33 @@ namespace Tusk {
 		virtual std::string to_string() const { return "Tree"; }
 	};
 
+	// Owns the nodes of one parse. Nodes are bump-allocated out of large blocks and all destroyed together
+	// with the arena, so building a tree costs no allocation per node and children are plain pointers
+	class AstArena {
+	public:
+		AstArena() = default;
+		AstArena(const AstArena&) = delete;
+		AstArena& operator=(const AstArena&) = delete;
+		~AstArena();
+
+		template<typename T, typename... Args>
+		T* make(Args&&... args) {
+			static_assert(std::is_base_of_v<ASTNode, T>, "Only tree nodes are allocated in the arena");
+			T* node = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+			m_nodes.push_back(node);
+			return node;
+		}
+		size_t bytes() const { return m_blocks.size() * BLOCK_SIZE; }
+	private:
+		static constexpr size_t BLOCK_SIZE = 64 * 1024;
+		std::vector<std::unique_ptr<std::byte[]>> m_blocks;
+		std::byte* m_next{ nullptr };
+		std::byte* m_end{ nullptr };
+		std::vector<ASTNode*> m_nodes;					// Nodes still own strings and vectors, their destructors run with the arena
+
+		void* allocate(size_t size, size_t alignment);
+	};
+
 	// EXPRESSIONS
 
 	struct Expression : public ASTNode {
@@ -57,11 +87,11 @@ namespace Tusk {
 	};
 
 	struct BinaryOperation : public Expression {
-		std::shared_ptr<Expression> left_expression;
+		Expression* left_expression;
 		Token operator_token;
-		std::shared_ptr<Expression> right_expression;
+		Expression* right_expression;
 
-		BinaryOperation(std::shared_ptr<Expression> left, Token tok, std::shared_ptr<Expression> right)
+		BinaryOperation(Expression* left, Token tok, Expression* right)
 			: left_expression{left}, right_expression{right}, operator_token{tok} {}
 		NodeType get_type() const override { return NodeType::BINARY_OPERATION; }
 		std::string to_string() const override { 
@@ -71,9 +101,9 @@ namespace Tusk {
 
 	struct UnaryOperation : public Expression {
 		Token operator_token;
-		std::shared_ptr<Expression> right_expression;
+		Expression* right_expression;
 
-		UnaryOperation(Token tok, std::shared_ptr<Expression> right)
+		UnaryOperation(Token tok, Expression* right)
 			: right_expression{ right }, operator_token{ tok } {}
 		NodeType get_type() const override { return NodeType::UNARY_OPERATION; }
 		std::string to_string() const override { return "(" + std::to_string((int)operator_token.type) + " " + right_expression->to_string() + ")"; }
@@ -85,11 +115,14 @@ namespace Tusk {
 		Number(const std::variant<int64_t, double>& val) : value{val} {}
 		NodeType get_type() const override { return NodeType::NUMBER_VALUE; }
 		std::string to_string() const override { return std::to_string( std::holds_alternative<int64_t>(value) ? std::get<int64_t>(value) : std::get<double>(value)); }*/
-		Value value;
+		IntegerObject wide;								// An integer too large for the Value, the compiler boxes it on the heap
+		Value value;									// Points to wide if the integer didn't fit
 
 		Number(const Value& val) : value{val} {}
+		Number(int64_t integer) : wide{ integer }, value{ Value::fits_inline(integer) ? Value(integer) : Value(&wide) } {}
+		Number(const Number&) = delete;
 		NodeType get_type() const override { return NodeType::NUMBER_VALUE; }
-		std::string to_string() const override { return std::to_string(value.is<int64_t>() ? value.get<int64_t>() : value.get<double>()); }
+		std::string to_string() const override { return value.is_int() ? std::to_string(value.as_int()) : std::to_string(value.get<double>()); }
 	};
 
 	struct BoolValue : public Expression {
@@ -103,7 +136,7 @@ namespace Tusk {
 	struct StringLiteral : public Expression {
 		std::string value;
 
-		StringLiteral(const std::string& val) : value{ val } {}
+		StringLiteral(std::string_view val) : value{ val } {}
 		NodeType get_type() const override { return NodeType::STRING; }
 		std::string to_string() const override { return '"' + value + '"'; }
 	};
@@ -113,7 +146,7 @@ namespace Tusk {
 	struct Name : public NameOrCall {
 		std::string string;
 
-		Name(const std::string& val = "") : string{val} {}
+		Name(std::string_view val = "") : string{val} {}
 		NodeType get_type() const override { return NodeType::NAME; }
 		std::string to_string() const override { return string; }
 	};
@@ -125,10 +158,10 @@ namespace Tusk {
 	};
 
 	struct LValue : Expression {
-		std::shared_ptr<NameOrCall> name;
-		std::shared_ptr<LValue> access;
+		NameOrCall* name;
+		LValue* access;
 
-		LValue(const std::shared_ptr<Name>& name = {}, const std::shared_ptr<LValue>& access = nullptr) : name{name}, access{access} {}
+		LValue(Name* name = {}, LValue* access = nullptr) : name{name}, access{access} {}
 		NodeType get_type() const override { return NodeType::LVALUE; }
 		std::string to_string() const override {
 			return "LValue " + name->to_string() + (access ? " access " + access->to_string() : "");
@@ -136,8 +169,8 @@ namespace Tusk {
 	};
 
 	struct LValueStartNode : public Expression {
-		std::shared_ptr<LValue> lvalue;
-		LValueStartNode(const std::shared_ptr<LValue>& lvalue = {}) : lvalue{ lvalue } {}
+		LValue* lvalue;
+		LValueStartNode(LValue* lvalue = {}) : lvalue{ lvalue } {}
 		NodeType get_type() const override { return NodeType::LVALUE_START; }
 		std::string to_string() const override {
 			return "LValue Start " + lvalue->to_string();
@@ -145,10 +178,10 @@ namespace Tusk {
 	};
 
 	struct Call : NameOrCall {
-		std::shared_ptr<Name> name;
-		std::vector<std::shared_ptr<Expression>> parameters;
+		Name* name;
+		std::vector<Expression*> parameters;
 
-		Call(const std::shared_ptr<Name>& val, const std::vector<std::shared_ptr<Expression>>& vec) : name{ val }, parameters { vec } {}
+		Call(Name* val, const std::vector<Expression*>& vec) : name{ val }, parameters { vec } {}
 		NodeType get_type() const override { return NodeType::CALL; }
 		std::string to_string() const override {
 			std::string str{ "(" };
@@ -167,44 +200,44 @@ namespace Tusk {
 	};
 
 	struct CompoundStatement : public Statement {
-		std::vector<std::shared_ptr<Statement>> statements;
+		std::vector<Statement*> statements;
 
-		CompoundStatement(const std::vector<std::shared_ptr<Statement>>& stmts) : statements{ stmts } {}
+		CompoundStatement(const std::vector<Statement*>& stmts) : statements{ stmts } {}
 		NodeType get_type() const override { return NodeType::COMPOUND_STATEMENT; }
 		std::string to_string() const override { std::string i; for (const auto& s : statements) i += s->to_string(); return "Compound Statement: " + i; }
 	};
 
 	struct LogStatement : public Statement {
-		std::shared_ptr<Expression> output;
+		Expression* output;
 		bool log_line = false;
 
-		LogStatement(const std::shared_ptr<Expression>& out, bool line = false) : output{ out }, log_line{line} {}
+		LogStatement(Expression* out, bool line = false) : output{ out }, log_line{line} {}
 		NodeType get_type() const override { return NodeType::LOG_STATEMENT; }
 		std::string to_string() const override { return "Log " + output->to_string() + "\n"; }
 	};
 
 	struct ExpressionStatement : public Statement {
-		std::shared_ptr<Expression> expression;
+		Expression* expression;
 
-		ExpressionStatement(const std::shared_ptr<Expression>& expr) : expression{ expr } {}
+		ExpressionStatement(Expression* expr) : expression{ expr } {}
 		NodeType get_type() const override { return NodeType::EXPRESSION_STATEMENT; }
 		std::string to_string() const override { return "Expression " + expression->to_string() + "\n"; }
 	};
 
 	struct VariableDeclaration : public Statement {
 		std::string variable_name{ "" };
-		std::shared_ptr<Expression> value{ nullptr };		// OPTIONAL, WILL DO NULL CHECKING
+		Expression* value{ nullptr };		// OPTIONAL, WILL DO NULL CHECKING
 
-		VariableDeclaration(const std::string& name = "", const std::shared_ptr<Expression>& expr = nullptr) : variable_name{name}, value{expr} {}
+		VariableDeclaration(std::string_view name = "", Expression* expr = nullptr) : variable_name{name}, value{expr} {}
 		NodeType get_type() const override { return NodeType::VARIABLE_DECLARATION; }
 		std::string to_string() const override { return "Variable declaration '" + variable_name + "' " + (value ? value->to_string() : "") + "\n"; }
 	};
 
 	struct Assignment : public Statement {
-		std::shared_ptr<LValueStartNode> lvalue;
-		std::shared_ptr<Expression> expression;
+		LValueStartNode* lvalue;
+		Expression* expression;
 
-		Assignment(const std::shared_ptr<LValueStartNode>& lvalue, const std::shared_ptr<Expression>& expr) : lvalue{ lvalue }, expression{ expr } {}
+		Assignment(LValueStartNode* lvalue, Expression* expr) : lvalue{ lvalue }, expression{ expr } {}
 		NodeType get_type() const override { return NodeType::ASSIGNMENT; }
 		std::string to_string() const override { return "Assignment " + expression->to_string() + " to: " + lvalue->to_string(); }
 	};
@@ -214,24 +247,25 @@ namespace Tusk {
 			ADD,
 			SUBTRACT,
 			MULTIPLY,
-			DIVIDE
+			DIVIDE,
+			MODULO
 		};
-		std::shared_ptr<LValueStartNode> lvalue;
-		std::shared_ptr<Expression> expression;
+		LValueStartNode* lvalue;
+		Expression* expression;
 		Action action;
 
-		CompoundAssignment(const std::shared_ptr<LValueStartNode>& lvalue, const std::shared_ptr<Expression>& expr, Action action)
+		CompoundAssignment(LValueStartNode* lvalue, Expression* expr, Action action)
 			: lvalue{ lvalue }, expression{ expr }, action{action} {}
 		NodeType get_type() const override { return NodeType::COMPOUND_ASSIGNMENT; }
 		std::string to_string() const override { return "Compound assignment " + expression->to_string() + " to: " + lvalue->to_string(); }
 	};
 
 	struct IfStatement : public Statement {
-		std::shared_ptr<Expression> condition;
-		std::shared_ptr<Statement> body;
-		std::shared_ptr<Statement> else_body{ nullptr };
+		Expression* condition;
+		Statement* body;
+		Statement* else_body{ nullptr };
 
-		IfStatement(const std::shared_ptr<Expression>& expr, const std::shared_ptr<Statement>& body, const std::shared_ptr<Statement>& else_body = nullptr)
+		IfStatement(Expression* expr, Statement* body, Statement* else_body = nullptr)
 			: condition{ expr }, body{ body }, else_body{ else_body } {}
 		NodeType get_type() const override { return NodeType::IF_STATEMENT; }
 		std::string to_string() const override { return "If " + condition->to_string() + " then: " + body->to_string() + (else_body ? " else " + else_body->to_string() : ""); }
@@ -244,10 +278,10 @@ namespace Tusk {
 	};
 
 	struct WhileStatement : public Statement {
-		std::shared_ptr<Expression> condition;
-		std::shared_ptr<Statement> body;
+		Expression* condition;
+		Statement* body;
 
-		WhileStatement(const std::shared_ptr<Expression>& expr, const std::shared_ptr<Statement>& body, const std::shared_ptr<Statement>& else_body = nullptr)
+		WhileStatement(Expression* expr, Statement* body, Statement* else_body = nullptr)
 			: condition{ expr }, body{ body } {}
 		NodeType get_type() const override { return NodeType::WHILE_STATEMENT; }
 		std::string to_string() const override { return "While " + condition->to_string() + " do: " + body->to_string(); }
@@ -265,30 +299,32 @@ namespace Tusk {
 
 	struct Argument {
 		std::string name = "";
-		std::shared_ptr<Expression> default_value{ nullptr };
+		Expression* default_value{ nullptr };
 	};
 
 	struct FunctionDeclaration : public Statement {
 		std::string function_name{ "" };
-		std::vector<std::shared_ptr<Argument>> arguments;
-		std::shared_ptr<Statement> body;
+		std::vector<Argument> arguments;
+		Statement* body;								// Null while the body is skipped, see Parser::set_preparse
+		std::string_view skipped_body;					// Source of a skipped body, braces included
+		int skipped_line{ 0 };							// Where the skipped body starts
 
-		FunctionDeclaration(const std::string& name, const std::vector<std::shared_ptr<Argument>>& args, const std::shared_ptr<Statement>& body)
+		FunctionDeclaration(std::string_view name, const std::vector<Argument>& args, Statement* body)
 			: function_name{ name }, arguments{ args }, body{ body } {}
 		NodeType get_type() const override { return NodeType::FUNCTION_DECLARATION; }
 		std::string to_string() const override { 
 			std::string args = "";
 			for (const auto& arg : arguments)
-				args += arg->name + ", ";
-			return "Function declaration '" + function_name + "' (" + args + ") " + body->to_string(); }
+				args += arg.name + ", ";
+			return "Function declaration '" + function_name + "' (" + args + ") " + (body ? body->to_string() : "(Skipped body)"); }
 	};
 
 	struct ClassDeclaration : public Statement {
 		std::string class_name{ "" };
-		std::shared_ptr<CompoundStatement> body;
+		CompoundStatement* body;
 		std::string parent_class{ "" };
 
-		ClassDeclaration(const std::string& name, const std::shared_ptr<CompoundStatement>& body, const std::string& parent_class = "")
+		ClassDeclaration(std::string_view name, CompoundStatement* body, std::string_view parent_class = "")
 			: class_name{ name }, body{ body }, parent_class{ parent_class } {}
 		NodeType get_type() const override { return NodeType::CLASS_DECLARATION; }
 		std::string to_string() const override {
@@ -297,9 +333,9 @@ namespace Tusk {
 	};
 
 	struct ReturnStatement : public Statement {
-		std::shared_ptr<Expression> expr;
+		Expression* expr;
 
-		ReturnStatement(const std::shared_ptr<Expression>& expr) : expr{ expr } {}
+		ReturnStatement(Expression* expr) : expr{ expr } {}
 		NodeType get_type() const override { return NodeType::RETURN_STATEMENT; }
 		std::string to_string() const override { return "Return\n" + expr->to_string(); }
 	};
@@ -308,7 +344,7 @@ namespace Tusk {
 		std::string enum_name{ "" };
 		std::vector<std::string> values;
 
-		EnumDeclaration(const std::string& name, const std::vector<std::string>& values) : enum_name{ name }, values{ values }{}
+		EnumDeclaration(std::string_view name, const std::vector<std::string>& values) : enum_name{ name }, values{ values }{}
 		NodeType get_type() const override { return NodeType::ENUM_DECLARATION; }
 		std::string to_string() const override {
 			std::string str{ "" };
@@ -320,11 +356,14 @@ namespace Tusk {
 
 	// TREE
 	struct AST : ASTNode {
-		std::vector<std::shared_ptr<Statement>> statements;
+		std::vector<Statement*> statements;
+		AstArena& arena;								// Passes that rewrite the tree allocate their nodes here too
+
+		AST(AstArena& arena) : arena{ arena } {}
 		//NodeType get_type() const override { return NodeType::NODE; }
 		std::string to_string() const override { 
 			std::string str{};
-			for (const std::shared_ptr<Statement>& stmt : statements)
+			for (Statement* stmt : statements)
 				str += stmt->to_string() + '\n';
 			return str;
 		}
@@ -332,25 +371,47 @@ namespace Tusk {
 
 	class Parser {
 	public:
-		Parser(const std::vector<Token>& tokens, ErrorHandler& handler) : m_tokens{ tokens }, m_error_handler{ handler } {}
+		// Pulls tokens from the lexer as it goes, the source has to outlive the parse but no token vector is built
+		Parser(Lexer& lexer, ErrorHandler& handler);
+		Parser(Lexer& lexer, ErrorHandler& handler, AstArena& arena);	// Allocates into the arena of an earlier parse
 
-		const std::shared_ptr<AST>& parse();
+		AST* parse();									// The tree lives as long as the parser
+
+		// Braced function bodies are only matched up and kept as source, nothing of them is built until parse_body
+		// is called. Syntax errors in them are only reported then, the source has to outlive the tree. Off by default
+		void set_preparse(bool preparse) { m_preparse = preparse; }
+		// Parses the body of a function the parser skipped into the arena of its tree, returns null if it has errors
+		static Statement* parse_body(FunctionDeclaration* function_decl, AstArena& arena, ErrorHandler& handler);
 	private:
-		const std::vector<Token> m_tokens;
-		int m_current_index{ 0 };
+		static constexpr size_t LOOKAHEAD = 4;			// Tokens held at once, peek() can look at most this far minus one
+		Lexer& m_lexer;
+		std::array<Token, LOOKAHEAD> m_lookahead;		// Ring of the current token and the ones after it
+		size_t m_current{ 0 };
+		bool m_lexical_error{ false };					// Only the errors of the lexer are reported once it found one
+		Expression* m_parsed_operand{ nullptr };		// Parsed while looking for an assignment, factor() returns it next
 		ErrorHandler& m_error_handler;
 
-		std::shared_ptr<AST> m_final_tree{ nullptr };
+		AstArena m_own_arena;
+		AstArena& m_arena;								// The own arena unless the tree of an earlier parse is extended
+		AST* m_final_tree{ nullptr };
 
 		bool m_panic_mode = false;
+		bool m_preparse = false;
 
 		// UTIL
-		void advance() { if(m_current_index < m_tokens.size() - 1) m_current_index++; }
-		const Token& current_token() const { return m_tokens[m_current_index]; }
-		const Token& peek(uint32_t depth = 1) const { return m_tokens[m_current_index + depth]; }
+		Token next_token();								// From the lexer, skipping the errors it already reported
+		void advance() {
+			if (current_token().type == TokenType::_EOF)
+				return;
+			m_lookahead[m_current] = next_token();			// The slot left behind takes the token furthest ahead
+			m_current = (m_current + 1) % LOOKAHEAD;
+		}
+		const Token& current_token() const { return m_lookahead[m_current]; }
+		const Token& peek(uint32_t depth = 1) const { return m_lookahead[(m_current + depth) % LOOKAHEAD]; }
 		void consume(TokenType type, const std::string& error);
 		void report_error(const std::string& error_msg) {
-			m_error_handler.report_error(error_msg, { current_token().line }, ErrorType::COMPILE_ERROR);
+			if (!m_lexical_error)
+				m_error_handler.report_error(error_msg, { current_token().line }, ErrorType::COMPILE_ERROR);
 		}
 		void synchronize() {
 			m_panic_mode = false;
@@ -369,28 +430,33 @@ namespace Tusk {
 		}
 
 		// EXPRESSIONS
-		std::shared_ptr<Expression> expression();
-		std::shared_ptr<Expression> logical_and();
-		std::shared_ptr<Expression> equality();
-		std::shared_ptr<Expression> relational();
-		std::shared_ptr<Expression> arithmetic();
-		std::shared_ptr<Expression> term();
-		std::shared_ptr<Expression> factor();
-		std::shared_ptr<LValue> identifier();
+		Expression* expression();
+		Expression* logical_and();
+		Expression* equality();
+		Expression* relational();
+		Expression* bitwise_or();
+		Expression* bitwise_xor();
+		Expression* bitwise_and();
+		Expression* shift();
+		Expression* arithmetic();
+		Expression* term();
+		Expression* factor();
+		LValue* identifier();
 
 		// STATEMENTS
-		std::shared_ptr<Statement> statement();
-		std::shared_ptr<Statement> compound_statement();
-		std::shared_ptr<Statement> log_statement(bool line = false);
-		std::shared_ptr<Statement> expression_statement();
-		std::shared_ptr<Statement> variable_declaration(bool allow_set_value = true);
-		std::shared_ptr<Statement> assignment();
-		std::shared_ptr<Statement> if_statement();
-		std::shared_ptr<Statement> while_statement();
-		std::shared_ptr<Statement> function();
-		std::shared_ptr<Statement> return_statement();
-		std::shared_ptr<Statement> class_declaration();
-		std::shared_ptr<Statement> class_body();
-		std::shared_ptr<Statement> enum_declaration();
+		Statement* statement();
+		Statement* compound_statement();
+		Statement* log_statement(bool line = false);
+		Statement* expression_statement();
+		Statement* variable_declaration(bool allow_set_value = true);
+		Statement* assignment();
+		Statement* if_statement();
+		Statement* while_statement();
+		Statement* function();
+		void skip_body(FunctionDeclaration* function_decl);	// Brace matches the body and keeps its source
+		Statement* return_statement();
+		Statement* class_declaration();
+		Statement* class_body();
+		Statement* enum_declaration();
 	};
 }
\ No newline at end of file
@@ -0,0 +1,152 @@
+#include "pch.h"
+#include "Scan.h"
+#include <bit>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define TK_SCAN_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TK_TARGET_AVX2
+#else
+#define TK_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace Tusk::Scan {
+	static bool is_whitespace(char character) {
+		return character == ' ' || character == '\t' || character == '\n';
+	}
+
+	static size_t skip_whitespace_scalar(const char* source, size_t from, size_t size, int& lines) {
+		for (; from < size && is_whitespace(source[from]); from++)
+			if (source[from] == '\n')
+				lines++;
+		return from;
+	}
+
+	static size_t find_scalar(const char* source, size_t from, size_t size, char target, int& lines) {
+		for (; from < size && source[from] != target; from++)
+			if (source[from] == '\n')
+				lines++;
+		return from;
+	}
+
+#ifdef TK_SCAN_X86
+	// Bit i of each mask is character i of the block, only the newlines in front of the first match are passed over
+	static int lines_before(uint32_t newlines, uint32_t matches) {
+		return std::popcount(newlines & ((1u << std::countr_zero(matches)) - 1));
+	}
+
+	static size_t skip_whitespace_sse2(const char* source, size_t from, size_t size, int& lines) {
+		const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), newline = _mm_set1_epi8('\n');
+		for (; from + 16 <= size; from += 16) {
+			__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + from));
+			__m128i is_newline = _mm_cmpeq_epi8(block, newline);
+			__m128i whitespace = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, space), _mm_cmpeq_epi8(block, tab)), is_newline);
+			uint32_t others = ~(uint32_t)_mm_movemask_epi8(whitespace) & 0xFFFF;
+			uint32_t newlines = (uint32_t)_mm_movemask_epi8(is_newline);
+			if (others) {
+				lines += lines_before(newlines, others);
+				return from + std::countr_zero(others);
+			}
+			lines += std::popcount(newlines);
+		}
+		return skip_whitespace_scalar(source, from, size, lines);
+	}
+
+	static size_t find_sse2(const char* source, size_t from, size_t size, char target, int& lines) {
+		const __m128i wanted = _mm_set1_epi8(target), newline = _mm_set1_epi8('\n');
+		for (; from + 16 <= size; from += 16) {
+			__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + from));
+			uint32_t matches = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, wanted));
+			uint32_t newlines = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+			if (matches) {
+				lines += lines_before(newlines, matches);
+				return from + std::countr_zero(matches);
+			}
+			lines += std::popcount(newlines);
+		}
+		return find_scalar(source, from, size, target, lines);
+	}
+
+	TK_TARGET_AVX2 static size_t skip_whitespace_avx2(const char* source, size_t from, size_t size, int& lines) {
+		const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), newline = _mm256_set1_epi8('\n');
+		for (; from + 32 <= size; from += 32) {
+			__m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + from));
+			__m256i is_newline = _mm256_cmpeq_epi8(block, newline);
+			__m256i whitespace = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, space), _mm256_cmpeq_epi8(block, tab)), is_newline);
+			uint32_t others = ~(uint32_t)_mm256_movemask_epi8(whitespace);
+			uint32_t newlines = (uint32_t)_mm256_movemask_epi8(is_newline);
+			if (others) {
+				lines += lines_before(newlines, others);
+				return from + std::countr_zero(others);
+			}
+			lines += std::popcount(newlines);
+		}
+		return skip_whitespace_sse2(source, from, size, lines);
+	}
+
+	TK_TARGET_AVX2 static size_t find_avx2(const char* source, size_t from, size_t size, char target, int& lines) {
+		const __m256i wanted = _mm256_set1_epi8(target), newline = _mm256_set1_epi8('\n');
+		for (; from + 32 <= size; from += 32) {
+			__m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + from));
+			uint32_t matches = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, wanted));
+			uint32_t newlines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+			if (matches) {
+				lines += lines_before(newlines, matches);
+				return from + std::countr_zero(matches);
+			}
+			lines += std::popcount(newlines);
+		}
+		return find_sse2(source, from, size, target, lines);
+	}
+
+	static bool has_avx2() {
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 1);
+		bool os_saves_ymm = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+		if (!os_saves_ymm)
+			return false;
+		__cpuidex(info, 7, 0);
+		return info[1] & (1 << 5);
+#else
+		return __builtin_cpu_supports("avx2");
+#endif
+	}
+#endif
+
+	struct Implementation {
+		const char* name;
+		size_t (*skip_whitespace)(const char* source, size_t from, size_t size, int& lines);
+		size_t (*find)(const char* source, size_t from, size_t size, char target, int& lines);
+	};
+
+	static Implementation select() {
+#ifdef TK_SCAN_X86
+		if (has_avx2())
+			return { "avx2", skip_whitespace_avx2, find_avx2 };
+		return { "sse2", skip_whitespace_sse2, find_sse2 };		// Part of every x64 processor
+#else
+		return { "scalar", skip_whitespace_scalar, find_scalar };
+#endif
+	}
+
+	static const Implementation selected = select();
+
+	size_t skip_whitespace(const char* source, size_t from, size_t size, int& lines) {
+		if (from < size && !is_whitespace(source[from]))		// Usually the next token starts right away
+			return from;
+		return selected.skip_whitespace(source, from, size, lines);
+	}
+
+	size_t find(const char* source, size_t from, size_t size, char target, int& lines) {
+		return selected.find(source, from, size, target, lines);
+	}
+
+	const char* implementation() {
+		return selected.name;
+	}
+}
\ No newline at end of file
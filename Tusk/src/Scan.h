@@ -0,0 +1,15 @@
+#pragma once
+#include <cstddef>
+
+// Block scanning for the lexer. Each function looks at 16 or 32 characters at a time with SSE2 or AVX2, picked
+// once from what the processor supports, and falls back to a character loop elsewhere.
+// 'lines' is increased by the number of '\n' passed over before the returned index.
+namespace Tusk::Scan {
+	// Index of the first character at or after 'from' that isn't ' ', '\t' or '\n', 'size' if there is none
+	size_t skip_whitespace(const char* source, size_t from, size_t size, int& lines);
+
+	// Index of the first 'target' at or after 'from', 'size' if there is none
+	size_t find(const char* source, size_t from, size_t size, char target, int& lines);
+
+	const char* implementation();				// "avx2", "sse2" or "scalar"
+}
\ No newline at end of file
@@ -0,0 +1,349 @@
+#include "pch.h"
+#include "Simplifier.h"
+
+namespace Tusk {
+	static bool is_literal(Expression* expression) {
+		switch (expression->get_type()) {
+		case NodeType::NUMBER_VALUE:
+		case NodeType::BOOL_VALUE:
+		case NodeType::STRING:
+		case NodeType::VOID:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	static const Value& number_of(Expression* expression) {
+		return static_cast<Number*>(expression)->value;
+	}
+
+	static bool is_true(Expression* expression) {	// Like the emulator, anything but true is false
+		return expression->get_type() == NodeType::BOOL_VALUE && static_cast<BoolValue*>(expression)->value;
+	}
+
+	static bool literals_equal(Expression* a, Expression* b) {
+		if (a->get_type() == NodeType::NUMBER_VALUE && b->get_type() == NodeType::NUMBER_VALUE) {
+			const Value& x = number_of(a);
+			const Value& y = number_of(b);
+			return x.is_int() && y.is_int() ? x.as_int() == y.as_int() : x.as_number() == y.as_number();
+		}
+		if (a->get_type() != b->get_type())
+			return false;
+		switch (a->get_type()) {
+		case NodeType::STRING:
+			return static_cast<StringLiteral*>(a)->value == static_cast<StringLiteral*>(b)->value;
+		case NodeType::BOOL_VALUE:
+			return static_cast<BoolValue*>(a)->value == static_cast<BoolValue*>(b)->value;
+		default:
+			return true;									// Void
+		}
+	}
+
+	// Evaluates an operation on two literals, returns nullptr if the emulator would report an error instead
+	static Expression* fold(AstArena& arena, TokenType operation, Expression* a, Expression* b) {
+		switch (operation) {
+		case TokenType::EQUAL_EQUAL:
+			return arena.make<BoolValue>(literals_equal(a, b));
+		case TokenType::BANG_EQUAL:
+			return arena.make<BoolValue>(!literals_equal(a, b));
+		case TokenType::PLUS:
+			if (a->get_type() == NodeType::STRING && b->get_type() == NodeType::STRING)
+				return arena.make<StringLiteral>(static_cast<StringLiteral*>(a)->value + static_cast<StringLiteral*>(b)->value);
+			break;
+		default:
+			break;
+		}
+		if (a->get_type() != NodeType::NUMBER_VALUE || b->get_type() != NodeType::NUMBER_VALUE)
+			return nullptr;
+
+		Value result;
+		if (!Emulator::arithmetic(operation, number_of(a), number_of(b), result))
+			return nullptr;									// 'and', 'or', bitwise operators on doubles and integers that need boxing
+		if (result.is<bool>())
+			return arena.make<BoolValue>(result.get<bool>());
+		return arena.make<Number>(result);
+	}
+
+	void Simplifier::simplify(AST* tree) {
+		m_arena = &tree->arena;
+		do {												// Removing a branch can leave a name without assignments, so repeat
+			m_changed = false;
+			m_skipped_bodies = false;
+			m_declarations.clear();
+			m_assigned.clear();
+			m_constants.clear();
+			for (const auto& stmt : tree->statements)
+				count_names(stmt);
+			for (auto& stmt : tree->statements)
+				stmt = statement(stmt);
+		} while (m_changed);
+	}
+
+	void Simplifier::simplify(FunctionDeclaration* function_decl, AstArena& arena) {
+		m_arena = &arena;
+		do {
+			m_changed = false;
+			m_declarations.clear();
+			m_assigned.clear();
+			m_constants.clear();
+			count_names(function_decl);
+			function_declaration(function_decl);
+		} while (m_changed);
+	}
+
+	void Simplifier::count_names(Statement* statement) {
+		switch (statement->get_type()) {
+		case NodeType::VARIABLE_DECLARATION:
+			declare(static_cast<VariableDeclaration*>(statement)->variable_name);
+			break;
+		case NodeType::ASSIGNMENT:
+			assign(static_cast<Assignment*>(statement)->lvalue);
+			break;
+		case NodeType::COMPOUND_ASSIGNMENT:
+			assign(static_cast<CompoundAssignment*>(statement)->lvalue);
+			break;
+		case NodeType::IF_STATEMENT: {
+			IfStatement* stmt = static_cast<IfStatement*>(statement);
+			count_names(stmt->body);
+			if (stmt->else_body)
+				count_names(stmt->else_body);
+			break;
+		}
+		case NodeType::WHILE_STATEMENT:
+			count_names(static_cast<WhileStatement*>(statement)->body);
+			break;
+		case NodeType::COMPOUND_STATEMENT:
+			for (const auto& stmt : static_cast<CompoundStatement*>(statement)->statements)
+				count_names(stmt);
+			break;
+		case NodeType::FUNCTION_DECLARATION: {
+			FunctionDeclaration* function_decl = static_cast<FunctionDeclaration*>(statement);
+			declare(function_decl->function_name);
+			for (const auto& arg : function_decl->arguments)
+				declare(arg.name);
+			if (function_decl->body)
+				count_names(function_decl->body);
+			else
+				m_skipped_bodies = true;
+			break;
+		}
+		case NodeType::CLASS_DECLARATION: {
+			ClassDeclaration* class_decl = static_cast<ClassDeclaration*>(statement);
+			declare(class_decl->class_name);
+			count_names(class_decl->body);
+			break;
+		}
+		case NodeType::ENUM_DECLARATION:
+			declare(static_cast<EnumDeclaration*>(statement)->enum_name);
+			break;
+		default:
+			break;
+		}
+	}
+
+	void Simplifier::assign(LValueStartNode* lvalue) {
+		LValue* lval = lvalue->lvalue;
+		if (!lval->access && lval->name->get_type() == NodeType::NAME)
+			m_assigned.insert(static_cast<Name*>(lval->name)->string);
+	}
+
+	void Simplifier::add_constant(VariableDeclaration* variable_decl) {
+		const std::string& name = variable_decl->variable_name;
+		if (!variable_decl->value || !is_literal(variable_decl->value))
+			return;
+		if (m_declarations[name] != 1 || m_assigned.count(name) || m_emulator.find_global(name) != -1)
+			return;
+		if (m_current_scope == -1 && (!m_whole_program || m_skipped_bodies))
+			return;
+		m_constants[name] = { variable_decl->value, m_current_scope };
+	}
+
+	Expression* Simplifier::expression(Expression* expression) {
+		switch (expression->get_type()) {
+		case NodeType::BINARY_OPERATION:
+			return binary_operation(static_cast<BinaryOperation*>(expression));
+		case NodeType::UNARY_OPERATION:
+			return unary_operation(static_cast<UnaryOperation*>(expression));
+		case NodeType::LVALUE:
+			lvalue(static_cast<LValue*>(expression));
+			return expression;
+		case NodeType::LVALUE_START:
+			return lvalue_start(static_cast<LValueStartNode*>(expression));
+		case NodeType::CALL:
+			for (auto& param : static_cast<Call*>(expression)->parameters)
+				param = this->expression(param);
+			return expression;
+		default:
+			return expression;
+		}
+	}
+
+	Expression* Simplifier::binary_operation(BinaryOperation* operation) {
+		operation->left_expression = expression(operation->left_expression);
+		operation->right_expression = expression(operation->right_expression);
+		if (!is_literal(operation->left_expression) || !is_literal(operation->right_expression))
+			return operation;
+		Expression* folded = fold(*m_arena, operation->operator_token.type, operation->left_expression, operation->right_expression);
+		if (!folded)
+			return operation;
+		m_stats.expressions_folded++;
+		m_changed = true;
+		return folded;
+	}
+
+	Expression* Simplifier::unary_operation(UnaryOperation* operation) {
+		operation->right_expression = expression(operation->right_expression);
+		Expression* right = operation->right_expression;
+		Expression* folded{ nullptr };
+		if (operation->operator_token.type == TokenType::MINUS && right->get_type() == NodeType::NUMBER_VALUE) {
+			const Value& value = number_of(right);
+			if (value.is_int())
+				folded = m_arena->make<Number>((int64_t)(0 - (uint64_t)value.as_int()));	// Wraps like the emulator
+			else
+				folded = m_arena->make<Number>(Value(-value.get<double>()));
+		}
+		else if (operation->operator_token.type == TokenType::BANG && right->get_type() == NodeType::BOOL_VALUE)
+			folded = m_arena->make<BoolValue>(!static_cast<BoolValue*>(right)->value);
+		if (!folded)
+			return operation;
+		m_stats.expressions_folded++;
+		m_changed = true;
+		return folded;
+	}
+
+	Expression* Simplifier::lvalue_start(LValueStartNode* l_value) {
+		LValue* lval = l_value->lvalue;
+		if (!lval->access && lval->name->get_type() == NodeType::NAME) {
+			auto constant = m_constants.find(static_cast<Name*>(lval->name)->string);
+			if (constant != m_constants.end()) {
+				m_stats.constants_propagated++;
+				m_changed = true;
+				return constant->second.value;
+			}
+		}
+		lvalue(lval);
+		return l_value;
+	}
+
+	void Simplifier::lvalue(LValue* l_value) {
+		if (l_value->name->get_type() == NodeType::CALL)
+			for (auto& param : static_cast<Call*>(l_value->name)->parameters)
+				param = expression(param);
+		if (l_value->access)
+			lvalue(l_value->access);
+	}
+
+	Statement* Simplifier::statement(Statement* statement) {
+		switch (statement->get_type()) {
+		case NodeType::LOG_STATEMENT: {
+			LogStatement* stmt = static_cast<LogStatement*>(statement);
+			stmt->output = expression(stmt->output);
+			break;
+		}
+		case NodeType::EXPRESSION_STATEMENT: {
+			ExpressionStatement* stmt = static_cast<ExpressionStatement*>(statement);
+			stmt->expression = expression(stmt->expression);
+			break;
+		}
+		case NodeType::VARIABLE_DECLARATION: {
+			VariableDeclaration* stmt = static_cast<VariableDeclaration*>(statement);
+			if (stmt->value)
+				stmt->value = expression(stmt->value);
+			add_constant(stmt);
+			break;
+		}
+		case NodeType::ASSIGNMENT: {
+			Assignment* stmt = static_cast<Assignment*>(statement);
+			stmt->expression = expression(stmt->expression);
+			lvalue(stmt->lvalue->lvalue);
+			break;
+		}
+		case NodeType::COMPOUND_ASSIGNMENT: {
+			CompoundAssignment* stmt = static_cast<CompoundAssignment*>(statement);
+			stmt->expression = expression(stmt->expression);
+			lvalue(stmt->lvalue->lvalue);
+			break;
+		}
+		case NodeType::IF_STATEMENT:
+			return if_statement(static_cast<IfStatement*>(statement));
+		case NodeType::WHILE_STATEMENT:
+			return while_statement(static_cast<WhileStatement*>(statement));
+		case NodeType::COMPOUND_STATEMENT:
+			compound_statement(static_cast<CompoundStatement*>(statement));
+			break;
+		case NodeType::FUNCTION_DECLARATION:
+			function_declaration(static_cast<FunctionDeclaration*>(statement));
+			break;
+		case NodeType::RETURN_STATEMENT: {
+			ReturnStatement* stmt = static_cast<ReturnStatement*>(statement);
+			if (stmt->expr)
+				stmt->expr = expression(stmt->expr);
+			break;
+		}
+		case NodeType::CLASS_DECLARATION:
+			for (const auto& stmt : static_cast<ClassDeclaration*>(statement)->body->statements) {
+				if (stmt->get_type() == NodeType::FUNCTION_DECLARATION)
+					function_declaration(static_cast<FunctionDeclaration*>(stmt));
+				else if (stmt->get_type() == NodeType::VARIABLE_DECLARATION) {	// Fields, only their default is simplified
+					VariableDeclaration* field = static_cast<VariableDeclaration*>(stmt);
+					if (field->value)
+						field->value = expression(field->value);
+				}
+			}
+			break;
+		default:
+			break;
+		}
+		return statement;
+	}
+
+	Statement* Simplifier::if_statement(IfStatement* stmt) {
+		stmt->condition = expression(stmt->condition);
+		if (!is_literal(stmt->condition)) {
+			stmt->body = statement(stmt->body);
+			if (stmt->else_body)
+				stmt->else_body = statement(stmt->else_body);
+			return stmt;
+		}
+		m_stats.branches_removed++;
+		m_changed = true;
+		if (is_true(stmt->condition))
+			return statement(stmt->body);
+		if (stmt->else_body)
+			return statement(stmt->else_body);
+		return m_arena->make<VoidStatement>();
+	}
+
+	Statement* Simplifier::while_statement(WhileStatement* stmt) {
+		stmt->condition = expression(stmt->condition);
+		if (is_literal(stmt->condition) && !is_true(stmt->condition)) {
+			m_stats.branches_removed++;
+			m_changed = true;
+			return m_arena->make<VoidStatement>();
+		}
+		stmt->body = statement(stmt->body);
+		return stmt;
+	}
+
+	void Simplifier::compound_statement(CompoundStatement* compound) {
+		m_current_scope++;
+		for (auto& stmt : compound->statements)
+			stmt = statement(stmt);
+		m_current_scope--;
+		for (auto it = m_constants.begin(); it != m_constants.end();) {	// Names of the block go out of scope
+			if (it->second.scope_depth > m_current_scope)
+				it = m_constants.erase(it);
+			else
+				it++;
+		}
+	}
+
+	void Simplifier::function_declaration(FunctionDeclaration* function_decl) {
+		for (auto& arg : function_decl->arguments)
+			if (arg.default_value)
+				arg.default_value = expression(arg.default_value);
+		if (function_decl->body)							// Skipped bodies are simplified once they are parsed
+			function_decl->body = statement(function_decl->body);
+	}
+}
\ No newline at end of file
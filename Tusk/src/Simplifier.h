@@ -0,0 +1,62 @@
+#pragma once
+#include <unordered_map>
+#include <unordered_set>
+#include "Parser.h"
+#include "Emulator.h"
+
+namespace Tusk {
+	struct SimplifierStats {
+		uint64_t expressions_folded{ 0 };
+		uint64_t constants_propagated{ 0 };
+		uint64_t branches_removed{ 0 };
+	};
+
+	// Rewrites the tree between parsing and compiling. Folds operations on literals the way the emulator
+	// would evaluate them, replaces uses of 'let' names that are never assigned to with their literal value
+	// and removes 'if' and 'while' bodies whose literal condition can never run them.
+	// Operations that would fail at runtime are left alone so the error is still reported when they run.
+	class Simplifier {
+	public:
+		// Globals are only propagated when the tree is the whole program, in the REPL a later line could assign them
+		Simplifier(const Emulator& emulator, bool whole_program = true) : m_emulator{ emulator }, m_whole_program{ whole_program } {}
+
+		void simplify(AST* tree);
+		void simplify(FunctionDeclaration* function_decl, AstArena& arena);	// A body parsed after the rest of its tree
+		const SimplifierStats& get_stats() const { return m_stats; }
+	private:
+		const Emulator& m_emulator;						// Names it already knows as globals are never propagated
+		bool m_whole_program;
+		SimplifierStats m_stats;
+		AstArena* m_arena{ nullptr };					// Of the tree being simplified, folded literals are allocated there
+		bool m_changed{ false };
+
+		std::unordered_map<std::string, uint32_t> m_declarations;	// How many times each name is declared in the tree
+		std::unordered_set<std::string> m_assigned;		// Names assigned to anywhere in the tree
+		bool m_skipped_bodies{ false };					// Some bodies weren't parsed, globals could be assigned in them
+		struct Constant {
+			Expression* value;
+			int32_t scope_depth;
+		};
+		std::unordered_map<std::string, Constant> m_constants;	// Names in scope with a literal value
+		int32_t m_current_scope = -1;
+
+		void count_names(Statement* statement);
+		void declare(const std::string& name) { m_declarations[name]++; }
+		void assign(LValueStartNode* lvalue);
+		void add_constant(VariableDeclaration* variable_decl);
+
+		// Expressions, return the node that replaces the expression
+		Expression* expression(Expression* expression);
+		Expression* binary_operation(BinaryOperation* operation);
+		Expression* unary_operation(UnaryOperation* operation);
+		Expression* lvalue_start(LValueStartNode* lvalue_start);
+		void lvalue(LValue* l_value);
+
+		// Statements, return the node that replaces the statement
+		Statement* statement(Statement* statement);
+		Statement* if_statement(IfStatement* statement);
+		Statement* while_statement(WhileStatement* statement);
+		void compound_statement(CompoundStatement* statement);
+		void function_declaration(FunctionDeclaration* function_decl);
+	};
+}
\ No newline at end of file
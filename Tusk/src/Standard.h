@@ -2,36 +2,37 @@
 #include <array>
 #include <string>
 #include <Value.h>
+#include "Heap.h"
 #include <iostream>
 
 namespace Tusk::Standard {
 	
 	const std::array<std::string, 2> standard_functions = {"read", "List"};
 
-	inline FunctionReturn read(int arg_count, Value* arguments) {
+	inline FunctionReturn read(Heap& heap, int arg_count, Value* arguments) {
 		std::string str;
 		std::getline(std::cin, str);
-		return FunctionReturn(FunctionResult::OK, Value(std::make_shared<StringObject>(str)));
+		return FunctionReturn(FunctionResult::OK, heap.make_string(str));
 	}
 
-	inline FunctionReturn List(int arg_count, Value* arguments) {
+	inline FunctionReturn List(Heap& heap, int arg_count, Value* arguments) {
 		std::vector<Value> values;
 		for (int i = 0; i < arg_count; i++) {
 			values.push_back(arguments[i + 1]);
 		}
-		return FunctionReturn(FunctionResult::OK, Value(std::make_shared<ListValue>(values)));
+		return FunctionReturn(FunctionResult::OK, Value(heap.allocate<ListValue>(values)));
 	}
 
 	namespace ListUtils {
-		inline FunctionReturn append(const std::shared_ptr<ListValue>& list, uint8_t arg_count, Value* args) {
+		inline FunctionReturn append(ListValue* list, uint8_t arg_count, Value* args) {
 			for (int i = 0; i < arg_count; i++) {
 				list->values.push_back(args[i]);
 			}
 			return FunctionReturn(FunctionResult::OK, Value(list));
 		}
-		inline FunctionReturn add(const std::shared_ptr<ListValue>& list, uint8_t arg_count, Value* args) {
+		inline FunctionReturn add(ListValue* list, uint8_t arg_count, Value* args) {
 			for (int i = 0; i < arg_count; i++) {
-				if (args[i].is<std::shared_ptr<ValueObject>>() && args[i].get_object_type() == ObjectType::LIST)
+				if (args[i].is_object(ObjectType::LIST))
 					for (auto& i : args[i].get_object<ListValue>()->values)
 						list->values.push_back(i);
 				else
@@ -39,7 +40,7 @@ namespace Tusk::Standard {
 			}
 			return FunctionReturn(FunctionResult::OK, Value(list));
 		}
-		inline FunctionReturn pop(const std::shared_ptr<ListValue>& list, uint8_t arg_count, Value* args) {
+		inline FunctionReturn pop(ListValue* list, uint8_t arg_count, Value* args) {
 			if (arg_count != 0)
 				return  FunctionReturn(FunctionResult::ERROR, list->values[args[0].get<int64_t>()], "Method pop() expects 0 arguments");
 			else {
@@ -48,7 +49,7 @@ namespace Tusk::Standard {
 				return FunctionReturn(FunctionResult::OK, top);
 			}
 		}
-		inline FunctionReturn size(const std::shared_ptr<ListValue>& list, uint8_t arg_count, Value* args) {
+		inline FunctionReturn size(ListValue* list, uint8_t arg_count, Value* args) {
 			if (arg_count != 0)
 				return  FunctionReturn(FunctionResult::ERROR, Value(), "Method size() expects 0 arguments");
 			else {
@@ -56,9 +57,9 @@ namespace Tusk::Standard {
 			}
 		}
 		inline FunctionReturn iterate() {}
-		inline FunctionReturn get(const std::shared_ptr<ListValue>& list, uint8_t arg_count, Value* args) {
+		inline FunctionReturn get(ListValue* list, uint8_t arg_count, Value* args) {
 			if (arg_count == 1)
-				if (args[0].get_type() != typeid(int64_t))
+				if (!args[0].is<int64_t>())
 					return FunctionReturn(FunctionResult::ERROR, Value(), "Only integers allowed as index");
 				else
 					if (args[0].get<int64_t>() > list->values.size())
@@ -1,5 +1,5 @@
 #pragma once
-#include <string>
+#include <string_view>
 
 enum class TokenType {
 	L_PAR, R_PAR, L_BRACE, R_BRACE, L_BRACK, R_BRACK, COMMA,		// 
@@ -19,7 +19,7 @@ enum class TokenType {
 
 struct Token {
 	TokenType type = TokenType::_EOF;
-	std::string value = "";
+	std::string_view value;											// Slice of the source, which outlives the tokens
 	int line = 0;
 	int start_idx = 0;
 	int end_idx = 0;
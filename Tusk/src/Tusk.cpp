@@ -3,6 +3,7 @@
 #include <string>
 #include "Lexer.h"
 #include "Parser.h"
+#include "Simplifier.h"
 #include "Compiler.h"
 #include "Emulator.h"
 
@@ -32,8 +33,9 @@ int main()
                 std::cout << (int)tok.type << '\n';
             }
 
-            Parser parser(tokens, handler);
-            const std::shared_ptr<AST>& ast = parser.parse();
+            Lexer parser_lexer(in, handler);             // The parser lexes again as it goes, the tokens above are only printed
+            Parser parser(parser_lexer, handler);
+            AST* ast = parser.parse();
             if (handler.has_errors())
                 for (const Error& error : handler.get_errors()) {
                     std::cout << ErrorHandler::string_basic_with_type(error) << '\n';
@@ -42,7 +44,10 @@ int main()
                 std::cout << "NODES:\n";
                 std::cout << ast->to_string() << '\n';
 
-                Compiler compiler(ast, handler);
+                Simplifier simplifier(emulator, false);     // Later lines can still assign the globals of this one
+                simplifier.simplify(ast);
+
+                Compiler compiler(ast, emulator, handler);
                 
                 const Unit& byte_code = compiler.compile();
                 if (handler.has_errors())
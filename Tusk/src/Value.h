@@ -1,13 +1,20 @@
 #pragma once
-#include <variant>
+#include <cstdint>
+#include <cstring>
 #include <memory>
 #include <iostream>
+#include <string>
+#include <vector>
 #include <unordered_map>
 #include <functional>
+#include <type_traits>
+#include <algorithm>
 
 namespace Tusk {
 	struct Unit;
-	
+	struct FunctionObject;
+	class Heap;
+
 	enum class ObjectType {
 		OBJECT,
 		STRING,
@@ -15,53 +22,331 @@ namespace Tusk {
 		CLASS,
 		INSTANCE,
 		ENUM,
-		VOID,
 		ENUM_VALUE,
 		STANDARD_FN,
-		LIST
+		LIST,
+		INTEGER
 	};
 
+	enum class ValueType {
+		INT,
+		DOUBLE,
+		BOOL,
+		VOID,
+		OBJECT
+	};
+
+	// Every object is owned by the Heap that allocated it, values only hold raw pointers
 	struct ValueObject {
+		virtual ~ValueObject() = default;
 		virtual ObjectType get_type() const { return ObjectType::OBJECT; }
+
+		// GC HEADER
+		ValueObject* next{ nullptr };						// Intrusive list of the generation the object belongs to
+		uint32_t size{ 0 };									// Bytes accounted to this object when it was allocated
+		bool marked{ false };
+		bool old{ false };									// Survived a collection and lives in the old generation
+		bool remembered{ false };							// Old object that may point into the nursery
 	};
 
-	struct VoidObject : public ValueObject {
-		ObjectType get_type() const override { return ObjectType::VOID; }
+	// An integer that doesn't fit the payload of a Value, see Heap::make_int
+	struct IntegerObject : public ValueObject {
+		int64_t value;
+
+		IntegerObject(int64_t value = 0) : value{ value } {}
+		ObjectType get_type() const override { return ObjectType::INTEGER; }
 	};
 
-	struct StringObject : public ValueObject {
-		std::string string;
+	// A Value is NaN-boxed into 64 bits. Doubles are stored as they are, everything else lives in the
+	// payload of a quiet NaN: integers (48 bits, sign extended), booleans, void and object pointers (48 bits).
+	// The rest of the int64 range is boxed in an IntegerObject, is<int64_t>() is only true for inline integers
+	// while is_int() and as_int() take both
+	class Value {
+	public:
+		static constexpr int64_t INT_MAX_VALUE = (int64_t(1) << 47) - 1;
+		static constexpr int64_t INT_MIN_VALUE = -(int64_t(1) << 47);
+
+		static constexpr bool fits_inline(int64_t integer) { return integer >= INT_MIN_VALUE && integer <= INT_MAX_VALUE; }
+
+		// The integer must fit inline, Heap::make_int boxes the ones that don't
+		Value(int64_t integer) : m_bits{ TAG_INT | ((uint64_t)integer & PAYLOAD_MASK) } {}
+		Value(double real) { set_double(real); }
+		Value(bool boolean) : m_bits{ boolean ? TAG_TRUE : TAG_FALSE } {}
+		Value(ValueObject* object) : m_bits{ OBJECT_BITS | (uint64_t)(uintptr_t)object } {}
+		Value(std::nullptr_t) : m_bits{ TAG_VOID } {}
+		Value() = default;
+
+		template<typename T>
+		bool is() const {
+			if constexpr (std::is_same_v<T, double>)
+				return (m_bits & QNAN) != QNAN;
+			else if constexpr (std::is_same_v<T, int64_t>)
+				return (m_bits & TAG_MASK) == TAG_INT;
+			else if constexpr (std::is_same_v<T, bool>)
+				return (m_bits & TAG_MASK) == TAG_BOOL;
+			else if constexpr (std::is_same_v<T, ValueObject*>)
+				return is_object();
+			else
+				static_assert(sizeof(T) == 0, "Value cannot hold this type");
+		}
+
+		template<typename T>
+		T get() const {
+			if constexpr (std::is_same_v<T, double>) {
+				double real;
+				std::memcpy(&real, &m_bits, sizeof(double));
+				return real;
+			}
+			else if constexpr (std::is_same_v<T, int64_t>)
+				return (int64_t)(m_bits << 16) >> 16;			// Sign extend the 48 bit payload
+			else if constexpr (std::is_same_v<T, bool>)
+				return m_bits == TAG_TRUE;
+			else if constexpr (std::is_same_v<T, ValueObject*>)
+				return (ValueObject*)(uintptr_t)(m_bits & PAYLOAD_MASK);
+			else
+				static_assert(sizeof(T) == 0, "Value cannot hold this type");
+		}
+
+		bool is_void() const { return m_bits == TAG_VOID; }
+		bool is_object() const { return (m_bits & OBJECT_BITS) == OBJECT_BITS; }
+		bool is_object(ObjectType type) const { return is_object() && get<ValueObject*>()->get_type() == type; }
+		bool is_int() const { return is<int64_t>() || is_object(ObjectType::INTEGER); }
+		bool is_number() const { return is<double>() || is_int(); }
 
-		StringObject(const std::string& str = "") : string{ str } {}
+		template<typename T>
+		T* get_object() const {
+			return static_cast<T*>(get<ValueObject*>());
+		}
+
+		ObjectType get_object_type() const {
+			return get<ValueObject*>()->get_type();
+		}
+
+		ValueType get_type() const {
+			if (is<double>())
+				return ValueType::DOUBLE;
+			if (is_object())
+				return ValueType::OBJECT;
+			switch (m_bits & TAG_MASK) {
+			case TAG_INT: return ValueType::INT;
+			case TAG_BOOL: return ValueType::BOOL;
+			default: return ValueType::VOID;
+			}
+		}
+
+		// Value of an inline or boxed integer
+		int64_t as_int() const { return is<int64_t>() ? get<int64_t>() : get_object<IntegerObject>()->value; }
+		// Numeric value of an int or double
+		double as_number() const { return is<double>() ? get<double>() : (double)as_int(); }
+
+		// Identity comparison, true if both values have the exact same encoding
+		bool same(const Value& other) const { return m_bits == other.m_bits; }
+		uint64_t bits() const { return m_bits; }
+
+		friend std::ostream& operator<<(std::ostream& os, const Value& value);
+	private:
+		static constexpr uint64_t SIGN_BIT = 0x8000000000000000;
+		static constexpr uint64_t QNAN = 0x7ffc000000000000;
+		static constexpr uint64_t CANONICAL_NAN = 0x7ff8000000000000;
+		static constexpr uint64_t PAYLOAD_MASK = 0x0000ffffffffffff;
+		static constexpr uint64_t TAG_MASK = 0xffff000000000000;
+
+		static constexpr uint64_t TAG_INT = QNAN | (uint64_t(1) << 48);
+		static constexpr uint64_t TAG_BOOL = QNAN | (uint64_t(2) << 48);
+		static constexpr uint64_t TAG_FALSE = TAG_BOOL;
+		static constexpr uint64_t TAG_TRUE = TAG_BOOL | 1;
+		static constexpr uint64_t TAG_VOID = QNAN | (uint64_t(3) << 48);
+		static constexpr uint64_t OBJECT_BITS = SIGN_BIT | QNAN;
+
+		void set_double(double real) {
+			if (real != real)
+				m_bits = CANONICAL_NAN;								// Real NaNs must never look like a boxed value
+			else
+				std::memcpy(&m_bits, &real, sizeof(double));
+		}
+
+		uint64_t m_bits{ TAG_VOID };
+	};
+	static_assert(sizeof(Value) == 8, "Value must stay NaN-boxed into 64 bits");
+
+	// A string is either flat or a rope, the concatenation of left and right. Concatenating long strings
+	// only makes a rope node, the characters are copied once when the rope is first read and it becomes flat.
+	// Short strings are kept inline by std::string itself
+	struct StringObject : public ValueObject {
+		std::string string;									// Empty while the string is a rope, read it through get()
+		size_t hash{ 0 };									// Only computed for interned strings
+		bool interned{ false };								// The one object with these contents, see Heap::intern
+		StringObject* left{ nullptr };						// Both set while the string is a rope
+		StringObject* right{ nullptr };
+		size_t length{ 0 };
+
+		StringObject(const std::string& str = "") : string{ str }, length{ str.size() } {}
+		StringObject(StringObject* left, StringObject* right) : left{ left }, right{ right }, length{ left->length + right->length } {}
 		ObjectType get_type() const override { return ObjectType::STRING; }
+
+		bool is_rope() const { return left != nullptr; }
+		const std::string& get() {
+			if (is_rope())
+				flatten();
+			return string;
+		}
+	private:
+		void flatten() {									// Iterative, ropes built in a loop are thousands of nodes deep
+			string.reserve(length);
+			std::vector<const StringObject*> pending{ right, left };
+			while (!pending.empty()) {
+				const StringObject* part = pending.back();
+				pending.pop_back();
+				if (part->is_rope()) {
+					pending.push_back(part->right);
+					pending.push_back(part->left);
+				}
+				else
+					string += part->string;
+			}
+			left = nullptr;									// The parts can be collected now
+			right = nullptr;
+		}
+	};
+
+	// Member names are interned strings, so maps keyed by them hash the cached hash and compare pointers
+	struct InternedHash {
+		size_t operator()(const StringObject* name) const { return name->hash; }
+	};
+	template<typename T>
+	using NameMap = std::unordered_map<const StringObject*, T, InternedHash>;
+
+	// Compiles the body of a function the first time it is called, see Compiler::set_lazy
+	struct LazyBody {
+		virtual ~LazyBody() = default;
+		virtual bool compile(FunctionObject& function) = 0;	// Sets code_unit, false if the body has errors
 	};
 
 	struct FunctionObject : public ValueObject {
 		std::string function_name{ "" };
 		uint32_t arg_count{ 0 };
-		std::shared_ptr<Unit> code_unit;
+		std::shared_ptr<Unit> code_unit;					// Null until the lazy body is compiled
+		std::unique_ptr<LazyBody> lazy_body;
 
 		FunctionObject(const std::string& str = "", uint32_t arg_count = 0) : function_name{ str }, arg_count{ arg_count } {}
 		ObjectType get_type() const override { return ObjectType::FUNCTION; }
 	};
 
-	class Value;
+	// Hidden class describing the field layout of instances. Shapes form a transition tree rooted at the
+	// class: instances that got the same fields added in the same order share a shape, so a field name
+	// resolves to the same slot index for all of them.
+	struct Shape {
+		uint32_t id;										// Unique for the lifetime of the process, safe to use as a cache key
+		Shape* parent{ nullptr };
+		std::vector<const StringObject*> field_names;		// Field name of every slot, in slot order
+		NameMap<uint32_t> slots;
+		NameMap<std::unique_ptr<Shape>> transitions;
+
+		Shape(Shape* parent = nullptr) : id{ s_next_id++ }, parent{ parent } {}
+
+		uint32_t slot_count() const { return (uint32_t)field_names.size(); }
+		int32_t find(const StringObject* name) const {
+			auto slot = slots.find(name);
+			return slot == slots.end() ? -1 : (int32_t)slot->second;
+		}
+		// Returns the shape with one more field, creating the transition the first time
+		Shape* add_field(const StringObject* name) {
+			std::unique_ptr<Shape>& next = transitions[name];
+			if (!next) {
+				next = std::make_unique<Shape>(this);
+				next->field_names = field_names;
+				next->slots = slots;
+				next->field_names.push_back(name);
+				next->slots[name] = slot_count();
+			}
+			return next.get();
+		}
+	private:
+		inline static uint32_t s_next_id{ 0 };
+	};
+
 	struct ClassObject : public ValueObject {
 		std::string class_name{ "" };
-		std::unordered_map<std::string, Value> public_members;
-		std::unordered_map<std::string, Value> private_members;
+		NameMap<Value> methods;
+		std::unique_ptr<Shape> root_shape;					// Owns every shape instances of this class go through
+		Shape* instance_shape;								// Shape of a new instance, made of the declared fields
+		std::vector<Value> field_defaults;					// Initial slot values of a new instance
+		uint32_t expected_slots{ 0 };						// Most fields an instance has grown to, used to size new instances
 
-		ClassObject(const std::string& str = "") : class_name{ str } {}
+		ClassObject(const std::string& str = "") : class_name{ str }, root_shape{ std::make_unique<Shape>() }, instance_shape{ root_shape.get() } {}
 		ObjectType get_type() const override { return ObjectType::CLASS; }
+
+		void declare_field(const StringObject* name, const Value& default_value) {
+			int32_t slot = instance_shape->find(name);
+			if (slot != -1) {
+				field_defaults[slot] = default_value;
+				return;
+			}
+			instance_shape = instance_shape->add_field(name);
+			field_defaults.push_back(default_value);
+			expected_slots = std::max(expected_slots, instance_shape->slot_count());
+		}
 	};
 
+	// An instance is a shape plus a flat array of slots. The slots are allocated inline, right after the
+	// object, and only move to a separate buffer if fields are added past the inline capacity.
 	struct InstanceObject : public ValueObject {
 		ClassObject& class_ref;
-		std::unordered_map<std::string, Value> public_members;
-		std::unordered_map<std::string, Value> private_members;
-
-		InstanceObject(ClassObject& class_ref) : class_ref{ class_ref } { }
+		Shape* shape;
+		Value* slots;
+		uint32_t capacity;
+
+		InstanceObject(ClassObject& class_ref, uint32_t inline_capacity)
+			: class_ref{ class_ref }, shape{ class_ref.instance_shape }, slots{ reinterpret_cast<Value*>(this + 1) }, capacity{ inline_capacity } {
+			for (uint32_t i = 0; i < class_ref.field_defaults.size(); i++)
+				slots[i] = class_ref.field_defaults[i];
+		}
 		ObjectType get_type() const override { return ObjectType::INSTANCE; }
+
+		// Bytes to allocate after the object for its inline slots
+		static size_t inline_size(uint32_t capacity) { return capacity * sizeof(Value); }
+		static void operator delete(void* memory) { ::operator delete(memory); }
+
+		// Gets a field or a method, returns false if the instance has neither
+		bool get_member(const StringObject* name, Value& out) const {
+			int32_t slot = shape->find(name);
+			if (slot != -1) {
+				out = slots[slot];
+				return true;
+			}
+			auto method = class_ref.methods.find(name);
+			if (method == class_ref.methods.end())
+				return false;
+			out = method->second;
+			return true;
+		}
+		void set_field(const StringObject* name, const Value& value) {
+			int32_t slot = shape->find(name);
+			if (slot == -1)
+				append_field(shape->add_field(name), value);
+			else
+				slots[slot] = value;
+		}
+		// Moves to next_shape, which must be a transition from the current shape, and stores value in the new slot
+		void append_field(Shape* next_shape, const Value& value) {
+			shape = next_shape;
+			if (shape->slot_count() > capacity)
+				grow();
+			class_ref.expected_slots = std::max(class_ref.expected_slots, shape->slot_count());
+			slots[shape->slot_count() - 1] = value;
+		}
+	private:
+		std::unique_ptr<Value[]> m_overflow;
+
+		void grow() {
+			uint32_t new_capacity = std::max(capacity * 2, 4u);
+			std::unique_ptr<Value[]> overflow = std::make_unique<Value[]>(new_capacity);
+			for (uint32_t i = 0; i < capacity; i++)
+				overflow[i] = slots[i];
+			m_overflow = std::move(overflow);
+			slots = m_overflow.get();
+			capacity = new_capacity;
+		}
 	};
 
 	struct EnumObject : public ValueObject {
@@ -73,10 +358,10 @@ namespace Tusk {
 	};
 
 	struct EnumValue : public ValueObject {
-		std::shared_ptr<EnumObject> enum_obj;
+		EnumObject* enum_obj;
 		std::string enum_name;
 
-		EnumValue(const std::shared_ptr<EnumObject>& enum_obj, const std::string& enum_name) : enum_obj{ enum_obj }, enum_name{ enum_name } { }
+		EnumValue(EnumObject* enum_obj, const std::string& enum_name) : enum_obj{ enum_obj }, enum_name{ enum_name } { }
 		ObjectType get_type() const override { return ObjectType::ENUM_VALUE; }
 	};
 
@@ -87,100 +372,59 @@ namespace Tusk {
 		ObjectType get_type() const override { return ObjectType::LIST; }
 	};
 
-	
-
-	class Value {
-	public:
-		Value(int64_t integer) : m_value{ integer } {}
-		Value(double real) : m_value{ real } {}
-		Value(bool boolean) : m_value{ boolean } {}
-		Value(const std::shared_ptr<ValueObject>& object) : m_value{ object } {}
-		Value(const std::string& str) : m_value{ std::make_shared<StringObject>(str) } {}
-		Value(nullptr_t) : m_value{ std::make_shared<VoidObject>() } {}
-		Value() = default;
-
-		template<typename T>
-		bool is() const {
-			return std::holds_alternative<T>(m_value);
-		}
-
-		template<typename T>
-		T get() const {
-			return std::get<T>(m_value);
-		}
-
-		template<typename T>
-		std::shared_ptr<T> get_object() const {
-			return std::static_pointer_cast<T>(std::get<std::shared_ptr<ValueObject>>(m_value));
-		}
-
-		ObjectType get_object_type() const {
-			return std::get<std::shared_ptr<ValueObject>>(m_value)->get_type();
-		}
-
-		template<typename T>
-		T get_if_is() const {
-			if (is<T>())
-				return std::get<T>(m_value);
-			else
-				return nullptr;
-		}
-
-		std::type_info const& get_type() {
-			return std::visit([](auto&& x)->decltype(auto) { return typeid(x); }, m_value);
-		}
-
-		void set(const std::variant<int64_t, double, bool, std::shared_ptr<ValueObject>>& val) { m_value = val; }
-
-		friend std::ostream& operator<<(std::ostream& os, const Value& value) {
-			if (value.is<int64_t>())
-				os << value.get<int64_t>();
-			else if (value.is<double>())
-				os << value.get<double>();
-			else if (value.is<bool>())
-				os << (value.get<bool>() ? "true" : "false");
-			else if (value.is<std::shared_ptr<ValueObject>>()) {
-				switch (value.get_object_type()) {
-				case ObjectType::STRING:
-					os << value.get_object<StringObject>()->string;
-					break;
-				case ObjectType::VOID:
-					os << "void";
-					break;
-				case ObjectType::FUNCTION:
-					os << "<function " + value.get_object<FunctionObject>()->function_name + ">";
-					break;
-				case ObjectType::STANDARD_FN:
-					os << "<std function>";
-					break;
-				case ObjectType::CLASS:
-					os << "<class " + value.get_object<ClassObject>()->class_name + ">";
-					break;
-				case ObjectType::INSTANCE:
-					os << "<" + value.get_object<InstanceObject>()->class_ref.class_name + " instance>";
-					break;
-				case ObjectType::ENUM:
-					os << "<enum " + value.get_object<EnumObject>()->name + ">";
-					break;
-				case ObjectType::ENUM_VALUE:
-					os << value.get_object<EnumValue>()->enum_obj->name + "." + value.get_object<EnumValue>()->enum_name;
-					break;
-				case ObjectType::LIST:
-					os << '[';
-					for (auto& i : value.get_object<ListValue>()->values)
-						os << i << ", ";
-					os << ']';
-					break;
-			}
+	inline std::ostream& operator<<(std::ostream& os, const Value& value) {
+		switch (value.get_type()) {
+		case ValueType::INT:
+			os << value.get<int64_t>();
+			break;
+		case ValueType::DOUBLE:
+			os << value.get<double>();
+			break;
+		case ValueType::BOOL:
+			os << (value.get<bool>() ? "true" : "false");
+			break;
+		case ValueType::VOID:
+			os << "void";
+			break;
+		case ValueType::OBJECT:
+			switch (value.get_object_type()) {
+			case ObjectType::STRING:
+				os << value.get_object<StringObject>()->get();
+				break;
+			case ObjectType::FUNCTION:
+				os << "<function " + value.get_object<FunctionObject>()->function_name + ">";
+				break;
+			case ObjectType::STANDARD_FN:
+				os << "<std function>";
+				break;
+			case ObjectType::CLASS:
+				os << "<class " + value.get_object<ClassObject>()->class_name + ">";
+				break;
+			case ObjectType::INSTANCE:
+				os << "<" + value.get_object<InstanceObject>()->class_ref.class_name + " instance>";
+				break;
+			case ObjectType::ENUM:
+				os << "<enum " + value.get_object<EnumObject>()->name + ">";
+				break;
+			case ObjectType::ENUM_VALUE:
+				os << value.get_object<EnumValue>()->enum_obj->name + "." + value.get_object<EnumValue>()->enum_name;
+				break;
+			case ObjectType::INTEGER:
+				os << value.get_object<IntegerObject>()->value;
+				break;
+			case ObjectType::LIST:
+				os << '[';
+				for (auto& i : value.get_object<ListValue>()->values)
+					os << i << ", ";
+				os << ']';
+				break;
+			default:
+				break;
 			}
-			return os;
+			break;
 		}
-
-		operator std::variant<int64_t, double, bool, std::shared_ptr<ValueObject>>() const { return m_value; }
-		const std::variant<int64_t, double, bool, std::shared_ptr<ValueObject>>& get_variant() const { return m_value; }
-	private:
-		std::variant<int64_t, double, bool, std::shared_ptr<ValueObject>> m_value;
-	};
+		return os;
+	}
 
 	namespace Standard {
 		enum class FunctionResult {
@@ -195,7 +439,7 @@ namespace Tusk {
 		};
 	}
 
-	using StandardFnType = std::function<Standard::FunctionReturn(int, Value*)>;
+	using StandardFnType = std::function<Standard::FunctionReturn(Heap&, int, Value*)>;
 	struct StandardFn : public ValueObject {
 		StandardFnType function;
 
@@ -10,6 +10,16 @@ workspace "Tusk"
 
 outputdir = "%{cfg.buildcfg}-%{cfg.system}-%{cfg.architecture}"
 
+newoption {
+	trigger = "switch-dispatch",
+	description = "Use a switch to dispatch bytecode instead of computed goto on GCC and Clang"
+}
+
+newoption {
+	trigger = "dispatch-stats",
+	description = "Count dispatched instructions, reported by Thorn --opt-stats"
+}
+
 project "Tusk"
 	location "Tusk"
 	kind "StaticLib"
@@ -34,6 +44,12 @@ project "Tusk"
 	
 	systemversion "latest"
 
+	filter "options:switch-dispatch"
+		defines { "TK_SWITCH_DISPATCH" }
+
+	filter "options:dispatch-stats"
+		defines { "TK_DISPATCH_STATS" }
+
 	filter "configurations:Debug"
 		runtime "Debug"
 		symbols "on"